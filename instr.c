@@ -13,16 +13,196 @@
  *
  * rinstr(haystack, needle, startpos)
  *    search backwards from the specified maximum position
+ *
+ * instr(haystack, needle, startpos, occurrence)
+ * rinstr(haystack, needle, startpos, occurrence)
+ *    find the nth occurrence in the direction of the search instead
+ *    of the first; each one starts after the one before, so they
+ *    may overlap
+ *
+ * instr_nocase(haystack, needle[, startpos[, occurrence]])
+ * rinstr_nocase(haystack, needle[, startpos[, occurrence]])
+ *    like instr and rinstr, except letters match in either case;
+ *    blobs fold ASCII letters only, and text also the other Latin,
+ *    Greek, Cyrillic and Armenian letters, with simple case folding
+ *    that leaves out the few mappings that change a character's size
+ *
+ * instr_any(haystack, needle1, needle2, ...)
+ *    the position of the first occurrence of any of the needles;
+ *    NULL needles are left out
+ *
+ * instr_which(haystack, needle1, needle2, ...)
+ *    which needle that is, counting from 1; when several needles
+ *    match at the same position, the first one of them in the list
+ *
+ * contains(haystack, needle)
+ * starts_with(haystack, needle)
+ * ends_with(haystack, needle)
+ *    1 if the needle occurs anywhere in the haystack, at its start,
+ *    or at its end, and 0 if not; these only compare bytes, so they
+ *    don't check the encoding of text
+ *
+ * instr_bytes(haystack, needle[, startpos])
+ * rinstr_bytes(haystack, needle[, startpos])
+ *    like instr and rinstr, except positions count bytes,
+ *    of the UTF-8 form for text
+ *
+ * substr_bytes(x, start[, length])
+ *    like substr, except start and length count bytes; for text,
+ *    neither end may fall inside a character
+ *
+ * substr_before(haystack, separator)
+ * substr_after(haystack, separator)
+ *    the part of the haystack before or after the first occurrence
+ *    of the separator, or NULL if there isn't one
+ *
+ * substr_before_last(haystack, separator)
+ * substr_after_last(haystack, separator)
+ *    same, for the last occurrence
+ *
+ * split_part(haystack, separator, n)
+ *    the nth field of the haystack split at the separator, as in
+ *    PostgreSQL; negative n counts from the end
+ *
+ * replace_all(haystack, needle, replacement[, max_count])
+ *    like replace, except it doesn't think strings end at NUL,
+ *    and replaces only the first max_count occurrences if given
+ *
+ * instr_count(haystack, needle[, overlapping])
+ *    the number of occurrences of the needle, which may overlap
+ *    if the third argument is true; like contains, this only
+ *    compares bytes
+ *
+ * instr_match(haystack, matcher)
+ *    like instr_any with the needles of a matcher, which comes from
+ *    matcher_compile(needle1, needle2, ...) or is bound by the
+ *    application with sqlite3_bind_pointer as an "instr_matcher"
+ *    made by instr_matcher_compile, declared in instr.h; blobs are
+ *    searched by bytes and anything else as UTF-8 text
+ *
+ * instr_blob_stream(db_name, table, column, rowid, needle[, startpos])
+ *    like instr on the blob stored in the given row and column,
+ *    but reads it incrementally instead of loading all of it;
+ *    it can only be used in top-level SQL, not triggers or views
+ *
+ * instr_file(path, needle[, startpos])
+ * rinstr_file(path, needle[, startpos])
+ *    like instr and rinstr on a blob with the contents of the file,
+ *    searched where it lies without being read into memory; text
+ *    needles are taken as UTF-8, and like instr_blob_stream these
+ *    can only be used in top-level SQL; not on Windows
+ *
+ * SELECT position, byte_offset FROM instr_all(haystack, needle)
+ *    a table-valued function with a row for each non-overlapping
+ *    occurrence of the needle, in order; byte_offset counts from 0,
+ *    in UTF-8 bytes for text, and an empty needle has no occurrences
+ *
+ * SELECT ... FROM instr_all(haystack, needle, overlapping)
+ *    same, except matches may overlap if the third argument is true
+ *
+ * SELECT ordinal, value, char_pos FROM split(haystack, separator)
+ *    a table-valued function with a row for each field of the haystack
+ *    split at the separator, and the character position it starts at
+ *
+ * CREATE VIRTUAL TABLE name USING instr_trigram
+ *    a table with one column, value, and a trigram index over it that
+ *    WHERE contains(value, ?) and WHERE instr(value, ?) are answered
+ *    from; the index narrows the rows and the function decides
+ *
+ * SELECT counter, value FROM instr_stats([reset])
+ *    only when built with INSTR_STATS defined: counters of the work
+ *    done by all searches since loading or the last reset, which
+ *    a true argument asks for after reading them
+ *
+ * Built into an application instead, with SQLITE_CORE defined, the
+ * functions are added to every connection it opens after
+ *
+ *   sqlite3_auto_extension((void (*)(void))sqlite3_instr_init);
+ *
+ * Loaded through the entry point sqlite3_instrtrusted_init instead,
+ * the same functions take text on trust: character positions are found
+ * by counting lead bytes or code units without checking the encoding,
+ * so malformed text gives meaningless positions rather than an error.
+ */
+
+/*
+ * instr_file needs mmap and pread, which strict C builds only get
+ * when asked for, and large file offsets on 32-bit systems.
  */
+#if !defined(_WIN32)
+#define HAVE_FILES 1
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
 
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sqlite3ext.h>
+#include "instr.h"
+#ifndef SQLITE_MUTEX_STATIC_MAIN
+#define SQLITE_MUTEX_STATIC_MAIN SQLITE_MUTEX_STATIC_MASTER
+#endif
+#if HAVE_FILES
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * The x86 kernels are compiled with per-function target attributes
+ * and picked when the extension is loaded, so the build itself needn't
+ * assume more than the base instruction set.  NEON is part of the
+ * ARM64 baseline and needs no such care.
+ */
+#if defined(__x86_64__) || defined(__i386__) \
+    || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__) || defined(_M_ARM64)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+ * Built with INSTR_THREADS defined as a thread count above one, searches
+ * and character counts over at least INSTR_THREAD_MIN bytes are shared
+ * out among that many threads, the caller's included.  A shared library
+ * only does so once it has been loaded through sqlite3_extension_init,
+ * which keeps it loaded for good.
+ */
+#if INSTR_THREADS>1
+#include <pthread.h>
+#ifndef INSTR_THREAD_MIN
+#define INSTR_THREAD_MIN (8<<20)
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
 
 SQLITE_EXTENSION_INIT1
 
 static char const confused[]    = "SQLite is confused";
 static char malformed_8[]       = "malformed UTF-8 text";
 static char malformed_16[]      = "malformed UTF-16 text";
+static char const noneedles[]   = "no needles to search for";
+static char const splitchar[]   = "byte range splits a character";
+static char const zerofield[]   = "field position must not be zero";
+static char const nonpositive[] = "occurrence must be positive";
 
 /*
  * upgrade this to size_t if SQLite ever gets
@@ -32,10 +212,182 @@ typedef unsigned int vsize;
 
 typedef vsize bmh_skips[256];
 
+/*
+ * Built with INSTR_STATS defined, the search paths count the work they
+ * do in the process-wide counters below, which the instr_stats table-
+ * valued function shows.  Searches in other connections and the thread
+ * pool's workers bump them at the same time, so they're atomic where
+ * the compiler has a way to say so.  STAT_TAKE reads one, zeroing it
+ * as well if reset is set.
+ */
+#ifdef INSTR_STATS
+#define STAT_SEARCHES   0
+#define STAT_SCANNED    1
+#define STAT_CANDIDATES 2
+#define STAT_SHIFTS     3
+#define STAT_SHIFTED    4
+#define STAT_COMPILED   5
+#define STAT_CACHED     6
+#define STAT_WALKED     7
+#define NSTATS          8
+
+static sqlite3_int64 stats[NSTATS];
+
+#if defined(__GNUC__)
+#define STAT(counter, n) \
+    ((void)__atomic_fetch_add(&stats[counter], (n), __ATOMIC_RELAXED))
+#define STAT_TAKE(counter, reset) \
+    ((reset) ? __atomic_exchange_n(&stats[counter], 0, __ATOMIC_RELAXED) \
+     : __atomic_load_n(&stats[counter], __ATOMIC_RELAXED))
+#elif defined(_MSC_VER)
+#define STAT(counter, n) \
+    ((void)_InterlockedExchangeAdd64(&stats[counter], (n)))
+#define STAT_TAKE(counter, reset) \
+    ((reset) ? _InterlockedExchange64(&stats[counter], 0) \
+     : _InterlockedExchangeAdd64(&stats[counter], 0))
+#else
+#define STAT(counter, n) (stats[counter] += (n))
+#define STAT_TAKE(counter, reset) stat_take(counter, reset)
+
+static sqlite3_int64 stat_take(
+    int counter,
+    int reset)
+{
+    sqlite3_int64 value = stats[counter];
+
+    if (reset)
+        stats[counter] = 0;
+    return value;
+}
+#endif
+#else
+#define STAT(counter, n) ((void)0)
+#endif
+
+/*
+ * A search counts the bytes it got through: from where it started to
+ * the end of its match, or for a reverse search from the end back to
+ * the start of its match, or all size of them if there's no match.
+ */
+#define STAT_FORWARD(start, size, match, needlesize) \
+    STAT(STAT_SCANNED, (match) \
+         ? (sqlite3_int64)((unsigned char const *)(match) \
+                           -(unsigned char const *)(start))+(needlesize) \
+         : (sqlite3_int64)(size))
+#define STAT_BACKWARD(start, size, match) \
+    STAT(STAT_SCANNED, (match) \
+         ? (sqlite3_int64)((unsigned char const *)(start)+(size) \
+                           -(unsigned char const *)(match)) \
+         : (sqlite3_int64)(size))
+
+#define SEARCH_BLOB     0
+#define SEARCH_UTF8     1
+#define SEARCH_UTF16    2
+#define SEARCH_REVERSE  4
+#define SEARCH_SWAPPED  8
+#define SEARCH_NOCASE   16
+
+/*
+ * SEARCH_SWAPPED marks UTF-16 text in the byte order opposite to the
+ * host's, which is searched as it is stored rather than being converted.
+ * Its code units are read through UNIT16, which swaps them back.
+ */
+#define UNIT16(ptr, ix, swapped) \
+    (swapped ? ((ptr)[ix]>>8|(ptr)[ix]<<8)&0xFFFF : (ptr)[ix])
+
+typedef struct twoway {
+    vsize suffix;
+    vsize period;
+    int periodic;
+    bmh_skips shift;
+} twoway;
+
+/*
+ * Needles at least this long, and periodic ones at least
+ * TWOWAY_PERIODIC long, are searched for with Two-Way; in bytes,
+ * or in code units for UTF-16.  Below that
+ * the candidate checks in the other engines are short enough
+ * that their worst case is still linear in the haystack size.
+ */
+#define TWOWAY_MIN      32
+#define TWOWAY_PERIODIC 8
+
+/*
+ * Blob needles from QGRAM_MIN up to TWOWAY_MIN get Horspool on byte
+ * pairs instead of the kernels' pair search, when the kernels use
+ * Horspool anyway or the needle uses so few distinct bytes that a
+ * first-and-last-byte filter would pass most positions.  Pairs make
+ * the shifts long again on such low-entropy data.  Its table, of
+ * QGRAM_TABLE hashed pairs, holds shifts below TWOWAY_MIN in a byte.
+ */
+#define QGRAM_MIN       8
+#define QGRAM_TABLE     4096
+#define QGRAM_HASH(a, b) (((a)<<4^(b))&(QGRAM_TABLE-1))
+
+/*
+ * Haystacks shorter than PLAN_SMALL bytes are searched position by
+ * position without any tables, which would cost more to build
+ * than the search itself.
+ */
+#define PLAN_SMALL      256
+
+/*
+ * What plan_needle can pick.  ENGINE_SCAN is the kernels' own search,
+ * by byte, pair or code unit as the needle and encoding call for.
+ */
+#define ENGINE_SCAN     0
+#define ENGINE_QGRAM    1
+#define ENGINE_TWOWAY   2
+#define ENGINE_NAIVE    3
+
+/*
+ * Needles searched for without regard to case get one of these instead.
+ * ENGINE_FOLD is the kernels' folded search, for blobs and for UTF-8
+ * needles that fold to ASCII; ENGINE_UFOLD is Horspool over text that's
+ * folded character by character as it's read.
+ */
+#define ENGINE_FOLD     4
+#define ENGINE_UFOLD    5
+
+/*
+ * Folded needles long or periodic enough for Two-Way get ENGINE_TWOFOLD,
+ * which runs it over the folded needle and folds the haystack as it's
+ * read, the way fold says: as ASCII, as UTF-8, or as UTF-16 code units,
+ * in the stored byte order if FOLD_SWAPPED is set.  FOLD_BACKWARDS
+ * is only for the scan, which reads reverse searches from the end.
+ */
+#define ENGINE_TWOFOLD  6
+
+#define FOLD_ASCII      0
+#define FOLD_UTF8       1
+#define FOLD_UTF16      2
+#define FOLD_BACKWARDS  4
+#define FOLD_SWAPPED    8
+
+/*
+ * A needle prepared for one encoding and direction.  It is attached
+ * to the needle argument as auxiliary data, so a constant needle
+ * only gets its tables built once per statement.  Reverse Two-Way
+ * needs a reversed copy of the needle, which is kept in rneedle,
+ * and q-gram Horspool its pair table, kept in qskips.  A needle
+ * searched for without regard to case is kept folded in folded,
+ * and with ENGINE_TWOFOLD reversed again in rneedle.
+ */
+typedef struct compiled {
+    int kind;
+    vsize needlesize;
+    int engine;
+    bmh_skips skips;
+    twoway tw;
+    unsigned char *rneedle;
+    unsigned char *qskips;
+    unsigned char *folded;
+    int fold;
+} compiled;
+
 static void fbmh_setup(
     unsigned char const *needle,
     vsize needlesize,
-    vsize mask,
     bmh_skips skips)
 {
     unsigned int c;
@@ -48,17 +400,11 @@ static void fbmh_setup(
     for (ix = 0; ix<limit; ix++) {
         skips[needle[ix]] = limit-ix;
     }
-    if (mask) {
-        for (c = 0; c<256; c++) {
-            skips[c] = skips[c]+mask & ~mask;
-        }
-    }
 }
 
 static void rbmh_setup(
     unsigned char const *needle,
     vsize needlesize,
-    vsize mask,
     bmh_skips skips)
 {
     unsigned int c;
@@ -71,11 +417,379 @@ static void rbmh_setup(
     for (ix = limit; ix>0; ix--) {
         skips[needle[ix]] = ix;
     }
-    if (mask) {
-        for (c = 0; c<256; c++) {
-            skips[c] = skips[c]+mask & ~mask;
+}
+
+/*
+ * UTF-16 needles get their tables in code units, keyed on both bytes
+ * of the unit.  Keying on one byte would let all of a CJK block share
+ * a handful of entries and shrink most shifts to a single unit.
+ */
+#define UNIT_HASH(u) (((u)^(u)>>8)&0xFF)
+
+static void fbmh16_setup(
+    unsigned short const *needle,
+    vsize needlesize,
+    bmh_skips skips)
+{
+    unsigned int c;
+    vsize ix, limit;
+
+    for (c = 0; c<256; c++) {
+        skips[c] = needlesize;
+    }
+    limit = needlesize-1;
+    for (ix = 0; ix<limit; ix++) {
+        skips[UNIT_HASH(needle[ix])] = limit-ix;
+    }
+}
+
+static void rbmh16_setup(
+    unsigned short const *needle,
+    vsize needlesize,
+    bmh_skips skips)
+{
+    unsigned int c;
+    vsize ix, limit;
+
+    for (c = 0; c<256; c++) {
+        skips[c] = needlesize;
+    }
+    limit = needlesize-1;
+    for (ix = limit; ix>0; ix--) {
+        skips[UNIT_HASH(needle[ix])] = ix;
+    }
+}
+
+/*
+ * The pair ending a forward window, or starting a reverse one,
+ * picks the shift; a pair found nowhere in the needle allows
+ * a shift of needlesize-1, leaving one byte of overlap.
+ */
+static void fqgram_setup(
+    unsigned char const *needle,
+    vsize needlesize,
+    unsigned char *qskips)
+{
+    vsize ix, limit;
+
+    memset(qskips, (int)(needlesize-1), QGRAM_TABLE);
+    limit = needlesize-2;
+    for (ix = 0; ix<limit; ix++) {
+        qskips[QGRAM_HASH(needle[ix], needle[ix+1])] =
+            (unsigned char)(limit-ix);
+    }
+}
+
+static void rqgram_setup(
+    unsigned char const *needle,
+    vsize needlesize,
+    unsigned char *qskips)
+{
+    vsize ix;
+
+    memset(qskips, (int)(needlesize-1), QGRAM_TABLE);
+    for (ix = needlesize-2; ix>0; ix--) {
+        qskips[QGRAM_HASH(needle[ix], needle[ix+1])] = (unsigned char)ix;
+    }
+}
+
+/*
+ * Crochemore-Perrin Two-Way matching, with a last-byte shift table
+ * in front of it the way glibc does it for long needles.  The shift
+ * table gives Horspool-like skips on typical text, while the critical
+ * factorization guarantees that no haystack byte is compared more
+ * than a couple of times, whatever the needle and haystack look like.
+ *
+ * Reverse searches run the same scan over the reversed needle and
+ * a reversed view of the haystack.  UTF-16 runs it over code units,
+ * with wide set; any order of the units does for the factorization,
+ * so they're compared as stored, whichever byte order that is.
+ */
+
+#define NEEDLE_SYM(needle, ix, wide) \
+    (wide ? ((unsigned short const *)(needle))[ix] \
+     : ((unsigned char const *)(needle))[ix])
+
+static vsize critical_factorization(
+    void const *needle,
+    vsize length,
+    int wide,
+    vsize *periodOut)
+{
+    vsize maxsuffix, maxsuffixrev;
+    vsize j, k, p;
+    unsigned int a, b;
+
+    if (length<3) {
+        *periodOut = 1;
+        return length-1;
+    }
+
+    maxsuffix = (vsize)-1;
+    j = 0;
+    k = p = 1;
+    while (j+k<length) {
+        a = NEEDLE_SYM(needle, j+k, wide);
+        b = NEEDLE_SYM(needle, maxsuffix+k, wide);
+        if (a<b) {
+            j += k;
+            k = 1;
+            p = j-maxsuffix;
+        } else if (a==b) {
+            if (k!=p) {
+                k++;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            maxsuffix = j++;
+            k = p = 1;
+        }
+    }
+    *periodOut = p;
+
+    maxsuffixrev = (vsize)-1;
+    j = 0;
+    k = p = 1;
+    while (j+k<length) {
+        a = NEEDLE_SYM(needle, j+k, wide);
+        b = NEEDLE_SYM(needle, maxsuffixrev+k, wide);
+        if (b<a) {
+            j += k;
+            k = 1;
+            p = j-maxsuffixrev;
+        } else if (a==b) {
+            if (k!=p) {
+                k++;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            maxsuffixrev = j++;
+            k = p = 1;
+        }
+    }
+
+    if (maxsuffixrev+1<maxsuffix+1)
+        return maxsuffix+1;
+    *periodOut = p;
+    return maxsuffixrev+1;
+}
+
+/*
+ * Set up for a needle of length bytes, or code units if wide is set.
+ * The code unit shift table is indexed by UNIT_HASH, and when units
+ * share a hash the shortest shift wins, so it never skips a match.
+ */
+static void twoway_setup(
+    void const *needle,
+    vsize length,
+    int wide,
+    twoway *tw)
+{
+    unsigned int c;
+    vsize ix;
+
+    tw->suffix = critical_factorization(needle, length, wide, &tw->period);
+    for (c = 0; c<256; c++) {
+        tw->shift[c] = length;
+    }
+    for (ix = 0; ix<length; ix++) {
+        c = NEEDLE_SYM(needle, ix, wide);
+        tw->shift[wide ? UNIT_HASH(c) : c] = length-ix-1;
+    }
+    tw->periodic = !memcmp(needle,
+                           (unsigned char const *)needle
+                           +(tw->period<<(wide!=0)),
+                           tw->suffix<<(wide!=0));
+    if (!tw->periodic) {
+        tw->period = (tw->suffix>length-tw->suffix
+                      ? tw->suffix : length-tw->suffix)+1;
+    }
+}
+
+/*
+ * Copy a needle of size bytes to out with its bytes, or code units
+ * if wide is set, in reverse order, for reverse searches.
+ */
+static void reverse_needle(
+    unsigned char const *needle,
+    vsize size,
+    int wide,
+    unsigned char *out)
+{
+    vsize ix;
+
+    if (wide) {
+        for (ix = 0; ix<size/2; ix++) {
+            ((unsigned short *)out)[ix]
+                = ((unsigned short const *)needle)[size/2-1-ix];
+        }
+    } else {
+        for (ix = 0; ix<size; ix++) {
+            out[ix] = needle[size-1-ix];
+        }
+    }
+}
+
+/*
+ * Where a scan picks up after a match at index 0, to find the next one
+ * at least skip past it.  A periodic needle's next window overlaps the
+ * match by all but a period, and that part needn't be compared again;
+ * any other needle can't match again within tw->period of the last
+ * match.  This is what keeps enumerating overlapping matches linear.
+ */
+static void twoway_resume(
+    twoway const *tw,
+    vsize length,
+    vsize skip,
+    vsize *fromOut,
+    vsize *memoryOut)
+{
+    if (skip<=tw->period) {
+        *fromOut = tw->period;
+        *memoryOut = tw->periodic ? length-tw->period : 0;
+    } else {
+        *fromOut = skip;
+        *memoryOut = 0;
+    }
+}
+
+/*
+ * Scan text[0], text[step], text[2*step], ... for the needle, from
+ * index from on, knowing that the first memory bytes of the needle
+ * match there; both are 0 for a fresh search, or what twoway_resume
+ * says.  Returns the index of the first match in scanning order,
+ * or (vsize)-1 if there isn't one.  textsize must be at least
+ * needlesize, and needlesize at least 2.
+ */
+static vsize twoway_scan(
+    twoway const *tw,
+    unsigned char const *needle,
+    vsize needlesize,
+    unsigned char const *text,
+    ptrdiff_t step,
+    vsize textsize,
+    vsize from,
+    vsize memory)
+{
+    vsize suffix, period, last, limit;
+    vsize i, j, shift;
+
+#define AT(ix) text[(ptrdiff_t)(ix)*step]
+    suffix = tw->suffix;
+    period = tw->period;
+    last = needlesize-1;
+    limit = textsize-needlesize;
+    j = from;
+    if (tw->periodic) {
+        while (j<=limit) {
+            shift = tw->shift[AT(j+last)];
+            if (shift) {
+                if (memory && shift<period)
+                    shift = needlesize-period;
+                memory = 0;
+                j += shift;
+                continue;
+            }
+            i = suffix>memory ? suffix : memory;
+            while (i<last && needle[i]==AT(i+j))
+                i++;
+            if (i>=last) {
+                i = suffix;
+                while (i>memory && needle[i-1]==AT(i-1+j))
+                    i--;
+                if (i<=memory)
+                    return j;
+                j += period;
+                memory = needlesize-period;
+            } else {
+                j += i-suffix+1;
+                memory = 0;
+            }
+        }
+    } else {
+        while (j<=limit) {
+            shift = tw->shift[AT(j+last)];
+            if (shift) {
+                j += shift;
+                continue;
+            }
+            i = suffix;
+            while (i<last && needle[i]==AT(i+j))
+                i++;
+            if (i>=last) {
+                i = suffix;
+                while (i>0 && needle[i-1]==AT(i-1+j))
+                    i--;
+                if (i==0)
+                    return j;
+                j += period;
+            } else {
+                j += i-suffix+1;
+            }
+        }
+    }
+#undef AT
+    return (vsize)-1;
+}
+
+/*
+ * twoway_scan over code units, with lengths and indexes in units.
+ * A hashed shift says less about the unit it came from than a byte's
+ * does, so it doesn't stretch a shift out of a window that matched
+ * a period of the needle the way the byte scan does.
+ */
+static vsize twoway_scan16(
+    twoway const *tw,
+    unsigned short const *needle,
+    vsize length,
+    unsigned short const *text,
+    ptrdiff_t step,
+    vsize textlength,
+    vsize from,
+    vsize memory)
+{
+    vsize suffix, period, last, limit;
+    vsize i, j, shift;
+    unsigned int unit;
+
+#define AT(ix) text[(ptrdiff_t)(ix)*step]
+    suffix = tw->suffix;
+    period = tw->period;
+    last = length-1;
+    limit = textlength-length;
+    j = from;
+    if (!tw->periodic)
+        memory = 0;
+    while (j<=limit) {
+        unit = AT(j+last);
+        shift = tw->shift[UNIT_HASH(unit)];
+        if (shift || unit!=needle[last]) {
+            j += shift ? shift : 1;
+            memory = 0;
+            continue;
+        }
+        i = suffix>memory ? suffix : memory;
+        while (i<last && needle[i]==AT(i+j))
+            i++;
+        if (i>=last) {
+            i = suffix;
+            while (i>memory && needle[i-1]==AT(i-1+j))
+                i--;
+            if (i<=memory)
+                return j;
+            j += period;
+            memory = tw->periodic ? length-period : 0;
+        } else {
+            j += i-suffix+1;
+            memory = 0;
         }
     }
+#undef AT
+    return (vsize)-1;
 }
 
 #define UTF8_ADVANCE(ptr, size, cp) \
@@ -111,48 +825,17 @@ static void rbmh_setup(
         } \
     } while (0)
 
-#define UTF8_RETREAT(ptr, size, cp) \
-    do { \
-        unsigned int c1, c2, c3, c4; \
-        if (size>=1 && (c1 = ptr[-1])<0x80) { \
-            cp = c1; \
-            ptr -= 1; \
-            size -= 1; \
-        } else if (size>=2 && c1>=0x80 && c1<0xC0 \
-                   && (c2 = ptr[-2])>=0xC2 && c2<0xE0) { \
-            cp = c2<<6 & 0x7C0 | c1&0x3F; \
-            ptr -= 2; \
-            size -= 2; \
-        } else if (size>=3 && c1>=0x80 && c1<0xC0 \
-                   && c2>=0xC2 && c2<0xE0 \
-                   && (c3 = ptr[-3])>=0xE0 && c3<0xF0 \
-                   && (cp = c3<<12&0xF000 | c2<<6&0xFC0 | c1&0x3F)>=0x800 \
-                   && (cp<0xD800 || cp>=0xE000)) { \
-            ptr -= 3; \
-            size -= 3; \
-        } else if (size>=4 && c1>=0x80 && c1<0xC0 \
-                   && c2>=0xC2 && c2<0xE0 \
-                   && c3>=0xC2 && c3<0xE0 \
-                   && (c4 = ptr[-4])>=0xF0 && c4<0xF5 \
-                   && (cp = c4<<18&0x1C0000 | c3<<12&0x3F000 \
-                       | c2<<6&0xFC0 | c1&0x3F)>=0x10000 \
-                   && cp<0x110000) { \
-            ptr -= 4; \
-            size -= 4; \
-        } else { \
-            cp = -1; \
-        } \
-    } while (0)
-
-#define UTF16_ADVANCE(ptr, size, cp) \
+#define UTF16_ADVANCE(ptr, size, cp, swapped) \
     do { \
         unsigned int c0, c1; \
-        if (size>=2 && ((c0 = ptr[0])<0xD800 || c0>=0xE000)) { \
+        if (size>=2 && ((c0 = UNIT16(ptr, 0, swapped))<0xD800 \
+                        || c0>=0xE000)) { \
             cp = c0; \
             ptr += 1; \
             size -= 2; \
         } else if (size>=4 && c0>=0xD800 && c0<0xDC00 \
-                   && (c1 = ptr[1])>=0xDC00 && c1<0xE000) { \
+                   && (c1 = UNIT16(ptr, 1, swapped))>=0xDC00 \
+                   && c1<0xE000) { \
             cp = (c0+0x40)<<10&0x1FFC00 | c1&0x3FF; \
             ptr += 2; \
             size -= 4; \
@@ -161,595 +844,8370 @@ static void rbmh_setup(
         } \
     } while (0)
 
-#define UTF16_RETREAT(ptr, size, cp) \
+/*
+ * Step over a character of text that's taken to be well-formed,
+ * without running past the end if it isn't.
+ */
+#define UTF8_SKIP(ptr, size) \
     do { \
-        unsigned int c1, c2; \
-        if (size>=2 && ((c1 = ptr[-1])<0xD800 || c1>=0xE000)) { \
-            cp = c1; \
-            ptr -= 1; \
-            size -= 2; \
-        } else if (size>=4 && c1>=0xDC00 && c1<0xE000 \
-                   && (c2 = ptr[-2])>=0xD800 && c2<0xDC00) { \
-            cp = (c2+0x40)<<10&0x1FFC00 | c1&0x3FF; \
-            ptr += 2; \
-            size -= 4; \
-        } else { \
-            cp = -1; \
-        } \
+        unsigned int c0 = ptr[0]; \
+        vsize len = c0<0xE0 ? 1+(c0>=0xC0) : 3+(c0>=0xF0); \
+        if (len>size) \
+            len = size; \
+        ptr += len; \
+        size -= len; \
     } while (0)
 
-static sqlite3_int64 instr_blob(
-    unsigned char const *haystack,
-    vsize stacksize,
-    unsigned char const *needle,
-    vsize needlesize,
-    sqlite3_int64 start)
-{
-    bmh_skips skips;
-    sqlite3_int64 found;
+#define UTF16_SKIP(ptr, size, swapped) \
+    do { \
+        vsize len = size>=4 \
+            && (UNIT16(ptr, 0, swapped)&0xFC00)==0xD800 ? 2 : 1; \
+        ptr += len; \
+        size -= len*2; \
+    } while (0)
 
-    if (start>1) {
-        found = start;
-        start--;
-        if (start>(sqlite3_int64)stacksize)
-            return 0;
-        haystack += start;
-        stacksize -= start;
-    } else {
-        found = 1;
-    }
-    if (needlesize>stacksize)
-        return 0;
-    if (needlesize<=0)
-        return found;
-    if (needlesize>1) {
-        fbmh_setup(needle, needlesize, 0, skips);
-        while (stacksize>=needlesize) {
-            vsize skip;
+/*
+ * Case folding for instr_nocase and rinstr_nocase.  ASCII letters fold
+ * by setting bit 5, which is all that blobs get.  Text gets simple case
+ * folding for Latin, Greek, Cyrillic and Armenian letters, Roman
+ * numerals, circled letters and fullwidth forms, less the mappings
+ * that would change the length of a character: the Kelvin sign,
+ * dotted capital I and so on stay as they are.  So folding keeps
+ * every character the same size in UTF-8 and UTF-16, haystack
+ * positions mean the same folded or not, and the haystack can be
+ * folded as it's read instead of copied.
+ */
+#define ASCII_FOLD(c) ((unsigned int)(c)-'A'<26 ? (c)|0x20 : (c))
 
-            if (!memcmp(haystack, needle, needlesize))
-                return found;
-            skip = skips[haystack[needlesize-1]];
-            haystack += skip;
-            stacksize -= skip;
-            found += skip;
+/*
+ * What the vector kernels OR into a block before comparing it with
+ * a folded byte: bit 5 if that's a lower case letter, for which the
+ * only other byte that gives it is the upper case one.
+ */
+#define FOLD_MASK(c) ((unsigned int)(c)-'a'<26 ? 0x20 : 0)
+
+static unsigned int fold_codepoint(
+    unsigned int c)
+{
+    if (c<0x80)
+        return ASCII_FOLD(c);
+    if (c<0x100)
+        return c>=0xC0 && c<=0xDE && c!=0xD7 ? c+0x20 : c;
+    if (c<0x180) {
+        if (c==0x178)
+            return 0xFF;
+        if (c>=0x139 && c<=0x148 || c>=0x179 && c<=0x17E)
+            return c&1 ? c+1 : c;
+        if (c>=0x100 && c<=0x12F || c>=0x132 && c<=0x137
+                || c>=0x14A && c<=0x177)
+            return c|1;
+        return c;
+    }
+    if (c>=0x370 && c<0x400) {
+        if (c==0x386)
+            return 0x3AC;
+        if (c>=0x388 && c<=0x38A)
+            return c+37;
+        if (c==0x38C)
+            return 0x3CC;
+        if (c==0x38E || c==0x38F)
+            return c+63;
+        if (c>=0x391 && c<=0x3AB && c!=0x3A2)
+            return c+0x20;
+        if (c==0x3C2)
+            return 0x3C3;
+        if (c>=0x3D8 && c<=0x3EF)
+            return c|1;
+        return c;
+    }
+    if (c>=0x400 && c<0x530) {
+        if (c<0x410)
+            return c+0x50;
+        if (c<0x430)
+            return c+0x20;
+        if (c==0x4C0)
+            return 0x4CF;
+        if (c>=0x4C1 && c<=0x4CE)
+            return c&1 ? c+1 : c;
+        if (c>=0x460 && c<=0x481 || c>=0x48A && c<=0x4BF || c>=0x4D0)
+            return c|1;
+        return c;
+    }
+    if (c>=0x531 && c<=0x556)
+        return c+0x30;
+    if (c>=0x1E00 && c<=0x1E95 || c>=0x1EA0 && c<=0x1EFF)
+        return c|1;
+    if (c>=0x2160 && c<=0x216F)
+        return c+0x10;
+    if (c>=0x24B6 && c<=0x24CF)
+        return c+26;
+    if (c>=0xFF21 && c<=0xFF3A)
+        return c+0x20;
+    return c;
+}
+
+/*
+ * Fold the character at text into out and return its length, or
+ * return 0 if it isn't a whole, well-formed character of two or
+ * three bytes; no others fold.
+ */
+static vsize fold_char8(
+    unsigned char const *text,
+    vsize size,
+    unsigned char *out)
+{
+    unsigned int c0, cp;
+
+    c0 = text[0];
+    if (c0>=0xC2 && c0<0xE0) {
+        if (size<2 || (text[1]&0xC0)!=0x80)
+            return 0;
+        cp = fold_codepoint((c0&0x1F)<<6 | (text[1]&0x3F));
+        out[0] = 0xC0 | cp>>6;
+        out[1] = 0x80 | (cp&0x3F);
+        return 2;
+    }
+    if (c0>=0xE0 && c0<0xF0) {
+        if (size<3 || (text[1]&0xC0)!=0x80 || (text[2]&0xC0)!=0x80)
+            return 0;
+        cp = (c0&0x0F)<<12 | (text[1]&0x3F)<<6 | (text[2]&0x3F);
+        if (cp<0x800 || cp>=0xD800 && cp<0xE000)
+            return 0;
+        cp = fold_codepoint(cp);
+        out[0] = 0xE0 | cp>>12;
+        out[1] = 0x80 | (cp>>6&0x3F);
+        out[2] = 0x80 | (cp&0x3F);
+        return 3;
+    }
+    return 0;
+}
+
+static void fold_utf8(
+    unsigned char const *text,
+    vsize size,
+    unsigned char *out)
+{
+    vsize ix, len;
+
+    for (ix = 0; ix<size; ix += len) {
+        len = text[ix]<0x80 ? 0 : fold_char8(text+ix, size-ix, out+ix);
+        if (!len) {
+            out[ix] = ASCII_FOLD(text[ix]);
+            len = 1;
         }
-    } else {
-        unsigned int first;
+    }
+}
+
+/*
+ * The folded byte at pos in text, found by looking back to the start
+ * of its character.  Returns -1 if the character runs past either end
+ * of the text, so that how it folds can't be told.
+ */
+static int fold_byte8(
+    unsigned char const *text,
+    vsize size,
+    vsize pos)
+{
+    unsigned char folded[3];
+    unsigned int c0;
+    vsize start;
+
+    if (text[pos]<0x80)
+        return ASCII_FOLD(text[pos]);
+    start = pos;
+    while ((text[start]&0xC0)==0x80 && pos-start<2) {
+        if (start==0)
+            return -1;
+        start--;
+    }
+    c0 = text[start];
+    if (c0>=0xC2 && c0<0xF0 && size-start<(vsize)(c0<0xE0 ? 2 : 3))
+        return -1;
+    if (fold_char8(text+start, size-start, folded)>pos-start)
+        return folded[pos-start];
+    return text[pos];
+}
+
+/*
+ * A UTF-16 code unit folds the same wherever it is, since surrogates
+ * never do.  It's folded in the byte order it's stored in.
+ */
+static unsigned int fold_unit(
+    unsigned int unit,
+    int swapped)
+{
+    if (!swapped)
+        return fold_codepoint(unit);
+    unit = fold_codepoint((unit>>8|unit<<8)&0xFFFF);
+    return (unit>>8|unit<<8)&0xFFFF;
+}
+
+static int fold_equal(
+    unsigned char const *text,
+    unsigned char const *folded,
+    vsize size)
+{
+    vsize ix;
+
+    for (ix = 0; ix<size; ix++) {
+        if (ASCII_FOLD(text[ix])!=folded[ix])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Kernels for the byte-oriented searches.
+ *
+ * find_byte is memchr.  find_pair looks for a needle of at least two
+ * bytes; the vector versions compare its first and last bytes against
+ * a block of consecutive alignments at once and only call memcmp for
+ * the alignments where both of them match, while the scalar version
+ * is plain Horspool on the skip table.  The rfind flavours find the
+ * last occurrence instead.  All of them return a pointer into the
+ * haystack, or 0 if there's no match.  find_fold and rfind_fold do
+ * the same for a needle that's been folded to lower case, comparing
+ * the haystack ASCII-folded; the vector versions OR bit 5 into the
+ * blocks where the bytes they compare with are letters.  count_byte
+ * counts the bytes that equal c.
+ *
+ * utf8_count checks that a piece of text is complete, well-formed UTF-8
+ * and counts its characters; it returns -1 if the text is malformed.
+ * utf8_leads and utf16_leads count the characters in text that's taken
+ * to be well-formed, by counting the bytes that aren't continuation
+ * bytes or the code units that aren't low surrogates; utf16_leads
+ * reads the code units byte-swapped if swapped is set.
+ */
+
+typedef struct kernelset {
+    unsigned char const *(*find_byte)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned int c);
+    unsigned char const *(*find_pair)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned char const *needle,
+        vsize needlesize,
+        vsize const *skips);
+    unsigned char const *(*rfind_byte)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned int c);
+    unsigned char const *(*rfind_pair)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned char const *needle,
+        vsize needlesize,
+        vsize const *skips);
+    unsigned short const *(*find_pair16)(
+        unsigned short const *haystack,
+        vsize stacksize,
+        unsigned short const *needle,
+        vsize needlesize,
+        vsize const *skips);
+    unsigned short const *(*rfind_pair16)(
+        unsigned short const *haystack,
+        vsize stacksize,
+        unsigned short const *needle,
+        vsize needlesize,
+        vsize const *skips);
+    unsigned char const *(*find_fold)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned char const *needle,
+        vsize needlesize,
+        vsize const *skips);
+    unsigned char const *(*rfind_fold)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned char const *needle,
+        vsize needlesize,
+        vsize const *skips);
+    sqlite3_int64 (*count_byte)(
+        unsigned char const *haystack,
+        vsize stacksize,
+        unsigned int c);
+    int (*utf8_count)(
+        unsigned char const *text,
+        vsize size,
+        sqlite3_int64 *countOut);
+    sqlite3_int64 (*utf8_leads)(
+        unsigned char const *text,
+        vsize size);
+    sqlite3_int64 (*utf16_leads)(
+        unsigned short const *text,
+        vsize units,
+        int swapped);
+    int bmh;
+} kernelset;
+
+static unsigned int lowest_bit(
+    unsigned int bits)
+{
+#if defined(_MSC_VER)
+    unsigned long ix;
+
+    _BitScanForward(&ix, bits);
+    return ix;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+static unsigned int highest_bit(
+    unsigned int bits)
+{
+#if defined(_MSC_VER)
+    unsigned long ix;
+
+    _BitScanReverse(&ix, bits);
+    return ix;
+#else
+    return 31-__builtin_clz(bits);
+#endif
+}
+
+static unsigned int lowest_bit64(
+    unsigned long long bits)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long ix;
 
-        first = needle[0];
-        while (stacksize>0) {
-            if (haystack[0]==first)
-                return found;
-            haystack++;
-            stacksize--;
-            found++;
+    _BitScanForward64(&ix, bits);
+    return ix;
+#elif defined(_MSC_VER)
+    return (unsigned int)bits ? lowest_bit((unsigned int)bits)
+        : 32+lowest_bit((unsigned int)(bits>>32));
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+static unsigned int highest_bit64(
+    unsigned long long bits)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long ix;
+
+    _BitScanReverse64(&ix, bits);
+    return ix;
+#elif defined(_MSC_VER)
+    return bits>>32 ? 32+highest_bit((unsigned int)(bits>>32))
+        : highest_bit((unsigned int)bits);
+#else
+    return 63-__builtin_clzll(bits);
+#endif
+}
+
+/*
+ * Check the remaining alignments one by one;
+ * the vector kernels finish off with these.
+ */
+static unsigned char const *find_pair_tail(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned int first, last;
+    vsize limit;
+
+    first = needle[0];
+    last = needle[needlesize-1];
+    limit = needlesize-1;
+    while (stacksize>=needlesize) {
+        if (haystack[0]==first && haystack[limit]==last) {
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+1, needle+1, needlesize-2))
+                return haystack;
         }
+        haystack++;
+        stacksize--;
     }
     return 0;
 }
 
-static sqlite3_int64 instr_utf8(
+static unsigned char const *rfind_pair_tail(
     unsigned char const *haystack,
     vsize stacksize,
     unsigned char const *needle,
-    vsize needlesize,
-    sqlite3_int64 start)
+    vsize needlesize)
 {
-    bmh_skips skips;
-    sqlite3_int64 found;
-    int codepoint;
+    unsigned char const *window;
+    unsigned int first, last;
+    vsize limit;
 
-    if (needlesize>stacksize)
-        return 0;
-    found = 1;
-    while (found<start && stacksize>needlesize) {
-        UTF8_ADVANCE(haystack, stacksize, codepoint);
-        if (codepoint==-1)
-            return -1;
-        found++;
-    }
-    if (found<start)
+    if (stacksize<needlesize)
         return 0;
-    if (needlesize<=0)
-        return found;
-    if (needlesize>1) {
-        unsigned char const *next;
-
-        fbmh_setup(needle, needlesize, 0, skips);
-        next = haystack;
-        while (stacksize>=needlesize) {
-            if (haystack>=next) {
-                vsize skip;
-
-                if (!memcmp(haystack, needle, needlesize))
-                    return found;
-                skip = skips[haystack[needlesize-1]];
-                if (stacksize-skip<needlesize)
-                    return 0;
-                next = haystack+skip;
-            }
-            UTF8_ADVANCE(haystack, stacksize, codepoint);
-            if (codepoint==-1)
-                return -1;
-            found++;
+    first = needle[0];
+    last = needle[needlesize-1];
+    limit = needlesize-1;
+    window = haystack+(stacksize-needlesize);
+    for (;;) {
+        if (window[0]==first && window[limit]==last) {
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(window+1, needle+1, needlesize-2))
+                return window;
         }
-    } else {
-        unsigned int first;
+        if (window==haystack)
+            return 0;
+        window--;
+    }
+}
 
-        first = needle[0];
-        while (stacksize>0) {
-            if (haystack[0]==first)
-                return found;
-            UTF8_ADVANCE(haystack, stacksize, codepoint);
-            if (codepoint==-1)
-                return -1;
-            found++;
+/*
+ * The same in code units, for the 16-bit kernels.
+ */
+static unsigned short const *find_pair16_tail(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    while (stacksize>=needlesize) {
+        if (haystack[0]==needle[0]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack, needle, needlesize*2))
+                return haystack;
         }
+        haystack++;
+        stacksize--;
     }
     return 0;
 }
 
-static sqlite3_int64 instr_utf16(
+static unsigned short const *rfind_pair16_tail(
     unsigned short const *haystack,
     vsize stacksize,
     unsigned short const *needle,
-    vsize needlesize,
-    sqlite3_int64 start)
+    vsize needlesize)
 {
-    bmh_skips skips;
-    sqlite3_int64 found;
-    int codepoint;
+    unsigned short const *window;
 
-    if (needlesize>stacksize)
-        return 0;
-    found = 1;
-    while (found<start && stacksize>needlesize) {
-        UTF16_ADVANCE(haystack, stacksize, codepoint);
-        if (codepoint==-1)
-            return -1;
-        found++;
-    }
-    if (found<start)
+    if (stacksize<needlesize)
         return 0;
-    if (needlesize<=0)
-        return found;
-    if (needlesize>2) {
-        unsigned short const *next;
-
-        fbmh_setup((unsigned char const *)needle, needlesize, 1, skips);
-        next = haystack;
-        while (stacksize>=needlesize) {
-            if (haystack>=next) {
-                vsize skip;
-
-                if (!memcmp(haystack, needle, needlesize))
-                    return found;
-                skip = skips[((unsigned char const *)haystack)[needlesize-1]];
-                if (stacksize-skip<needlesize)
-                    return 0;
-                next = haystack+skip/2;
-            }
-            UTF16_ADVANCE(haystack, stacksize, codepoint);
-            if (codepoint==-1)
-                return -1;
-            found++;
+    window = haystack+(stacksize-needlesize);
+    for (;;) {
+        if (window[0]==needle[0]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(window, needle, needlesize*2))
+                return window;
         }
-    } else {
-        unsigned int first;
+        if (window==haystack)
+            return 0;
+        window--;
+    }
+}
 
-        first = needle[0];
-        while (stacksize>0) {
-            if (haystack[0]==first)
-                return found;
-            UTF16_ADVANCE(haystack, stacksize, codepoint);
-            if (codepoint==-1)
-                return -1;
-            found++;
+static unsigned char const *find_fold_tail(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned int first, last;
+    vsize limit;
+
+    first = needle[0];
+    last = needle[needlesize-1];
+    limit = needlesize-1;
+    while (stacksize>=needlesize) {
+        if (ASCII_FOLD(haystack[0])==first
+                && ASCII_FOLD(haystack[limit])==last) {
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(haystack, needle, needlesize))
+                return haystack;
         }
+        haystack++;
+        stacksize--;
     }
     return 0;
 }
 
-static void instr_func(
-    sqlite3_context *context,
-    int argc,
-    sqlite3_value **args)
+static unsigned char const *rfind_fold_tail(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
 {
-    int stacktype, needletype;
-    void const *haystack, *needle;
-    vsize stacksize, needlesize;
-    sqlite3_int64 start, result;
-    char const *malformed;
+    unsigned char const *window;
+    unsigned int first, last;
+    vsize limit;
 
-    if (argc<2)
-        goto confused;
-    stacktype = sqlite3_value_type(args[0]);
-    if (stacktype==SQLITE_NULL)
-        return;
-    needletype = sqlite3_value_type(args[1]);
-    if (needletype==SQLITE_NULL)
-        return;
-    if (argc>=3) {
-        if (sqlite3_value_type(args[2])==SQLITE_NULL)
-            return;
-        start = sqlite3_value_int64(args[2]);
-    } else {
-        start = 1;
-    }
-    malformed = sqlite3_user_data(context);
-    if (stacktype==SQLITE_BLOB && needletype==SQLITE_BLOB) {
-        haystack = sqlite3_value_blob(args[0]);
-        stacksize = sqlite3_value_bytes(args[0]);
-        if (!haystack && stacksize>0)
-            goto nomem;
-        needle = sqlite3_value_blob(args[1]);
-        needlesize = sqlite3_value_bytes(args[1]);
-        if (!needle && needlesize>0)
-            goto nomem;
-        result = instr_blob(haystack, stacksize, needle, needlesize, start);
-    } else if (malformed==malformed_8) {
-        haystack = sqlite3_value_text(args[0]);
-        if (!haystack)
-            goto nomem;
-        stacksize = sqlite3_value_bytes(args[0]);
-        needle = sqlite3_value_text(args[1]);
-        if (!needle)
-            goto nomem;
-        needlesize = sqlite3_value_bytes(args[1]);
-        result = instr_utf8(haystack, stacksize, needle, needlesize, start);
-    } else if (malformed==malformed_16) {
-        haystack = sqlite3_value_text16(args[0]);
-        if (!haystack)
-            goto nomem;
-        stacksize = sqlite3_value_bytes16(args[0])&~(vsize)1;
-        needle = sqlite3_value_text16(args[1]);
-        if (!needle)
-            goto nomem;
-        needlesize = sqlite3_value_bytes16(args[1])&~(vsize)1;
-        result = instr_utf16(haystack, stacksize, needle, needlesize, start);
-    } else {
-        goto confused;
+    if (stacksize<needlesize)
+        return 0;
+    first = needle[0];
+    last = needle[needlesize-1];
+    limit = needlesize-1;
+    window = haystack+(stacksize-needlesize);
+    for (;;) {
+        if (ASCII_FOLD(window[0])==first && ASCII_FOLD(window[limit])==last) {
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(window, needle, needlesize))
+                return window;
+        }
+        if (window==haystack)
+            return 0;
+        window--;
     }
-    if (result<0) {
-        sqlite3_result_error(context, malformed, -1);
-    } else {
-        sqlite3_result_int64(context, result);
+}
+
+static unsigned char const *find_byte_scalar(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    return memchr(haystack, c, stacksize);
+}
+
+static unsigned char const *rfind_byte_scalar(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    while (stacksize>0) {
+        stacksize--;
+        if (haystack[stacksize]==c)
+            return haystack+stacksize;
     }
-    return;
+    return 0;
+}
 
-confused:
-    sqlite3_result_error(context, confused, sizeof confused-1);
-    return;
+static sqlite3_int64 count_byte_scalar(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    sqlite3_int64 count;
 
-nomem:
-    sqlite3_result_error_nomem(context);
+    count = 0;
+    while (stacksize>0) {
+        count += *haystack++==c;
+        stacksize--;
+    }
+    return count;
 }
 
-static sqlite3_int64 rinstr_blob(
+static unsigned char const *find_pair_scalar(
     unsigned char const *haystack,
     vsize stacksize,
     unsigned char const *needle,
     vsize needlesize,
-    sqlite3_int64 start)
+    vsize const *skips)
 {
-    bmh_skips skips;
-    sqlite3_int64 found;
+    while (stacksize>=needlesize) {
+        vsize skip;
 
-    if (start<=0)
-        return 0;
-    if (needlesize>stacksize)
-        return 0;
-    if (start>1) {
-        if (start-1>(sqlite3_int64)(stacksize-needlesize))
-            start = stacksize-needlesize+1;
-        found = start;
-        stacksize = start-1;
-        haystack += stacksize;
-    } else {
-        found = 1;
-        stacksize = 0;
+        STAT(STAT_CANDIDATES, 1);
+        if (!memcmp(haystack, needle, needlesize))
+            return haystack;
+        skip = skips[haystack[needlesize-1]];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        haystack += skip;
+        stacksize -= skip;
     }
-    if (needlesize<=0)
-        return found;
-    if (needlesize>1) {
-        rbmh_setup(needle, needlesize, 0, skips);
-        for (;;) {
-            vsize skip;
+    return 0;
+}
 
-            if (!memcmp(haystack, needle, needlesize))
-                return found;
-            skip = skips[haystack[0]];
-            if (skip>stacksize)
-                return 0;
-            haystack -= skip;
-            stacksize -= skip;
-            found -= skip;
-        }
-    } else {
-        unsigned int first;
+static unsigned char const *rfind_pair_scalar(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    unsigned char const *window;
+    vsize left;
 
-        first = needle[0];
-        for (;;) {
-            if (haystack[0]==first)
-                return found;
-            if (stacksize<=0)
-                return 0;
-            haystack--;
-            stacksize--;
-            found--;
-        }
+    left = stacksize-needlesize;
+    window = haystack+left;
+    for (;;) {
+        vsize skip;
+
+        STAT(STAT_CANDIDATES, 1);
+        if (!memcmp(window, needle, needlesize))
+            return window;
+        skip = skips[window[0]];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>left)
+            return 0;
+        window -= skip;
+        left -= skip;
     }
 }
 
-static sqlite3_int64 rinstr_utf8(
-    unsigned char const *haystack,
-    vsize stacksize,
-    unsigned char const *needle,
-    vsize needlesize,
-    sqlite3_int64 start)
+static unsigned short const *find_pair16_scalar(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    while (stacksize>=needlesize) {
+        vsize skip;
+
+        STAT(STAT_CANDIDATES, 1);
+        if (!memcmp(haystack, needle, needlesize*2))
+            return haystack;
+        skip = skips[UNIT_HASH(haystack[needlesize-1])];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        haystack += skip;
+        stacksize -= skip;
+    }
+    return 0;
+}
+
+static unsigned short const *rfind_pair16_scalar(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    unsigned short const *window;
+    vsize left;
+
+    left = stacksize-needlesize;
+    window = haystack+left;
+    for (;;) {
+        vsize skip;
+
+        STAT(STAT_CANDIDATES, 1);
+        if (!memcmp(window, needle, needlesize*2))
+            return window;
+        skip = skips[UNIT_HASH(window[0])];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>left)
+            return 0;
+        window -= skip;
+        left -= skip;
+    }
+}
+
+static unsigned char const *find_fold_scalar(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    while (stacksize>=needlesize) {
+        vsize skip;
+
+        STAT(STAT_CANDIDATES, 1);
+        if (fold_equal(haystack, needle, needlesize))
+            return haystack;
+        skip = skips[ASCII_FOLD(haystack[needlesize-1])];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        haystack += skip;
+        stacksize -= skip;
+    }
+    return 0;
+}
+
+static unsigned char const *rfind_fold_scalar(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    unsigned char const *window;
+    vsize left;
+
+    left = stacksize-needlesize;
+    window = haystack+left;
+    for (;;) {
+        vsize skip;
+
+        STAT(STAT_CANDIDATES, 1);
+        if (fold_equal(window, needle, needlesize))
+            return window;
+        skip = skips[ASCII_FOLD(window[0])];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>left)
+            return 0;
+        window -= skip;
+        left -= skip;
+    }
+}
+
+static int utf8_count_scalar(
+    unsigned char const *text,
+    vsize size,
+    sqlite3_int64 *countOut)
+{
+    sqlite3_int64 count;
+    int codepoint;
+
+    count = 0;
+    while (size>0) {
+        UTF8_ADVANCE(text, size, codepoint);
+        if (codepoint==-1)
+            return -1;
+        count++;
+    }
+    *countOut = count;
+    return 0;
+}
+
+static sqlite3_int64 utf8_leads_scalar(
+    unsigned char const *text,
+    vsize size)
+{
+    sqlite3_int64 count;
+
+    count = 0;
+    while (size>0) {
+        count += (signed char)*text++>-65;
+        size--;
+    }
+    return count;
+}
+
+static sqlite3_int64 utf16_leads_scalar(
+    unsigned short const *text,
+    vsize units,
+    int swapped)
+{
+    unsigned int mask, low;
+    sqlite3_int64 count;
+
+    mask = swapped ? 0x00FC : 0xFC00;
+    low = swapped ? 0x00DC : 0xDC00;
+    count = 0;
+    while (units>0) {
+        count += (*text++&mask)!=low;
+        units--;
+    }
+    return count;
+}
+
+static kernelset const scalar_kernels =
+{
+    find_byte_scalar,
+    find_pair_scalar,
+    rfind_byte_scalar,
+    rfind_pair_scalar,
+    find_pair16_scalar,
+    rfind_pair16_scalar,
+    find_fold_scalar,
+    rfind_fold_scalar,
+    count_byte_scalar,
+    utf8_count_scalar,
+    utf8_leads_scalar,
+    utf16_leads_scalar,
+    1
+};
+
+#if HAVE_X86 || HAVE_NEON
+
+/*
+ * Lookup tables for the vector UTF-8 validator, after Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte".  Each table
+ * maps one nibble of a byte pair to the errors that pair could be part
+ * of, so ANDing the three lookups leaves only the errors actually there.
+ * A continuation byte where none is due shows up as TWO_CONTS, which
+ * is then cancelled for the third and fourth bytes of long sequences.
+ */
+#define U8_TOO_SHORT    0x01
+#define U8_TOO_LONG     0x02
+#define U8_OVERLONG_3   0x04
+#define U8_TOO_LARGE    0x08
+#define U8_SURROGATE    0x10
+#define U8_OVERLONG_2   0x20
+#define U8_TOO_LARGE_1000 0x40
+#define U8_OVERLONG_4   0x40
+#define U8_TWO_CONTS    0x80
+#define U8_CARRY        (U8_TOO_SHORT|U8_TOO_LONG|U8_TWO_CONTS)
+
+static unsigned char const utf8_byte1_high[16] =
+{
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+    U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+    U8_TOO_SHORT|U8_OVERLONG_2,
+    U8_TOO_SHORT,
+    U8_TOO_SHORT|U8_OVERLONG_3|U8_SURROGATE,
+    U8_TOO_SHORT|U8_TOO_LARGE|U8_TOO_LARGE_1000|U8_OVERLONG_4
+};
+
+static unsigned char const utf8_byte1_low[16] =
+{
+    U8_CARRY|U8_OVERLONG_3|U8_OVERLONG_2|U8_OVERLONG_4,
+    U8_CARRY|U8_OVERLONG_2,
+    U8_CARRY,
+    U8_CARRY,
+    U8_CARRY|U8_TOO_LARGE,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000|U8_SURROGATE,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000,
+    U8_CARRY|U8_TOO_LARGE|U8_TOO_LARGE_1000
+};
+
+static unsigned char const utf8_byte2_high[16] =
+{
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_LONG|U8_OVERLONG_2|U8_TWO_CONTS
+        |U8_OVERLONG_3|U8_TOO_LARGE_1000|U8_OVERLONG_4,
+    U8_TOO_LONG|U8_OVERLONG_2|U8_TWO_CONTS|U8_OVERLONG_3|U8_TOO_LARGE,
+    U8_TOO_LONG|U8_OVERLONG_2|U8_TWO_CONTS|U8_SURROGATE|U8_TOO_LARGE,
+    U8_TOO_LONG|U8_OVERLONG_2|U8_TWO_CONTS|U8_SURROGATE|U8_TOO_LARGE,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+};
+
+#endif
+
+#if HAVE_X86
+
+/*
+ * Not __popcnt, which needs a CPU that has the instruction.
+ */
+static unsigned int popcount32(
+    unsigned int bits)
+{
+#if defined(__GNUC__)
+    return __builtin_popcount(bits);
+#else
+    bits -= bits>>1 & 0x55555555;
+    bits = (bits&0x33333333)+(bits>>2 & 0x33333333);
+    return (bits+(bits>>4) & 0x0F0F0F0F)*0x01010101>>24;
+#endif
+}
+
+TARGET("sse2")
+static unsigned char const *find_byte_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m128i vc;
+
+    vc = _mm_set1_epi8((char)c);
+    while (stacksize>=16) {
+        unsigned int bits;
+
+        bits = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((__m128i const *)haystack), vc));
+        if (bits)
+            return haystack+lowest_bit(bits);
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return memchr(haystack, c, stacksize);
+}
+
+TARGET("sse2")
+static unsigned char const *find_pair_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m128i first, last;
+    vsize limit;
+
+    first = _mm_set1_epi8((char)needle[0]);
+    last = _mm_set1_epi8((char)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=16) {
+        unsigned int bits;
+
+        bits = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i const *)haystack), first),
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i const *)(haystack+limit)), last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix+1, needle+1, needlesize-2))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return find_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("sse2")
+static unsigned char const *rfind_byte_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m128i vc;
+
+    vc = _mm_set1_epi8((char)c);
+    while (stacksize>=16) {
+        unsigned int bits;
+
+        stacksize -= 16;
+        bits = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((__m128i const *)(haystack+stacksize)), vc));
+        if (bits)
+            return haystack+stacksize+highest_bit(bits);
+    }
+    return rfind_byte_scalar(haystack, stacksize, c);
+}
+
+TARGET("sse2")
+static unsigned char const *rfind_pair_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m128i first, last;
+    vsize limit;
+
+    first = _mm_set1_epi8((char)needle[0]);
+    last = _mm_set1_epi8((char)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=16) {
+        unsigned char const *block;
+        unsigned int bits;
+
+        stacksize -= 16;
+        block = haystack+(stacksize-limit);
+        bits = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i const *)block), first),
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i const *)(block+limit)), last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix+1, needle+1, needlesize-2))
+                return block+ix;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+/*
+ * The SSE2, AVX2 and NEON count_byte kernels subtract comparison masks
+ * from per-lane byte counters, and sum those up every 255 blocks,
+ * before they can overflow.
+ */
+TARGET("sse2")
+static sqlite3_int64 count_byte_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m128i vc, zero, acc;
+    sqlite3_int64 count;
+    vsize run;
+
+    vc = _mm_set1_epi8((char)c);
+    zero = _mm_setzero_si128();
+    count = 0;
+    while (stacksize>=16) {
+        run = stacksize/16<255 ? stacksize/16 : 255;
+        stacksize -= run*16;
+        acc = zero;
+        while (run>0) {
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i const *)haystack), vc));
+            haystack += 16;
+            run--;
+        }
+        acc = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(acc)+_mm_extract_epi16(acc, 4);
+    }
+    return count+count_byte_scalar(haystack, stacksize, c);
+}
+
+/*
+ * Without a byte shuffle, the best SSE2 can do
+ * is skip over runs of ASCII quickly.
+ */
+TARGET("sse2")
+static int utf8_count_sse2(
+    unsigned char const *text,
+    vsize size,
+    sqlite3_int64 *countOut)
+{
+    sqlite3_int64 count;
+    int codepoint;
+
+    count = 0;
+    while (size>=16) {
+        unsigned char const *end;
+
+        if (!_mm_movemask_epi8(_mm_loadu_si128((__m128i const *)text))) {
+            text += 16;
+            size -= 16;
+            count += 16;
+            continue;
+        }
+        end = text+16;
+        while (text<end) {
+            UTF8_ADVANCE(text, size, codepoint);
+            if (codepoint==-1)
+                return -1;
+            count++;
+        }
+    }
+    while (size>0) {
+        UTF8_ADVANCE(text, size, codepoint);
+        if (codepoint==-1)
+            return -1;
+        count++;
+    }
+    *countOut = count;
+    return 0;
+}
+
+TARGET("sse2")
+static sqlite3_int64 utf8_leads_sse2(
+    unsigned char const *text,
+    vsize size)
+{
+    __m128i lead;
+    sqlite3_int64 count;
+
+    lead = _mm_set1_epi8((char)0xBF);
+    count = 0;
+    while (size>=16) {
+        count += popcount32(_mm_movemask_epi8(_mm_cmpgt_epi8(
+            _mm_loadu_si128((__m128i const *)text), lead)));
+        text += 16;
+        size -= 16;
+    }
+    return count+utf8_leads_scalar(text, size);
+}
+
+TARGET("sse2")
+static sqlite3_int64 utf16_leads_sse2(
+    unsigned short const *text,
+    vsize units,
+    int swapped)
+{
+    __m128i mask, low;
+    sqlite3_int64 count;
+
+    mask = _mm_set1_epi16(swapped ? 0x00FC : (short)0xFC00);
+    low = _mm_set1_epi16(swapped ? 0x00DC : (short)0xDC00);
+    count = 0;
+    while (units>=8) {
+        count += 8-popcount32(_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(_mm_loadu_si128((__m128i const *)text), mask),
+            low)))/2;
+        text += 8;
+        units -= 8;
+    }
+    return count+utf16_leads_scalar(text, units, swapped);
+}
+
+/*
+ * The 16-bit kernels compare whole code units, so every candidate they
+ * turn up is aligned; each unit sets two mask bits, of which the even
+ * one is kept.
+ */
+TARGET("sse2")
+static unsigned short const *find_pair16_sse2(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m128i first, last;
+    vsize limit;
+
+    first = _mm_set1_epi16((short)needle[0]);
+    last = _mm_set1_epi16((short)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=8) {
+        unsigned int bits;
+
+        bits = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi16(
+                _mm_loadu_si128((__m128i const *)haystack), first),
+            _mm_cmpeq_epi16(
+                _mm_loadu_si128((__m128i const *)(haystack+limit)), last)))
+            & 0x5555;
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits)/2;
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix, needle, needlesize*2))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 8;
+        stacksize -= 8;
+    }
+    return find_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("sse2")
+static unsigned short const *rfind_pair16_sse2(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m128i first, last;
+    vsize limit;
+
+    first = _mm_set1_epi16((short)needle[0]);
+    last = _mm_set1_epi16((short)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=8) {
+        unsigned short const *block;
+        unsigned int bits;
+
+        stacksize -= 8;
+        block = haystack+(stacksize-limit);
+        bits = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi16(
+                _mm_loadu_si128((__m128i const *)block), first),
+            _mm_cmpeq_epi16(
+                _mm_loadu_si128((__m128i const *)(block+limit)), last)))
+            & 0x5555;
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix/2, needle, needlesize*2))
+                return block+ix/2;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("sse2")
+static unsigned char const *find_fold_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m128i first, last, firstmask, lastmask;
+    vsize limit;
+
+    limit = needlesize-1;
+    first = _mm_set1_epi8((char)needle[0]);
+    last = _mm_set1_epi8((char)needle[limit]);
+    firstmask = _mm_set1_epi8((char)FOLD_MASK(needle[0]));
+    lastmask = _mm_set1_epi8((char)FOLD_MASK(needle[limit]));
+    while (stacksize-limit>=16) {
+        unsigned int bits;
+
+        bits = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_or_si128(
+                _mm_loadu_si128((__m128i const *)haystack), firstmask),
+                first),
+            _mm_cmpeq_epi8(_mm_or_si128(
+                _mm_loadu_si128((__m128i const *)(haystack+limit)),
+                lastmask), last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(haystack+ix, needle, needlesize))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return find_fold_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("sse2")
+static unsigned char const *rfind_fold_sse2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m128i first, last, firstmask, lastmask;
+    vsize limit;
+
+    limit = needlesize-1;
+    first = _mm_set1_epi8((char)needle[0]);
+    last = _mm_set1_epi8((char)needle[limit]);
+    firstmask = _mm_set1_epi8((char)FOLD_MASK(needle[0]));
+    lastmask = _mm_set1_epi8((char)FOLD_MASK(needle[limit]));
+    while (stacksize-limit>=16) {
+        unsigned char const *block;
+        unsigned int bits;
+
+        stacksize -= 16;
+        block = haystack+(stacksize-limit);
+        bits = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_or_si128(
+                _mm_loadu_si128((__m128i const *)block), firstmask),
+                first),
+            _mm_cmpeq_epi8(_mm_or_si128(
+                _mm_loadu_si128((__m128i const *)(block+limit)),
+                lastmask), last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(block+ix, needle, needlesize))
+                return block+ix;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_fold_tail(haystack, stacksize, needle, needlesize);
+}
+
+static kernelset const sse2_kernels =
+{
+    find_byte_sse2,
+    find_pair_sse2,
+    rfind_byte_sse2,
+    rfind_pair_sse2,
+    find_pair16_sse2,
+    rfind_pair16_sse2,
+    find_fold_sse2,
+    rfind_fold_sse2,
+    count_byte_sse2,
+    utf8_count_sse2,
+    utf8_leads_sse2,
+    utf16_leads_sse2,
+    0
+};
+
+TARGET("avx2")
+static unsigned char const *find_byte_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m256i vc;
+
+    vc = _mm256_set1_epi8((char)c);
+    while (stacksize>=32) {
+        unsigned int bits;
+
+        bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((__m256i const *)haystack), vc));
+        if (bits)
+            return haystack+lowest_bit(bits);
+        haystack += 32;
+        stacksize -= 32;
+    }
+    return memchr(haystack, c, stacksize);
+}
+
+TARGET("avx2")
+static unsigned char const *find_pair_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m256i first, last;
+    vsize limit;
+
+    first = _mm256_set1_epi8((char)needle[0]);
+    last = _mm256_set1_epi8((char)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=32) {
+        unsigned int bits;
+
+        bits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i const *)haystack), first),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i const *)(haystack+limit)),
+                last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix+1, needle+1, needlesize-2))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 32;
+        stacksize -= 32;
+    }
+    return find_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx2")
+static unsigned char const *rfind_byte_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m256i vc;
+
+    vc = _mm256_set1_epi8((char)c);
+    while (stacksize>=32) {
+        unsigned int bits;
+
+        stacksize -= 32;
+        bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((__m256i const *)(haystack+stacksize)), vc));
+        if (bits)
+            return haystack+stacksize+highest_bit(bits);
+    }
+    return rfind_byte_scalar(haystack, stacksize, c);
+}
+
+TARGET("avx2")
+static unsigned char const *rfind_pair_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m256i first, last;
+    vsize limit;
+
+    first = _mm256_set1_epi8((char)needle[0]);
+    last = _mm256_set1_epi8((char)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=32) {
+        unsigned char const *block;
+        unsigned int bits;
+
+        stacksize -= 32;
+        block = haystack+(stacksize-limit);
+        bits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i const *)block), first),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i const *)(block+limit)),
+                last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix+1, needle+1, needlesize-2))
+                return block+ix;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx2")
+static sqlite3_int64 count_byte_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m256i vc, zero, acc;
+    __m128i sums;
+    sqlite3_int64 count;
+    vsize run;
+
+    vc = _mm256_set1_epi8((char)c);
+    zero = _mm256_setzero_si256();
+    count = 0;
+    while (stacksize>=32) {
+        run = stacksize/32<255 ? stacksize/32 : 255;
+        stacksize -= run*32;
+        acc = zero;
+        while (run>0) {
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i const *)haystack), vc));
+            haystack += 32;
+            run--;
+        }
+        acc = _mm256_sad_epu8(acc, zero);
+        sums = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                             _mm256_extracti128_si256(acc, 1));
+        count += _mm_cvtsi128_si32(sums)+_mm_extract_epi16(sums, 4);
+    }
+    return count+count_byte_scalar(haystack, stacksize, c);
+}
+
+/*
+ * Validate 32 bytes at a time with the lookup tables above, and count
+ * the bytes that aren't continuation bytes.  The text is padded out
+ * with at least one block of zeros, so a sequence that's cut short
+ * at the end gets flagged like any other.
+ */
+TARGET("avx2,popcnt")
+static int utf8_count_avx2(
+    unsigned char const *text,
+    vsize size,
+    sqlite3_int64 *countOut)
+{
+    __m256i byte1high, byte1low, byte2high, nibble, lead;
+    __m256i prev, error;
+    unsigned char block[32];
+    sqlite3_int64 count;
+    int last;
+
+    byte1high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((__m128i const *)utf8_byte1_high));
+    byte1low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((__m128i const *)utf8_byte1_low));
+    byte2high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((__m128i const *)utf8_byte2_high));
+    nibble = _mm256_set1_epi8(0x0F);
+    lead = _mm256_set1_epi8((char)0xBF);
+    prev = error = _mm256_setzero_si256();
+    count = 0;
+    last = 0;
+    do {
+        __m256i input;
+        unsigned int valid;
+
+        if (size>=32) {
+            input = _mm256_loadu_si256((__m256i const *)text);
+            valid = ~0U;
+            text += 32;
+            size -= 32;
+        } else {
+            memset(block, 0, sizeof block);
+            memcpy(block, text, size);
+            input = _mm256_loadu_si256((__m256i const *)block);
+            valid = (1U<<size)-1;
+            last = 1;
+        }
+        if (_mm256_movemask_epi8(_mm256_or_si256(input, prev))) {
+            __m256i carry, prev1, prev2, prev3, special, must23;
+
+            carry = _mm256_permute2x128_si256(prev, input, 0x21);
+            prev1 = _mm256_alignr_epi8(input, carry, 15);
+            prev2 = _mm256_alignr_epi8(input, carry, 14);
+            prev3 = _mm256_alignr_epi8(input, carry, 13);
+            special = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(byte1high, _mm256_and_si256(
+                        _mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte1low, _mm256_and_si256(
+                        prev1, nibble))),
+                _mm256_shuffle_epi8(byte2high, _mm256_and_si256(
+                    _mm256_srli_epi16(input, 4), nibble)));
+            must23 = _mm256_or_si256(
+                _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0-0x80)),
+                _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0-0x80)));
+            error = _mm256_or_si256(error, _mm256_xor_si256(special,
+                _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80))));
+            valid &= _mm256_movemask_epi8(_mm256_cmpgt_epi8(input, lead));
+        }
+        count += popcount32(valid);
+        prev = input;
+    } while (!last);
+    if (!_mm256_testz_si256(error, error))
+        return -1;
+    *countOut = count;
+    return 0;
+}
+
+TARGET("avx2,popcnt")
+static sqlite3_int64 utf8_leads_avx2(
+    unsigned char const *text,
+    vsize size)
+{
+    __m256i lead;
+    sqlite3_int64 count;
+
+    lead = _mm256_set1_epi8((char)0xBF);
+    count = 0;
+    while (size>=32) {
+        count += popcount32(_mm256_movemask_epi8(_mm256_cmpgt_epi8(
+            _mm256_loadu_si256((__m256i const *)text), lead)));
+        text += 32;
+        size -= 32;
+    }
+    return count+utf8_leads_scalar(text, size);
+}
+
+TARGET("avx2,popcnt")
+static sqlite3_int64 utf16_leads_avx2(
+    unsigned short const *text,
+    vsize units,
+    int swapped)
+{
+    __m256i mask, low;
+    sqlite3_int64 count;
+
+    mask = _mm256_set1_epi16(swapped ? 0x00FC : (short)0xFC00);
+    low = _mm256_set1_epi16(swapped ? 0x00DC : (short)0xDC00);
+    count = 0;
+    while (units>=16) {
+        count += 16-popcount32(_mm256_movemask_epi8(_mm256_cmpeq_epi16(
+            _mm256_and_si256(
+                _mm256_loadu_si256((__m256i const *)text), mask),
+            low)))/2;
+        text += 16;
+        units -= 16;
+    }
+    return count+utf16_leads_scalar(text, units, swapped);
+}
+
+TARGET("avx2")
+static unsigned short const *find_pair16_avx2(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m256i first, last;
+    vsize limit;
+
+    first = _mm256_set1_epi16((short)needle[0]);
+    last = _mm256_set1_epi16((short)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=16) {
+        unsigned int bits;
+
+        bits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi16(
+                _mm256_loadu_si256((__m256i const *)haystack), first),
+            _mm256_cmpeq_epi16(
+                _mm256_loadu_si256((__m256i const *)(haystack+limit)),
+                last))) & 0x55555555;
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits)/2;
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix, needle, needlesize*2))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return find_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx2")
+static unsigned short const *rfind_pair16_avx2(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m256i first, last;
+    vsize limit;
+
+    first = _mm256_set1_epi16((short)needle[0]);
+    last = _mm256_set1_epi16((short)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=16) {
+        unsigned short const *block;
+        unsigned int bits;
+
+        stacksize -= 16;
+        block = haystack+(stacksize-limit);
+        bits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi16(
+                _mm256_loadu_si256((__m256i const *)block), first),
+            _mm256_cmpeq_epi16(
+                _mm256_loadu_si256((__m256i const *)(block+limit)),
+                last))) & 0x55555555;
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix/2, needle, needlesize*2))
+                return block+ix/2;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx2")
+static unsigned char const *find_fold_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m256i first, last, firstmask, lastmask;
+    vsize limit;
+
+    limit = needlesize-1;
+    first = _mm256_set1_epi8((char)needle[0]);
+    last = _mm256_set1_epi8((char)needle[limit]);
+    firstmask = _mm256_set1_epi8((char)FOLD_MASK(needle[0]));
+    lastmask = _mm256_set1_epi8((char)FOLD_MASK(needle[limit]));
+    while (stacksize-limit>=32) {
+        unsigned int bits;
+
+        bits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_or_si256(
+                _mm256_loadu_si256((__m256i const *)haystack), firstmask),
+                first),
+            _mm256_cmpeq_epi8(_mm256_or_si256(
+                _mm256_loadu_si256((__m256i const *)(haystack+limit)),
+                lastmask), last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(haystack+ix, needle, needlesize))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 32;
+        stacksize -= 32;
+    }
+    return find_fold_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx2")
+static unsigned char const *rfind_fold_avx2(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m256i first, last, firstmask, lastmask;
+    vsize limit;
+
+    limit = needlesize-1;
+    first = _mm256_set1_epi8((char)needle[0]);
+    last = _mm256_set1_epi8((char)needle[limit]);
+    firstmask = _mm256_set1_epi8((char)FOLD_MASK(needle[0]));
+    lastmask = _mm256_set1_epi8((char)FOLD_MASK(needle[limit]));
+    while (stacksize-limit>=32) {
+        unsigned char const *block;
+        unsigned int bits;
+
+        stacksize -= 32;
+        block = haystack+(stacksize-limit);
+        bits = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_or_si256(
+                _mm256_loadu_si256((__m256i const *)block), firstmask),
+                first),
+            _mm256_cmpeq_epi8(_mm256_or_si256(
+                _mm256_loadu_si256((__m256i const *)(block+limit)),
+                lastmask), last)));
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(block+ix, needle, needlesize))
+                return block+ix;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_fold_tail(haystack, stacksize, needle, needlesize);
+}
+
+static kernelset const avx2_kernels =
+{
+    find_byte_avx2,
+    find_pair_avx2,
+    rfind_byte_avx2,
+    rfind_pair_avx2,
+    find_pair16_avx2,
+    rfind_pair16_avx2,
+    find_fold_avx2,
+    rfind_fold_avx2,
+    count_byte_avx2,
+    utf8_count_avx2,
+    utf8_leads_avx2,
+    utf16_leads_avx2,
+    0
+};
+
+TARGET("avx512f,avx512bw")
+static unsigned char const *find_byte_avx512(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m512i vc;
+
+    vc = _mm512_set1_epi8((char)c);
+    while (stacksize>=64) {
+        unsigned long long bits;
+
+        bits = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(haystack), vc);
+        if (bits)
+            return haystack+lowest_bit64(bits);
+        haystack += 64;
+        stacksize -= 64;
+    }
+    return memchr(haystack, c, stacksize);
+}
+
+TARGET("avx512f,avx512bw")
+static unsigned char const *find_pair_avx512(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m512i first, last;
+    vsize limit;
+
+    first = _mm512_set1_epi8((char)needle[0]);
+    last = _mm512_set1_epi8((char)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=64) {
+        unsigned long long bits;
+
+        bits = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(haystack), first)
+            & _mm512_cmpeq_epi8_mask(
+                _mm512_loadu_si512(haystack+limit), last);
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit64(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix+1, needle+1, needlesize-2))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 64;
+        stacksize -= 64;
+    }
+    return find_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx512f,avx512bw")
+static unsigned char const *rfind_byte_avx512(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m512i vc;
+
+    vc = _mm512_set1_epi8((char)c);
+    while (stacksize>=64) {
+        unsigned long long bits;
+
+        stacksize -= 64;
+        bits = _mm512_cmpeq_epi8_mask(
+            _mm512_loadu_si512(haystack+stacksize), vc);
+        if (bits)
+            return haystack+stacksize+highest_bit64(bits);
+    }
+    return rfind_byte_scalar(haystack, stacksize, c);
+}
+
+TARGET("avx512f,avx512bw")
+static unsigned char const *rfind_pair_avx512(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m512i first, last;
+    vsize limit;
+
+    first = _mm512_set1_epi8((char)needle[0]);
+    last = _mm512_set1_epi8((char)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=64) {
+        unsigned char const *block;
+        unsigned long long bits;
+
+        stacksize -= 64;
+        block = haystack+(stacksize-limit);
+        bits = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(block), first)
+            & _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(block+limit), last);
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit64(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix+1, needle+1, needlesize-2))
+                return block+ix;
+            bits &= ~(1ULL<<ix);
+        }
+    }
+    return rfind_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx512f,avx512bw")
+static sqlite3_int64 count_byte_avx512(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    __m512i vc;
+    sqlite3_int64 count;
+
+    vc = _mm512_set1_epi8((char)c);
+    count = 0;
+    while (stacksize>=64) {
+        unsigned long long bits;
+
+        bits = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(haystack), vc);
+        count += popcount32((unsigned int)bits)
+            +popcount32((unsigned int)(bits>>32));
+        haystack += 64;
+        stacksize -= 64;
+    }
+    return count+count_byte_scalar(haystack, stacksize, c);
+}
+
+TARGET("avx512f,avx512bw")
+static unsigned short const *find_pair16_avx512(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m512i first, last;
+    vsize limit;
+
+    first = _mm512_set1_epi16((short)needle[0]);
+    last = _mm512_set1_epi16((short)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=32) {
+        unsigned int bits;
+
+        bits = _mm512_cmpeq_epi16_mask(_mm512_loadu_si512(haystack), first)
+            & _mm512_cmpeq_epi16_mask(
+                _mm512_loadu_si512(haystack+limit), last);
+        while (bits) {
+            unsigned int ix;
+
+            ix = lowest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix, needle, needlesize*2))
+                return haystack+ix;
+            bits &= bits-1;
+        }
+        haystack += 32;
+        stacksize -= 32;
+    }
+    return find_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+TARGET("avx512f,avx512bw")
+static unsigned short const *rfind_pair16_avx512(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    __m512i first, last;
+    vsize limit;
+
+    first = _mm512_set1_epi16((short)needle[0]);
+    last = _mm512_set1_epi16((short)needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=32) {
+        unsigned short const *block;
+        unsigned int bits;
+
+        stacksize -= 32;
+        block = haystack+(stacksize-limit);
+        bits = _mm512_cmpeq_epi16_mask(_mm512_loadu_si512(block), first)
+            & _mm512_cmpeq_epi16_mask(_mm512_loadu_si512(block+limit), last);
+        while (bits) {
+            unsigned int ix;
+
+            ix = highest_bit(bits);
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix, needle, needlesize*2))
+                return block+ix;
+            bits &= ~(1U<<ix);
+        }
+    }
+    return rfind_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+static kernelset const avx512_kernels =
+{
+    find_byte_avx512,
+    find_pair_avx512,
+    rfind_byte_avx512,
+    rfind_pair_avx512,
+    find_pair16_avx512,
+    rfind_pair16_avx512,
+    find_fold_avx2,
+    rfind_fold_avx2,
+    count_byte_avx512,
+    utf8_count_avx2,
+    utf8_leads_avx2,
+    utf16_leads_avx2,
+    0
+};
+
+#endif
+
+#if HAVE_NEON
+
+/*
+ * NEON has no movemask; narrowing each 16-bit lane by 4 bits
+ * leaves one nibble per byte in a 64-bit scalar instead.
+ */
+static unsigned long long neon_nibbles(
+    uint8x16_t matches)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+}
+
+static unsigned char const *find_byte_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    uint8x16_t vc;
+
+    vc = vdupq_n_u8((unsigned char)c);
+    while (stacksize>=16) {
+        unsigned long long nibbles;
+
+        nibbles = neon_nibbles(vceqq_u8(vld1q_u8(haystack), vc));
+        if (nibbles)
+            return haystack+(lowest_bit64(nibbles)>>2);
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return memchr(haystack, c, stacksize);
+}
+
+static unsigned char const *find_pair_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    uint8x16_t first, last;
+    vsize limit;
+
+    first = vdupq_n_u8(needle[0]);
+    last = vdupq_n_u8(needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=16) {
+        unsigned long long nibbles;
+
+        nibbles = neon_nibbles(vandq_u8(
+            vceqq_u8(vld1q_u8(haystack), first),
+            vceqq_u8(vld1q_u8(haystack+limit), last)));
+        while (nibbles) {
+            unsigned int ix;
+
+            ix = lowest_bit64(nibbles)>>2;
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix+1, needle+1, needlesize-2))
+                return haystack+ix;
+            nibbles &= ~(0xFULL<<ix*4);
+        }
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return find_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+static unsigned char const *rfind_byte_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    uint8x16_t vc;
+
+    vc = vdupq_n_u8((unsigned char)c);
+    while (stacksize>=16) {
+        unsigned long long nibbles;
+
+        stacksize -= 16;
+        nibbles = neon_nibbles(vceqq_u8(vld1q_u8(haystack+stacksize), vc));
+        if (nibbles)
+            return haystack+stacksize+(highest_bit64(nibbles)>>2);
+    }
+    return rfind_byte_scalar(haystack, stacksize, c);
+}
+
+static unsigned char const *rfind_pair_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    uint8x16_t first, last;
+    vsize limit;
+
+    first = vdupq_n_u8(needle[0]);
+    last = vdupq_n_u8(needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=16) {
+        unsigned char const *block;
+        unsigned long long nibbles;
+
+        stacksize -= 16;
+        block = haystack+(stacksize-limit);
+        nibbles = neon_nibbles(vandq_u8(
+            vceqq_u8(vld1q_u8(block), first),
+            vceqq_u8(vld1q_u8(block+limit), last)));
+        while (nibbles) {
+            unsigned int ix;
+
+            ix = highest_bit64(nibbles)>>2;
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix+1, needle+1, needlesize-2))
+                return block+ix;
+            nibbles &= ~(0xFULL<<ix*4);
+        }
+    }
+    return rfind_pair_tail(haystack, stacksize, needle, needlesize);
+}
+
+static sqlite3_int64 count_byte_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    uint8x16_t vc, acc;
+    sqlite3_int64 count;
+    vsize run;
+
+    vc = vdupq_n_u8((unsigned char)c);
+    count = 0;
+    while (stacksize>=16) {
+        run = stacksize/16<255 ? stacksize/16 : 255;
+        stacksize -= run*16;
+        acc = vdupq_n_u8(0);
+        while (run>0) {
+            acc = vsubq_u8(acc, vceqq_u8(vld1q_u8(haystack), vc));
+            haystack += 16;
+            run--;
+        }
+        count += vaddlvq_u8(acc);
+    }
+    return count+count_byte_scalar(haystack, stacksize, c);
+}
+
+/*
+ * The same validator as utf8_count_avx2, 16 bytes at a time.
+ */
+static int utf8_count_neon(
+    unsigned char const *text,
+    vsize size,
+    sqlite3_int64 *countOut)
+{
+    uint8x16_t byte1high, byte1low, byte2high, nibble;
+    uint8x16_t prev, error;
+    unsigned char block[16];
+    sqlite3_int64 count;
+    int last;
+
+    byte1high = vld1q_u8(utf8_byte1_high);
+    byte1low = vld1q_u8(utf8_byte1_low);
+    byte2high = vld1q_u8(utf8_byte2_high);
+    nibble = vdupq_n_u8(0x0F);
+    prev = error = vdupq_n_u8(0);
+    count = 0;
+    last = 0;
+    do {
+        uint8x16_t input;
+        vsize valid;
+
+        if (size>=16) {
+            input = vld1q_u8(text);
+            valid = 16;
+            text += 16;
+            size -= 16;
+        } else {
+            memset(block, 0, sizeof block);
+            memcpy(block, text, size);
+            input = vld1q_u8(block);
+            valid = size;
+            last = 1;
+        }
+        if (vmaxvq_u8(vorrq_u8(input, prev))>=0x80) {
+            uint8x16_t prev1, prev2, prev3, special, must23;
+
+            prev1 = vextq_u8(prev, input, 15);
+            prev2 = vextq_u8(prev, input, 14);
+            prev3 = vextq_u8(prev, input, 13);
+            special = vandq_u8(
+                vandq_u8(
+                    vqtbl1q_u8(byte1high, vshrq_n_u8(prev1, 4)),
+                    vqtbl1q_u8(byte1low, vandq_u8(prev1, nibble))),
+                vqtbl1q_u8(byte2high, vshrq_n_u8(input, 4)));
+            must23 = vorrq_u8(
+                vqsubq_u8(prev2, vdupq_n_u8(0xE0-0x80)),
+                vqsubq_u8(prev3, vdupq_n_u8(0xF0-0x80)));
+            error = vorrq_u8(error, veorq_u8(special,
+                vandq_u8(must23, vdupq_n_u8(0x80))));
+            /* the zero padding past the end counts as characters */
+            valid = vaddvq_u8(vshrq_n_u8(vcgtq_s8(
+                vreinterpretq_s8_u8(input), vdupq_n_s8(-65)), 7))
+                -(16-valid);
+        }
+        count += valid;
+        prev = input;
+    } while (!last);
+    if (vmaxvq_u8(error))
+        return -1;
+    *countOut = count;
+    return 0;
+}
+
+static sqlite3_int64 utf8_leads_neon(
+    unsigned char const *text,
+    vsize size)
+{
+    int8x16_t lead;
+    sqlite3_int64 count;
+
+    lead = vdupq_n_s8(-65);
+    count = 0;
+    while (size>=16) {
+        count += vaddvq_u8(vshrq_n_u8(vcgtq_s8(
+            vreinterpretq_s8_u8(vld1q_u8(text)), lead), 7));
+        text += 16;
+        size -= 16;
+    }
+    return count+utf8_leads_scalar(text, size);
+}
+
+static sqlite3_int64 utf16_leads_neon(
+    unsigned short const *text,
+    vsize units,
+    int swapped)
+{
+    uint16x8_t mask, low;
+    sqlite3_int64 count;
+
+    mask = vdupq_n_u16(swapped ? 0x00FC : 0xFC00);
+    low = vdupq_n_u16(swapped ? 0x00DC : 0xDC00);
+    count = 0;
+    while (units>=8) {
+        count += 8-vaddvq_u16(vshrq_n_u16(vceqq_u16(
+            vandq_u16(vld1q_u16(text), mask), low), 15));
+        text += 8;
+        units -= 8;
+    }
+    return count+utf16_leads_scalar(text, units, swapped);
+}
+
+/*
+ * Each 16-bit lane narrows to a whole byte here, two nibbles' worth.
+ */
+static unsigned short const *find_pair16_neon(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    uint16x8_t first, last;
+    vsize limit;
+
+    first = vdupq_n_u16(needle[0]);
+    last = vdupq_n_u16(needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=8) {
+        unsigned long long nibbles;
+
+        nibbles = neon_nibbles(vreinterpretq_u8_u16(vandq_u16(
+            vceqq_u16(vld1q_u16(haystack), first),
+            vceqq_u16(vld1q_u16(haystack+limit), last))));
+        while (nibbles) {
+            unsigned int ix;
+
+            ix = lowest_bit64(nibbles)>>3;
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack+ix, needle, needlesize*2))
+                return haystack+ix;
+            nibbles &= ~(0xFFULL<<ix*8);
+        }
+        haystack += 8;
+        stacksize -= 8;
+    }
+    return find_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+static unsigned short const *rfind_pair16_neon(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    uint16x8_t first, last;
+    vsize limit;
+
+    first = vdupq_n_u16(needle[0]);
+    last = vdupq_n_u16(needle[needlesize-1]);
+    limit = needlesize-1;
+    while (stacksize-limit>=8) {
+        unsigned short const *block;
+        unsigned long long nibbles;
+
+        stacksize -= 8;
+        block = haystack+(stacksize-limit);
+        nibbles = neon_nibbles(vreinterpretq_u8_u16(vandq_u16(
+            vceqq_u16(vld1q_u16(block), first),
+            vceqq_u16(vld1q_u16(block+limit), last))));
+        while (nibbles) {
+            unsigned int ix;
+
+            ix = highest_bit64(nibbles)>>3;
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(block+ix, needle, needlesize*2))
+                return block+ix;
+            nibbles &= ~(0xFFULL<<ix*8);
+        }
+    }
+    return rfind_pair16_tail(haystack, stacksize, needle, needlesize);
+}
+
+static unsigned char const *find_fold_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    uint8x16_t first, last, firstmask, lastmask;
+    vsize limit;
+
+    limit = needlesize-1;
+    first = vdupq_n_u8(needle[0]);
+    last = vdupq_n_u8(needle[limit]);
+    firstmask = vdupq_n_u8(FOLD_MASK(needle[0]));
+    lastmask = vdupq_n_u8(FOLD_MASK(needle[limit]));
+    while (stacksize-limit>=16) {
+        unsigned long long nibbles;
+
+        nibbles = neon_nibbles(vandq_u8(
+            vceqq_u8(vorrq_u8(vld1q_u8(haystack), firstmask), first),
+            vceqq_u8(vorrq_u8(vld1q_u8(haystack+limit), lastmask), last)));
+        while (nibbles) {
+            unsigned int ix;
+
+            ix = lowest_bit64(nibbles)>>2;
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(haystack+ix, needle, needlesize))
+                return haystack+ix;
+            nibbles &= ~(0xFULL<<ix*4);
+        }
+        haystack += 16;
+        stacksize -= 16;
+    }
+    return find_fold_tail(haystack, stacksize, needle, needlesize);
+}
+
+static unsigned char const *rfind_fold_neon(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    uint8x16_t first, last, firstmask, lastmask;
+    vsize limit;
+
+    limit = needlesize-1;
+    first = vdupq_n_u8(needle[0]);
+    last = vdupq_n_u8(needle[limit]);
+    firstmask = vdupq_n_u8(FOLD_MASK(needle[0]));
+    lastmask = vdupq_n_u8(FOLD_MASK(needle[limit]));
+    while (stacksize-limit>=16) {
+        unsigned char const *block;
+        unsigned long long nibbles;
+
+        stacksize -= 16;
+        block = haystack+(stacksize-limit);
+        nibbles = neon_nibbles(vandq_u8(
+            vceqq_u8(vorrq_u8(vld1q_u8(block), firstmask), first),
+            vceqq_u8(vorrq_u8(vld1q_u8(block+limit), lastmask), last)));
+        while (nibbles) {
+            unsigned int ix;
+
+            ix = highest_bit64(nibbles)>>2;
+            STAT(STAT_CANDIDATES, 1);
+            if (fold_equal(block+ix, needle, needlesize))
+                return block+ix;
+            nibbles &= ~(0xFULL<<ix*4);
+        }
+    }
+    return rfind_fold_tail(haystack, stacksize, needle, needlesize);
+}
+
+static kernelset const neon_kernels =
+{
+    find_byte_neon,
+    find_pair_neon,
+    rfind_byte_neon,
+    rfind_pair_neon,
+    find_pair16_neon,
+    rfind_pair16_neon,
+    find_fold_neon,
+    rfind_fold_neon,
+    count_byte_neon,
+    utf8_count_neon,
+    utf8_leads_neon,
+    utf16_leads_neon,
+    0
+};
+
+#endif
+
+static kernelset const *kernels = &scalar_kernels;
+
+#if INSTR_THREADS>1
+
+/*
+ * A big haystack is cut into a few pieces per thread, which the caller
+ * and the pool's workers take in turn.  A search takes the pieces nearest
+ * the end it starts from first and skips those lying beyond a piece that
+ * has already matched; each piece reaches needlesize-1 bytes (or code
+ * units) into the next, so a match straddling the cut is found by the
+ * piece it starts in.
+ * Counts just add up the pieces, whose bounds are moved off continuation
+ * bytes when the text is being checked as well as counted.
+ */
+#define JOB_FIND_BYTE       0
+#define JOB_FIND_PAIR       1
+#define JOB_FIND_PAIR16     2
+#define JOB_RFIND_BYTE      3
+#define JOB_RFIND_PAIR      4
+#define JOB_RFIND_PAIR16    5
+#define JOB_COUNT_BYTE      6
+#define JOB_UTF8_COUNT      7
+#define JOB_UTF8_LEADS      8
+#define JOB_UTF16_LEADS     9
+
+#define JOB_SEARCH(op)  ((op)<=JOB_RFIND_PAIR16)
+#define JOB_REVERSE(op) ((op)>=JOB_RFIND_BYTE && (op)<=JOB_RFIND_PAIR16)
+
+#define JOB_PIECES (INSTR_THREADS*4)
+
+typedef struct job {
+    int op;
+    unsigned char const *data;
+    vsize size;
+    void const *needle;
+    vsize needlesize;
+    vsize const *skips;
+    unsigned int c;
+    int swapped;
+    int next;
+    int pending;
+    int best;
+    void const *found[JOB_PIECES];
+    sqlite3_int64 counts[JOB_PIECES];
+} job;
+
+/*
+ * The pool's threads outlive the connection that started them, so
+ * in a shared library they're only started once the library has been
+ * pinned in memory; until then jobs run serially.  Built into the
+ * application it can't be unloaded.
+ */
+#ifdef SQLITE_CORE
+#define POOL_PINNED 1
+#else
+#define POOL_PINNED 0
+#endif
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t busy;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    job *current;
+    int pinned;
+    int started;
+} pool = {
+    PTHREAD_ONCE_INIT,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0,
+    POOL_PINNED,
+    0
+};
+
+static kernelset const *serial_kernels = &scalar_kernels;
+static kernelset threaded_kernels;
+
+static void job_init(
+    job *jb,
+    int op,
+    void const *data,
+    vsize size)
+{
+    jb->op = op;
+    jb->data = data;
+    jb->size = size;
+    jb->needle = 0;
+    jb->needlesize = 0;
+    jb->skips = 0;
+    jb->c = 0;
+    jb->swapped = 0;
+}
+
+static vsize piece_start(
+    job const *jb,
+    int piece)
+{
+    vsize ix;
+    int steps;
+
+    if (piece>=JOB_PIECES)
+        return jb->size;
+    ix = (vsize)((sqlite3_uint64)jb->size*piece/JOB_PIECES);
+    if (piece>0 && jb->op==JOB_UTF8_COUNT)
+        for (steps = 0;
+             steps<3 && ix<jb->size && (jb->data[ix]&0xC0)==0x80;
+             steps++)
+            ix++;
+    return ix;
+}
+
+static void run_piece(
+    job *jb,
+    int piece)
+{
+    kernelset const *k;
+    vsize lo, hi, reach;
+
+    k = serial_kernels;
+    lo = piece_start(jb, piece);
+    hi = piece_start(jb, piece+1);
+    reach = jb->size-hi<jb->needlesize
+        ? jb->size-lo : hi-lo+jb->needlesize-1;
+    switch (jb->op) {
+    case JOB_FIND_BYTE:
+        jb->found[piece] = k->find_byte(jb->data+lo, hi-lo, jb->c);
+        break;
+    case JOB_FIND_PAIR:
+        jb->found[piece] = reach>=jb->needlesize
+            ? k->find_pair(jb->data+lo, reach,
+                           jb->needle, jb->needlesize, jb->skips)
+            : 0;
+        break;
+    case JOB_FIND_PAIR16:
+        jb->found[piece] = reach>=jb->needlesize
+            ? k->find_pair16((unsigned short const *)jb->data+lo, reach,
+                             jb->needle, jb->needlesize, jb->skips)
+            : 0;
+        break;
+    case JOB_RFIND_BYTE:
+        jb->found[piece] = k->rfind_byte(jb->data+lo, hi-lo, jb->c);
+        break;
+    case JOB_RFIND_PAIR:
+        jb->found[piece] = reach>=jb->needlesize
+            ? k->rfind_pair(jb->data+lo, reach,
+                            jb->needle, jb->needlesize, jb->skips)
+            : 0;
+        break;
+    case JOB_RFIND_PAIR16:
+        jb->found[piece] = reach>=jb->needlesize
+            ? k->rfind_pair16((unsigned short const *)jb->data+lo, reach,
+                              jb->needle, jb->needlesize, jb->skips)
+            : 0;
+        break;
+    case JOB_COUNT_BYTE:
+        jb->counts[piece] = k->count_byte(jb->data+lo, hi-lo, jb->c);
+        break;
+    case JOB_UTF8_COUNT:
+        if (k->utf8_count(jb->data+lo, hi-lo, &jb->counts[piece]))
+            jb->counts[piece] = -1;
+        break;
+    case JOB_UTF8_LEADS:
+        jb->counts[piece] = k->utf8_leads(jb->data+lo, hi-lo);
+        break;
+    case JOB_UTF16_LEADS:
+        jb->counts[piece] = k->utf16_leads(
+            (unsigned short const *)jb->data+lo, hi-lo, jb->swapped);
+        break;
+    }
+}
+
+/*
+ * The next three are called with pool.lock held.
+ */
+static void piece_done(
+    job *jb)
+{
+    if (--jb->pending==0)
+        pthread_cond_signal(&pool.done);
+}
+
+static int take_piece(
+    job *jb)
+{
+    int reverse, piece;
+
+    reverse = JOB_REVERSE(jb->op);
+    while (jb->next<JOB_PIECES) {
+        piece = reverse ? JOB_PIECES-1-jb->next : jb->next;
+        jb->next++;
+        if (jb->best<0 || (reverse ? piece>jb->best : piece<jb->best))
+            return piece;
+        jb->found[piece] = 0;
+        piece_done(jb);
+    }
+    return -1;
+}
+
+static void finish_piece(
+    job *jb,
+    int piece)
+{
+    int reverse;
+
+    reverse = JOB_REVERSE(jb->op);
+    if (JOB_SEARCH(jb->op) && jb->found[piece]
+        && (jb->best<0 || (reverse ? piece>jb->best : piece<jb->best)))
+        jb->best = piece;
+    piece_done(jb);
+}
+
+static void *pool_worker(
+    void *unused)
+{
+    job *jb;
+    int piece;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        jb = pool.current;
+        if (jb && (piece = take_piece(jb))>=0) {
+            pthread_mutex_unlock(&pool.lock);
+            run_piece(jb, piece);
+            pthread_mutex_lock(&pool.lock);
+            finish_piece(jb, piece);
+        } else {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+    }
+    return 0;
+}
+
+static void start_pool(void)
+{
+    pthread_t thread;
+    int ix;
+
+    for (ix = 1; ix<INSTR_THREADS; ix++) {
+        if (!pthread_create(&thread, 0, pool_worker, 0)) {
+            pthread_detach(thread);
+            pool.started = 1;
+        }
+    }
+}
+
+#ifndef SQLITE_CORE
+/*
+ * Start the pool for a library that's about to be kept loaded.  Returns
+ * nonzero if any threads are running, in which case it must be.
+ */
+static int pin_pool(void)
+{
+    pthread_mutex_lock(&pool.busy);
+    pool.pinned = 1;
+    pthread_mutex_unlock(&pool.busy);
+    pthread_once(&pool.once, start_pool);
+    return pool.started;
+}
+#endif
+
+/*
+ * Only one job runs at a time; if the pool is busy with another
+ * connection's, the caller does its own work serially.
+ */
+static int run_job(
+    job *jb)
+{
+    int piece;
+
+    if (pthread_mutex_trylock(&pool.busy))
+        return 0;
+    if (!pool.pinned) {
+        pthread_mutex_unlock(&pool.busy);
+        return 0;
+    }
+    pthread_once(&pool.once, start_pool);
+    jb->next = 0;
+    jb->pending = JOB_PIECES;
+    jb->best = -1;
+    pthread_mutex_lock(&pool.lock);
+    pool.current = jb;
+    pthread_cond_broadcast(&pool.work);
+    while ((piece = take_piece(jb))>=0) {
+        pthread_mutex_unlock(&pool.lock);
+        run_piece(jb, piece);
+        pthread_mutex_lock(&pool.lock);
+        finish_piece(jb, piece);
+    }
+    while (jb->pending>0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pool.current = 0;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+    return 1;
+}
+
+static void const *job_found(
+    job const *jb)
+{
+    return jb->best>=0 ? jb->found[jb->best] : 0;
+}
+
+static sqlite3_int64 job_total(
+    job const *jb)
+{
+    sqlite3_int64 total;
+    int piece;
+
+    total = 0;
+    for (piece = 0; piece<JOB_PIECES; piece++) {
+        if (jb->counts[piece]<0)
+            return -1;
+        total += jb->counts[piece];
+    }
+    return total;
+}
+
+static unsigned char const *find_byte_threaded(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    job jb;
+
+    job_init(&jb, JOB_FIND_BYTE, haystack, stacksize);
+    jb.c = c;
+    if (stacksize<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->find_byte(haystack, stacksize, c);
+    return job_found(&jb);
+}
+
+static unsigned char const *find_pair_threaded(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    job jb;
+
+    job_init(&jb, JOB_FIND_PAIR, haystack, stacksize);
+    jb.needle = needle;
+    jb.needlesize = needlesize;
+    jb.skips = skips;
+    if (stacksize<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->find_pair(
+            haystack, stacksize, needle, needlesize, skips);
+    return job_found(&jb);
+}
+
+static unsigned char const *rfind_byte_threaded(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    job jb;
+
+    job_init(&jb, JOB_RFIND_BYTE, haystack, stacksize);
+    jb.c = c;
+    if (stacksize<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->rfind_byte(haystack, stacksize, c);
+    return job_found(&jb);
+}
+
+static unsigned char const *rfind_pair_threaded(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    job jb;
+
+    job_init(&jb, JOB_RFIND_PAIR, haystack, stacksize);
+    jb.needle = needle;
+    jb.needlesize = needlesize;
+    jb.skips = skips;
+    if (stacksize<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->rfind_pair(
+            haystack, stacksize, needle, needlesize, skips);
+    return job_found(&jb);
+}
+
+static unsigned short const *find_pair16_threaded(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    job jb;
+
+    job_init(&jb, JOB_FIND_PAIR16, haystack, stacksize);
+    jb.needle = needle;
+    jb.needlesize = needlesize;
+    jb.skips = skips;
+    if (stacksize<INSTR_THREAD_MIN/2 || !run_job(&jb))
+        return serial_kernels->find_pair16(
+            haystack, stacksize, needle, needlesize, skips);
+    return job_found(&jb);
+}
+
+static unsigned short const *rfind_pair16_threaded(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    vsize const *skips)
+{
+    job jb;
+
+    job_init(&jb, JOB_RFIND_PAIR16, haystack, stacksize);
+    jb.needle = needle;
+    jb.needlesize = needlesize;
+    jb.skips = skips;
+    if (stacksize<INSTR_THREAD_MIN/2 || !run_job(&jb))
+        return serial_kernels->rfind_pair16(
+            haystack, stacksize, needle, needlesize, skips);
+    return job_found(&jb);
+}
+
+static sqlite3_int64 count_byte_threaded(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned int c)
+{
+    job jb;
+
+    job_init(&jb, JOB_COUNT_BYTE, haystack, stacksize);
+    jb.c = c;
+    if (stacksize<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->count_byte(haystack, stacksize, c);
+    return job_total(&jb);
+}
+
+static int utf8_count_threaded(
+    unsigned char const *text,
+    vsize size,
+    sqlite3_int64 *countOut)
+{
+    job jb;
+    sqlite3_int64 count;
+
+    job_init(&jb, JOB_UTF8_COUNT, text, size);
+    if (size<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->utf8_count(text, size, countOut);
+    count = job_total(&jb);
+    if (count<0)
+        return -1;
+    *countOut = count;
+    return 0;
+}
+
+static sqlite3_int64 utf8_leads_threaded(
+    unsigned char const *text,
+    vsize size)
+{
+    job jb;
+
+    job_init(&jb, JOB_UTF8_LEADS, text, size);
+    if (size<INSTR_THREAD_MIN || !run_job(&jb))
+        return serial_kernels->utf8_leads(text, size);
+    return job_total(&jb);
+}
+
+static sqlite3_int64 utf16_leads_threaded(
+    unsigned short const *text,
+    vsize units,
+    int swapped)
+{
+    job jb;
+
+    job_init(&jb, JOB_UTF16_LEADS, text, units);
+    jb.swapped = swapped;
+    if (units<INSTR_THREAD_MIN/2 || !run_job(&jb))
+        return serial_kernels->utf16_leads(text, units, swapped);
+    return job_total(&jb);
+}
+
+static kernelset const *threaded(
+    kernelset const *serial)
+{
+    serial_kernels = serial;
+    threaded_kernels = *serial;
+    threaded_kernels.find_byte = find_byte_threaded;
+    threaded_kernels.find_pair = find_pair_threaded;
+    threaded_kernels.rfind_byte = rfind_byte_threaded;
+    threaded_kernels.rfind_pair = rfind_pair_threaded;
+    threaded_kernels.find_pair16 = find_pair16_threaded;
+    threaded_kernels.rfind_pair16 = rfind_pair16_threaded;
+    threaded_kernels.count_byte = count_byte_threaded;
+    threaded_kernels.utf8_count = utf8_count_threaded;
+    threaded_kernels.utf8_leads = utf8_leads_threaded;
+    threaded_kernels.utf16_leads = utf16_leads_threaded;
+    return &threaded_kernels;
+}
+
+#endif
+
+/*
+ * Pick the best kernels this CPU can run.
+ */
+static void select_kernels(void)
+{
+    kernelset const *chosen = &scalar_kernels;
+
+#if HAVE_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    int maxleaf, sse2, avx2, avx512;
+    unsigned long long xcr0;
+
+    __cpuid(info, 0);
+    maxleaf = info[0];
+    __cpuid(info, 1);
+    sse2 = info[3]>>26 & 1;
+    xcr0 = info[2]>>27 & 1 ? _xgetbv(0) : 0;
+    avx2 = avx512 = 0;
+    if (maxleaf>=7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (xcr0&0x06)==0x06 && info[1]>>5 & 1;
+        avx512 = (xcr0&0xE6)==0xE6 && info[1]>>16 & 1 && info[1]>>30 & 1;
+    }
+#else
+    int sse2, avx2, avx512;
+
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw");
+#endif
+    if (avx512) {
+        chosen = &avx512_kernels;
+    } else if (avx2) {
+        chosen = &avx2_kernels;
+    } else if (sse2) {
+        chosen = &sse2_kernels;
+    }
+#elif HAVE_NEON
+    chosen = &neon_kernels;
+#endif
+#if INSTR_THREADS>1
+    kernels = threaded(chosen);
+#else
+    kernels = chosen;
+#endif
+}
+
+static int few_bytes(
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned char seen[256];
+    vsize ix, distinct;
+
+    memset(seen, 0, sizeof seen);
+    distinct = 0;
+    for (ix = 0; ix<needlesize; ix++) {
+        distinct += !seen[needle[ix]];
+        seen[needle[ix]] = 1;
+    }
+    return distinct*4<=needlesize;
+}
+
+/*
+ * Whether a needle of length bytes, or code units if wide is set,
+ * should get Two-Way.
+ */
+static int wants_twoway(
+    unsigned char const *needle,
+    vsize length,
+    int wide)
+{
+    vsize period, suffix;
+
+    if (length>=TWOWAY_MIN)
+        return 1;
+    if (length<TWOWAY_PERIODIC)
+        return 0;
+    suffix = critical_factorization(needle, length, wide, &period);
+    return period*2<=length
+        && !memcmp(needle, needle+(period<<wide), suffix<<wide);
+}
+
+/*
+ * Pick an engine for a needle of at least one byte, given the size
+ * of the haystack it's first wanted for.  UTF-16 needles are measured
+ * in code units.
+ */
+static int plan_needle(
+    int kind,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize stacksize)
+{
+    int base, wide, engine;
+
+    base = kind&~(SEARCH_REVERSE|SEARCH_SWAPPED);
+    wide = base==SEARCH_UTF16;
+    engine = wants_twoway(needle, wide ? needlesize/2 : needlesize, wide)
+        ? ENGINE_TWOWAY : ENGINE_SCAN;
+    if (engine==ENGINE_SCAN && base==SEARCH_BLOB
+            && needlesize>=QGRAM_MIN
+            && (kernels->bmh || few_bytes(needle, needlesize)))
+        engine = ENGINE_QGRAM;
+    if (stacksize<PLAN_SMALL
+            && (engine!=ENGINE_SCAN || kernels->bmh && needlesize>1
+                || wide && !(kind&SEARCH_REVERSE)))
+        engine = ENGINE_NAIVE;
+    return engine;
+}
+
+/*
+ * Fold a needle to be searched for without regard to case, and pick
+ * the engine for it.
+ */
+static int fold_needle(
+    int kind,
+    unsigned char const *needle,
+    vsize needlesize,
+    unsigned char *folded)
+{
+    unsigned short const *units;
+    unsigned short *out;
+    vsize ix;
+    int base;
+
+    base = kind&~(SEARCH_REVERSE|SEARCH_SWAPPED|SEARCH_NOCASE);
+    if (base==SEARCH_UTF16) {
+        units = (unsigned short const *)needle;
+        out = (unsigned short *)folded;
+        for (ix = 0; ix<needlesize/2; ix++) {
+            out[ix] = fold_unit(units[ix], kind&SEARCH_SWAPPED);
+        }
+        return ENGINE_UFOLD;
+    }
+    if (base==SEARCH_BLOB) {
+        for (ix = 0; ix<needlesize; ix++) {
+            folded[ix] = ASCII_FOLD(needle[ix]);
+        }
+        return ENGINE_FOLD;
+    }
+    fold_utf8(needle, needlesize, folded);
+    for (ix = 0; ix<needlesize; ix++) {
+        if (folded[ix]>=0x80)
+            return ENGINE_UFOLD;
+    }
+    return ENGINE_FOLD;
+}
+
+static compiled *compile_needle(
+    int kind,
+    unsigned char const *needle,
+    vsize needlesize,
+    vsize stacksize)
+{
+    compiled *cn;
+    vsize extra;
+    int base, wide, engine;
+
+    base = kind&~(SEARCH_REVERSE|SEARCH_SWAPPED|SEARCH_NOCASE);
+    wide = base==SEARCH_UTF16;
+    if (kind&SEARCH_NOCASE) {
+        engine = ENGINE_FOLD;
+        extra = kind&SEARCH_REVERSE ? needlesize*2 : needlesize;
+    } else {
+        engine = needlesize>0
+            ? plan_needle(kind, needle, needlesize, stacksize) : ENGINE_SCAN;
+        extra = engine==ENGINE_TWOWAY ? needlesize
+            : engine==ENGINE_QGRAM ? QGRAM_TABLE : 0;
+    }
+    cn = sqlite3_malloc64(sizeof *cn+extra);
+    if (!cn)
+        return 0;
+    STAT(STAT_COMPILED, 1);
+    cn->kind = kind;
+    cn->needlesize = needlesize;
+    cn->engine = engine;
+    cn->rneedle = 0;
+    cn->qskips = 0;
+    cn->folded = 0;
+    cn->fold = 0;
+    if (kind&SEARCH_NOCASE) {
+        cn->folded = (unsigned char *)(cn+1);
+        cn->engine = fold_needle(kind, needle, needlesize, cn->folded);
+        if (needlesize>0
+                && wants_twoway(cn->folded, needlesize>>wide, wide)) {
+            cn->fold = !wide ? (cn->engine==ENGINE_UFOLD
+                                ? FOLD_UTF8 : FOLD_ASCII)
+                : kind&SEARCH_SWAPPED ? FOLD_UTF16|FOLD_SWAPPED : FOLD_UTF16;
+            cn->engine = ENGINE_TWOFOLD;
+            if (kind&SEARCH_REVERSE) {
+                cn->rneedle = cn->folded+needlesize;
+                reverse_needle(cn->folded, needlesize, wide, cn->rneedle);
+                twoway_setup(cn->rneedle, needlesize>>wide, wide, &cn->tw);
+            } else {
+                twoway_setup(cn->folded, needlesize>>wide, wide, &cn->tw);
+            }
+        } else if (base==SEARCH_UTF16) {
+            if (needlesize>=2 && kind&SEARCH_REVERSE) {
+                rbmh16_setup((unsigned short const *)cn->folded,
+                             needlesize/2, cn->skips);
+            } else if (needlesize>=2) {
+                fbmh16_setup((unsigned short const *)cn->folded,
+                             needlesize/2, cn->skips);
+            }
+        } else if (needlesize>0
+                   && (cn->engine==ENGINE_UFOLD || kernels->bmh)) {
+            if (kind&SEARCH_REVERSE) {
+                rbmh_setup(cn->folded, needlesize, cn->skips);
+            } else {
+                fbmh_setup(cn->folded, needlesize, cn->skips);
+            }
+        }
+    } else if (engine==ENGINE_TWOWAY) {
+        if (kind&SEARCH_REVERSE) {
+            cn->rneedle = (unsigned char *)(cn+1);
+            reverse_needle(needle, needlesize, wide, cn->rneedle);
+            twoway_setup(cn->rneedle, needlesize>>wide, wide, &cn->tw);
+        } else {
+            twoway_setup(needle, needlesize>>wide, wide, &cn->tw);
+        }
+    } else if (engine==ENGINE_QGRAM) {
+        cn->qskips = (unsigned char *)(cn+1);
+        if (kind&SEARCH_REVERSE) {
+            rqgram_setup(needle, needlesize, cn->qskips);
+        } else {
+            fqgram_setup(needle, needlesize, cn->qskips);
+        }
+    } else if (engine==ENGINE_NAIVE) {
+        return cn;
+    } else if (base==SEARCH_UTF16) {
+        if (needlesize>=2
+                && (!(kind&SEARCH_REVERSE) || kernels->bmh)) {
+            if (kind&SEARCH_REVERSE) {
+                rbmh16_setup((unsigned short const *)needle, needlesize/2,
+                             cn->skips);
+            } else {
+                fbmh16_setup((unsigned short const *)needle, needlesize/2,
+                             cn->skips);
+            }
+        }
+    } else if (needlesize>1 && kernels->bmh) {
+        if (kind&SEARCH_REVERSE) {
+            rbmh_setup(needle, needlesize, cn->skips);
+        } else {
+            fbmh_setup(needle, needlesize, cn->skips);
+        }
+    }
+    return cn;
+}
+
+/*
+ * Fetch the prepared needle cached on argument 1, or prepare a new one.
+ * When *fresh is set, the caller must hand the result to cache_needle
+ * once it's done with it.  One prepared without tables for a short
+ * haystack is prepared again if a long one comes along.  Every SQL call
+ * that searches fetches its needle here once, so this counts searches.
+ */
+static compiled *get_needle(
+    sqlite3_context *context,
+    int kind,
+    void const *needle,
+    vsize needlesize,
+    vsize stacksize,
+    int *fresh)
+{
+    compiled *cn;
+
+    STAT(STAT_SEARCHES, 1);
+    cn = sqlite3_get_auxdata(context, 1);
+    if (cn && cn->kind==kind && cn->needlesize==needlesize
+            && (cn->engine!=ENGINE_NAIVE || stacksize<PLAN_SMALL)) {
+        STAT(STAT_CACHED, 1);
+        *fresh = 0;
+        return cn;
+    }
+    *fresh = 1;
+    return compile_needle(kind, needle, needlesize, stacksize);
+}
+
+static void cache_needle(
+    sqlite3_context *context,
+    compiled *cn,
+    int fresh)
+{
+    if (fresh)
+        sqlite3_set_auxdata(context, 1, cn, sqlite3_free);
+}
+
+static unsigned char const *qgram_find(
+    unsigned char const *qskips,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    vsize limit;
+
+    limit = needlesize-1;
+    while (stacksize>=needlesize) {
+        vsize skip;
+
+        if (haystack[limit]==needle[limit]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(haystack, needle, limit))
+                return haystack;
+        }
+        skip = qskips[QGRAM_HASH(haystack[limit-1], haystack[limit])];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        haystack += skip;
+        stacksize -= skip;
+    }
+    return 0;
+}
+
+static unsigned char const *qgram_rfind(
+    unsigned char const *qskips,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned char const *window;
+    vsize left;
+
+    left = stacksize-needlesize;
+    window = haystack+left;
+    for (;;) {
+        vsize skip;
+
+        if (window[0]==needle[0]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (!memcmp(window+1, needle+1, needlesize-1))
+                return window;
+        }
+        skip = qskips[QGRAM_HASH(window[0], window[1])];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>left)
+            return 0;
+        window -= skip;
+        left -= skip;
+    }
+}
+
+/*
+ * Horspool for a needle folded to UTF-8 that isn't all ASCII, folding
+ * the haystack byte by byte as it's compared.  A byte whose fold can't
+ * be told, at the very ends of the haystack, only allows a shift of one.
+ */
+static int ufold_equal(
+    unsigned char const *haystack,
+    vsize stacksize,
+    vsize pos,
+    unsigned char const *folded,
+    vsize needlesize)
+{
+    vsize ix;
+    int c;
+
+    for (ix = 0; ix<needlesize; ix++) {
+        c = fold_byte8(haystack, stacksize, pos+ix);
+        if ((c<0 ? haystack[pos+ix] : c)!=folded[ix])
+            return 0;
+    }
+    return 1;
+}
+
+static unsigned char const *ufold_find(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize)
+{
+    vsize pos, limit, skip;
+    int c;
+
+    limit = cn->needlesize-1;
+    for (pos = 0; stacksize-pos>=cn->needlesize; pos += skip) {
+        c = fold_byte8(haystack, stacksize, pos+limit);
+        if (c==cn->folded[limit]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (ufold_equal(haystack, stacksize, pos, cn->folded, limit))
+                return haystack+pos;
+        }
+        skip = c<0 ? 1 : cn->skips[c];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+    }
+    return 0;
+}
+
+static unsigned char const *ufold_rfind(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize)
+{
+    vsize pos, skip;
+    int c;
+
+    pos = stacksize-cn->needlesize;
+    for (;;) {
+        c = fold_byte8(haystack, stacksize, pos);
+        if (c==cn->folded[0]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (ufold_equal(haystack, stacksize, pos+1, cn->folded+1,
+                            cn->needlesize-1))
+                return haystack+pos;
+        }
+        skip = c<0 ? 1 : cn->skips[c];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>pos)
+            return 0;
+        pos -= skip;
+    }
+}
+
+/*
+ * The same for UTF-16, where each code unit can be folded on its own.
+ */
+static int fold16_equal(
+    unsigned short const *text,
+    unsigned short const *folded,
+    vsize units,
+    int swapped)
+{
+    vsize ix;
+
+    for (ix = 0; ix<units; ix++) {
+        if (fold_unit(text[ix], swapped)!=folded[ix])
+            return 0;
+    }
+    return 1;
+}
+
+static unsigned short const *fold16_find(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize units)
+{
+    unsigned short const *folded;
+    vsize limit, skip;
+    unsigned int last;
+    int swapped;
+
+    folded = (unsigned short const *)cn->folded;
+    swapped = cn->kind&SEARCH_SWAPPED;
+    limit = cn->needlesize/2-1;
+    while (units>limit) {
+        last = fold_unit(text[limit], swapped);
+        if (last==folded[limit]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (fold16_equal(text, folded, limit, swapped))
+                return text;
+        }
+        skip = cn->skips[UNIT_HASH(last)];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>=units)
+            return 0;
+        text += skip;
+        units -= skip;
+    }
+    return 0;
+}
+
+static unsigned short const *fold16_rfind(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize units)
+{
+    unsigned short const *folded, *window;
+    vsize left, skip;
+    unsigned int first;
+    int swapped;
+
+    folded = (unsigned short const *)cn->folded;
+    swapped = cn->kind&SEARCH_SWAPPED;
+    left = units-cn->needlesize/2;
+    window = text+left;
+    for (;;) {
+        first = fold_unit(window[0], swapped);
+        if (first==folded[0]) {
+            STAT(STAT_CANDIDATES, 1);
+            if (fold16_equal(window+1, folded+1, cn->needlesize/2-1,
+                             swapped))
+                return window;
+        }
+        skip = cn->skips[UNIT_HASH(first)];
+        STAT(STAT_SHIFTS, 1);
+        STAT(STAT_SHIFTED, skip);
+        if (skip>left)
+            return 0;
+        window -= skip;
+        left -= skip;
+    }
+}
+
+/*
+ * The symbol at index ix of the haystack folded the way fold says,
+ * counting from the end with FOLD_BACKWARDS.  length is in bytes,
+ * or in code units for UTF-16.
+ */
+static unsigned int folded_at(
+    int fold,
+    void const *text,
+    vsize length,
+    vsize ix)
+{
+    unsigned char const *bytes = text;
+    int c;
+
+    if (fold&FOLD_BACKWARDS)
+        ix = length-1-ix;
+    switch (fold&(FOLD_UTF8|FOLD_UTF16)) {
+    case FOLD_ASCII:
+        return ASCII_FOLD(bytes[ix]);
+    case FOLD_UTF8:
+        c = fold_byte8(bytes, length, ix);
+        return c<0 ? bytes[ix] : (unsigned int)c;
+    }
+    return fold_unit(((unsigned short const *)text)[ix], fold&FOLD_SWAPPED);
+}
+
+/*
+ * Two-Way for ENGINE_TWOFOLD, like twoway_scan16 but over the folded
+ * haystack, where the needle is a folded one of length bytes or code
+ * units.  Reverse scans are given the start of the text and read it
+ * from the end.
+ */
+static vsize twoway_fold_scan(
+    twoway const *tw,
+    unsigned char const *needle,
+    vsize length,
+    int fold,
+    void const *text,
+    vsize textlength,
+    vsize from,
+    vsize memory)
+{
+    vsize suffix, period, last, limit;
+    vsize i, j, shift;
+    unsigned int c;
+    int wide;
+
+#define AT(ix) folded_at(fold, text, textlength, ix)
+#define SYM(ix) NEEDLE_SYM(needle, ix, wide)
+    wide = (fold&FOLD_UTF16)!=0;
+    suffix = tw->suffix;
+    period = tw->period;
+    last = length-1;
+    limit = textlength-length;
+    j = from;
+    if (!tw->periodic)
+        memory = 0;
+    while (j<=limit) {
+        c = AT(j+last);
+        shift = tw->shift[wide ? UNIT_HASH(c) : c];
+        if (shift || c!=SYM(last)) {
+            j += shift ? shift : 1;
+            memory = 0;
+            continue;
+        }
+        i = suffix>memory ? suffix : memory;
+        while (i<last && SYM(i)==AT(i+j))
+            i++;
+        if (i>=last) {
+            i = suffix;
+            while (i>memory && SYM(i-1)==AT(i-1+j))
+                i--;
+            if (i<=memory)
+                return j;
+            j += period;
+            memory = tw->periodic ? length-period : 0;
+        } else {
+            j += i-suffix+1;
+            memory = 0;
+        }
+    }
+#undef SYM
+#undef AT
+    return (vsize)-1;
+}
+
+/*
+ * Find the first or last occurrence of a needle of at least one byte
+ * with whatever engine was chosen for it, in a haystack at least
+ * as long as the needle.
+ */
+static unsigned char const *engine_find(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    vsize ix;
+
+    switch (cn->engine) {
+    case ENGINE_TWOWAY:
+        ix = twoway_scan(&cn->tw, needle, needlesize, haystack, 1, stacksize,
+                         0, 0);
+        return ix!=(vsize)-1 ? haystack+ix : 0;
+    case ENGINE_TWOFOLD:
+        ix = twoway_fold_scan(&cn->tw, cn->folded, needlesize, cn->fold,
+                              haystack, stacksize, 0, 0);
+        return ix!=(vsize)-1 ? haystack+ix : 0;
+    case ENGINE_QGRAM:
+        return qgram_find(cn->qskips, haystack, stacksize, needle, needlesize);
+    case ENGINE_FOLD:
+        return kernels->find_fold(
+            haystack, stacksize, cn->folded, needlesize, cn->skips);
+    case ENGINE_UFOLD:
+        return ufold_find(cn, haystack, stacksize);
+    }
+    if (needlesize==1)
+        return kernels->find_byte(haystack, stacksize, needle[0]);
+    if (cn->engine==ENGINE_NAIVE)
+        return find_pair_tail(haystack, stacksize, needle, needlesize);
+    return kernels->find_pair(
+        haystack, stacksize, needle, needlesize, cn->skips);
+}
+
+static unsigned char const *engine_rfind(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    vsize ix;
+
+    switch (cn->engine) {
+    case ENGINE_TWOWAY:
+        ix = twoway_scan(&cn->tw, cn->rneedle, needlesize,
+                         haystack+stacksize-1, -1, stacksize, 0, 0);
+        return ix!=(vsize)-1 ? haystack+(stacksize-needlesize-ix) : 0;
+    case ENGINE_TWOFOLD:
+        ix = twoway_fold_scan(&cn->tw, cn->rneedle, needlesize,
+                              cn->fold|FOLD_BACKWARDS, haystack, stacksize,
+                              0, 0);
+        return ix!=(vsize)-1 ? haystack+(stacksize-needlesize-ix) : 0;
+    case ENGINE_QGRAM:
+        return qgram_rfind(cn->qskips, haystack, stacksize,
+                           needle, needlesize);
+    case ENGINE_FOLD:
+        return kernels->rfind_fold(
+            haystack, stacksize, cn->folded, needlesize, cn->skips);
+    case ENGINE_UFOLD:
+        return ufold_rfind(cn, haystack, stacksize);
+    }
+    if (needlesize==1)
+        return kernels->rfind_byte(haystack, stacksize, needle[0]);
+    if (cn->engine==ENGINE_NAIVE)
+        return rfind_pair_tail(haystack, stacksize, needle, needlesize);
+    return kernels->rfind_pair(
+        haystack, stacksize, needle, needlesize, cn->skips);
+}
+
+static unsigned char const *needle_find(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned char const *match;
+
+    match = stacksize>=needlesize
+        ? engine_find(cn, haystack, stacksize, needle, needlesize) : 0;
+    STAT_FORWARD(haystack, stacksize, match, needlesize);
+    return match;
+}
+
+static unsigned char const *needle_rfind(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned char const *match;
+
+    match = stacksize>=needlesize
+        ? engine_rfind(cn, haystack, stacksize, needle, needlesize) : 0;
+    STAT_BACKWARD(haystack, stacksize, match);
+    return match;
+}
+
+/*
+ * The first match at least skip bytes past one known to be at match,
+ * among the size bytes from there, and the last match that starts
+ * before one known to be at match.  Two-Way carries on its scan from
+ * the known match instead of starting over, so that a run of
+ * overlapping matches is found in time linear in the haystack.
+ */
+static unsigned char const *needle_find_after(
+    compiled const *cn,
+    unsigned char const *match,
+    vsize size,
+    vsize skip,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned char const *next;
+    vsize from, memory, ix;
+
+    if (cn->engine!=ENGINE_TWOWAY && cn->engine!=ENGINE_TWOFOLD) {
+        return skip<=size
+            ? needle_find(cn, match+skip, size-skip, needle, needlesize) : 0;
+    }
+    twoway_resume(&cn->tw, needlesize, skip, &from, &memory);
+    ix = cn->engine==ENGINE_TWOWAY
+        ? twoway_scan(&cn->tw, needle, needlesize, match, 1, size,
+                      from, memory)
+        : twoway_fold_scan(&cn->tw, cn->folded, needlesize, cn->fold,
+                           match, size, from, memory);
+    next = ix!=(vsize)-1 ? match+ix : 0;
+    STAT_FORWARD(match+skip, size-skip, next, needlesize);
+    return next;
+}
+
+static unsigned char const *needle_rfind_before(
+    compiled const *cn,
+    unsigned char const *haystack,
+    unsigned char const *match,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned char const *next;
+    vsize size, from, memory, ix;
+
+    size = match-haystack+needlesize;
+    if (cn->engine!=ENGINE_TWOWAY && cn->engine!=ENGINE_TWOFOLD)
+        return needle_rfind(cn, haystack, size-1, needle, needlesize);
+    twoway_resume(&cn->tw, needlesize, 1, &from, &memory);
+    ix = cn->engine==ENGINE_TWOWAY
+        ? twoway_scan(&cn->tw, cn->rneedle, needlesize, haystack+size-1, -1,
+                      size, from, memory)
+        : twoway_fold_scan(&cn->tw, cn->rneedle, needlesize,
+                           cn->fold|FOLD_BACKWARDS, haystack, size,
+                           from, memory);
+    next = ix!=(vsize)-1 ? haystack+(size-needlesize-ix) : 0;
+    STAT_BACKWARD(haystack, size-1, next);
+    return next;
+}
+
+/*
+ * The occurrence-th last match, where each one must start before
+ * the one after it; they may overlap.
+ */
+static unsigned char const *needle_rfind_nth(
+    compiled const *cn,
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    sqlite3_int64 occurrence)
+{
+    unsigned char const *match;
+
+    match = needle_rfind(cn, haystack, stacksize, needle, needlesize);
+    while (match && --occurrence>0) {
+        match = needle_rfind_before(cn, haystack, match, needle, needlesize);
+    }
+    return match;
+}
+
+static sqlite3_int64 instr_blob(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    compiled const *cn,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence)
+{
+    sqlite3_int64 found;
+    unsigned char const *match;
+
+    if (needlesize<=0 && start<=0x7FFFFFFFFFFFFFFFLL-occurrence)
+        start = (start>1 ? start : 1)+occurrence-1;
+    if (start>1) {
+        found = start;
+        start--;
+        if (start>(sqlite3_int64)stacksize)
+            return 0;
+        haystack += start;
+        stacksize -= start;
+    } else {
+        found = 1;
+    }
+    if (needlesize>stacksize)
+        return 0;
+    if (needlesize<=0)
+        return found;
+    match = needle_find(cn, haystack, stacksize, needle, needlesize);
+    while (match && --occurrence>0) {
+        match = needle_find_after(cn, match, stacksize-(match-haystack), 1,
+                                  needle, needlesize);
+    }
+    return match ? found+(match-haystack) : 0;
+}
+
+/*
+ * A sparse index from character positions to byte offsets, attached
+ * to the haystack argument as auxiliary data so that calls with the same
+ * haystack and a far-off start position needn't walk all the way there
+ * again.  offsets[k] is the byte offset of character k*CHARINDEX_STEP+1;
+ * entries are added whenever a walk goes past the last one.  It is only
+ * worth keeping for haystacks of at least CHARINDEX_MIN bytes.
+ */
+
+#define CHARINDEX_STEP  1024
+#define CHARINDEX_MIN   16384
+
+typedef struct charindex {
+    void const *text;
+    vsize size;
+    int kind;
+    vsize used;
+    vsize alloc;
+    vsize *offsets;
+} charindex;
+
+static void free_index(
+    void *ptr)
+{
+    charindex *ix = ptr;
+
+    sqlite3_free(ix->offsets);
+    sqlite3_free(ix);
+}
+
+/*
+ * Fetch the index cached on argument 0, or start a new one if a walk
+ * to start could use it.  When *fresh is set, the caller must hand the
+ * result to cache_index once it's done with it.  Returns 0 if there's
+ * no index to be had, which the seek functions cope with.
+ */
+static charindex *get_index(
+    sqlite3_context *context,
+    int kind,
+    void const *text,
+    vsize size,
+    sqlite3_int64 start,
+    int *fresh)
+{
+    charindex *ix;
+
+    *fresh = 0;
+    if (size<CHARINDEX_MIN || start<=CHARINDEX_STEP)
+        return 0;
+    ix = sqlite3_get_auxdata(context, 0);
+    if (ix && ix->text==text && ix->size==size && ix->kind==kind)
+        return ix;
+    ix = sqlite3_malloc(sizeof *ix);
+    if (!ix)
+        return 0;
+    ix->offsets = sqlite3_malloc(16*sizeof *ix->offsets);
+    if (!ix->offsets) {
+        sqlite3_free(ix);
+        return 0;
+    }
+    ix->text = text;
+    ix->size = size;
+    ix->kind = kind;
+    ix->offsets[0] = 0;
+    ix->used = 1;
+    ix->alloc = 16;
+    *fresh = 1;
+    return ix;
+}
+
+static void cache_index(
+    sqlite3_context *context,
+    charindex *ix,
+    int fresh)
+{
+    if (fresh)
+        sqlite3_set_auxdata(context, 0, ix, free_index);
+}
+
+/*
+ * Jump to the last indexed character at or before start
+ * that the walk in the seek functions would have reached.
+ */
+static sqlite3_int64 index_jump(
+    charindex const *ix,
+    sqlite3_int64 start,
+    vsize keep,
+    vsize *offsetOut)
+{
+    vsize k;
+
+    k = ix->used-1;
+    if ((start-1)/CHARINDEX_STEP<k)
+        k = (vsize)((start-1)/CHARINDEX_STEP);
+    while (k>0 && ix->size-ix->offsets[k]<keep)
+        k--;
+    *offsetOut = ix->offsets[k];
+    return (sqlite3_int64)k*CHARINDEX_STEP+1;
+}
+
+static void index_add(
+    charindex *ix,
+    vsize offset)
+{
+    if (ix->used>=ix->alloc) {
+        vsize *grown;
+
+        grown = sqlite3_realloc64(
+            ix->offsets, (sqlite3_uint64)ix->alloc*2*sizeof *grown);
+        if (!grown)
+            return;
+        ix->offsets = grown;
+        ix->alloc *= 2;
+    }
+    ix->offsets[ix->used++] = offset;
+}
+
+/*
+ * Walk from the first character towards character number start,
+ * but not past a character that leaves fewer than keep bytes after it.
+ * Returns the number of the character reached, or -1 if the text
+ * is malformed.
+ */
+static sqlite3_int64 utf8_seek(
+    charindex *ix,
+    unsigned char const **textInOut,
+    vsize *sizeInOut,
+    sqlite3_int64 start,
+    vsize keep,
+    int trusted)
+{
+    unsigned char const *base, *text;
+    vsize size, offset;
+    sqlite3_int64 found, next;
+    int codepoint;
+
+    base = text = *textInOut;
+    size = *sizeInOut;
+    found = 1;
+    next = 0;
+    if (ix) {
+        found = index_jump(ix, start, keep, &offset);
+        text += offset;
+        size -= offset;
+        next = (sqlite3_int64)ix->used*CHARINDEX_STEP+1;
+    }
+    while (found<start && size>keep) {
+        unsigned char const *oldtext = text;
+        vsize oldsize = size;
+
+        if (trusted) {
+            UTF8_SKIP(text, size);
+        } else {
+            UTF8_ADVANCE(text, size, codepoint);
+            if (codepoint==-1)
+                return -1;
+        }
+        if (size<keep) {
+            text = oldtext;
+            size = oldsize;
+            break;
+        }
+        found++;
+        STAT(STAT_WALKED, 1);
+        if (found==next) {
+            index_add(ix, text-base);
+            next += CHARINDEX_STEP;
+        }
+    }
+    *textInOut = text;
+    *sizeInOut = size;
+    return found;
+}
+
+static sqlite3_int64 utf16_seek(
+    charindex *ix,
+    unsigned short const **textInOut,
+    vsize *sizeInOut,
+    sqlite3_int64 start,
+    vsize keep,
+    int trusted,
+    int swapped)
+{
+    unsigned short const *base, *text;
+    vsize size, offset;
+    sqlite3_int64 found, next;
+    int codepoint;
+
+    base = text = *textInOut;
+    size = *sizeInOut;
+    found = 1;
+    next = 0;
+    if (ix) {
+        found = index_jump(ix, start, keep, &offset);
+        text += offset/2;
+        size -= offset;
+        next = (sqlite3_int64)ix->used*CHARINDEX_STEP+1;
+    }
+    while (found<start && size>keep) {
+        unsigned short const *oldtext = text;
+        vsize oldsize = size;
+
+        if (trusted) {
+            UTF16_SKIP(text, size, swapped);
+        } else {
+            UTF16_ADVANCE(text, size, codepoint, swapped);
+            if (codepoint==-1)
+                return -1;
+        }
+        if (size<keep) {
+            text = oldtext;
+            size = oldsize;
+            break;
+        }
+        found++;
+        STAT(STAT_WALKED, 1);
+        if (found==next) {
+            index_add(ix, (text-base)*2);
+            next += CHARINDEX_STEP;
+        }
+    }
+    *textInOut = text;
+    *sizeInOut = size;
+    return found;
+}
+
+/*
+ * Find the first match of a needle of at least one byte, starting
+ * at least skip bytes into text that begins at a character boundary,
+ * and at a match when skip isn't 0.  Returns 1 and sets *offsetOut
+ * and *countOut to the byte offset of the match and the number of
+ * characters in front of it, 0 if there's no match, or -1 if the text
+ * leading up to the match is malformed.
+ */
+static int utf8_next(
+    compiled const *cn,
+    unsigned char const *text,
+    vsize size,
+    vsize skip,
+    unsigned char const *needle,
+    vsize needlesize,
+    int trusted,
+    vsize *offsetOut,
+    sqlite3_int64 *countOut)
+{
+    unsigned char const *match;
+    sqlite3_int64 count;
+
+    if (skip>size)
+        return 0;
+    if (needle[0]>=0x80 && needle[0]<0xC0) {
+        unsigned char const *walk;
+        vsize rest;
+        int codepoint;
+
+        /*
+         * A needle that starts with a continuation byte can match
+         * inside a character, so walk up to each match and carry on
+         * from the character boundary after it if that happens.
+         */
+        walk = text;
+        rest = size;
+        count = 0;
+        for (;;) {
+            match = needle_find(
+                cn, text+skip, size-skip, needle, needlesize);
+            if (!match)
+                return 0;
+            while (walk<match) {
+                if (trusted) {
+                    UTF8_SKIP(walk, rest);
+                } else {
+                    UTF8_ADVANCE(walk, rest, codepoint);
+                    if (codepoint==-1)
+                        return -1;
+                }
+                count++;
+            }
+            if (walk==match)
+                break;
+            skip = walk-text;
+        }
+    } else {
+        /*
+         * Otherwise a match in well-formed text is always at a character
+         * boundary, and its position is the number of characters before it.
+         */
+        match = skip>0
+            ? needle_find_after(cn, text, size, skip, needle, needlesize)
+            : needle_find(cn, text, size, needle, needlesize);
+        if (!match)
+            return 0;
+        if (trusted) {
+            count = kernels->utf8_leads(text, match-text);
+        } else if (kernels->utf8_count(text, match-text, &count)) {
+            return -1;
+        }
+    }
+    STAT(STAT_WALKED, count);
+    *offsetOut = match-text;
+    *countOut = count;
+    return 1;
+}
+
+static sqlite3_int64 instr_utf8(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    compiled const *cn,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence,
+    int trusted,
+    charindex *ix)
+{
+    sqlite3_int64 found, count;
+    vsize offset, skip;
+    int status;
+
+    if (needlesize>stacksize)
+        return 0;
+    if (needlesize<=0 && start<=0x7FFFFFFFFFFFFFFFLL-occurrence)
+        start = (start>1 ? start : 1)+occurrence-1;
+    found = utf8_seek(ix, &haystack, &stacksize, start, needlesize, trusted);
+    if (found<0)
+        return -1;
+    if (found<start)
+        return 0;
+    if (needlesize<=0)
+        return found;
+    skip = 0;
+    for (;;) {
+        status = utf8_next(cn, haystack, stacksize, skip, needle, needlesize,
+                           trusted, &offset, &count);
+        if (status<=0)
+            return status;
+        found += count;
+        if (--occurrence<=0)
+            return found;
+        haystack += offset;
+        stacksize -= offset;
+        skip = 1;
+    }
+}
+
+/*
+ * Find the first or last match of a needle of at least one code unit
+ * that starts at a code unit boundary.  Sizes are in bytes.
+ */
+static unsigned short const *engine_find16(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize size,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    vsize ix;
+
+    switch (cn->engine) {
+    case ENGINE_TWOWAY:
+        ix = twoway_scan16(&cn->tw, needle, needlesize/2, text, 1, size/2,
+                           0, 0);
+        return ix!=(vsize)-1 ? text+ix : 0;
+    case ENGINE_TWOFOLD:
+        ix = twoway_fold_scan(&cn->tw, cn->folded, needlesize/2, cn->fold,
+                              text, size/2, 0, 0);
+        return ix!=(vsize)-1 ? text+ix : 0;
+    case ENGINE_UFOLD:
+        return fold16_find(cn, text, size/2);
+    case ENGINE_NAIVE:
+        return find_pair16_tail(text, size/2, needle, needlesize/2);
+    }
+    return kernels->find_pair16(text, size/2, needle, needlesize/2,
+                                cn->skips);
+}
+
+static unsigned short const *engine_rfind16(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize size,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    vsize ix;
+
+    switch (cn->engine) {
+    case ENGINE_TWOWAY:
+        ix = twoway_scan16(&cn->tw, (unsigned short const *)cn->rneedle,
+                           needlesize/2, text+size/2-1, -1, size/2, 0, 0);
+        return ix!=(vsize)-1 ? text+(size/2-needlesize/2-ix) : 0;
+    case ENGINE_TWOFOLD:
+        ix = twoway_fold_scan(&cn->tw, cn->rneedle, needlesize/2,
+                              cn->fold|FOLD_BACKWARDS, text, size/2, 0, 0);
+        return ix!=(vsize)-1 ? text+(size/2-needlesize/2-ix) : 0;
+    case ENGINE_UFOLD:
+        return fold16_rfind(cn, text, size/2);
+    case ENGINE_NAIVE:
+        return rfind_pair16_tail(text, size/2, needle, needlesize/2);
+    }
+    return kernels->rfind_pair16(text, size/2, needle, needlesize/2,
+                                 cn->skips);
+}
+
+static unsigned short const *utf16_find(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize size,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    unsigned short const *match;
+
+    match = size>=needlesize
+        ? engine_find16(cn, text, size, needle, needlesize) : 0;
+    STAT_FORWARD(text, size, match, needlesize);
+    return match;
+}
+
+static unsigned short const *utf16_rfind(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize size,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    unsigned short const *match;
+
+    match = size>=needlesize
+        ? engine_rfind16(cn, text, size, needle, needlesize) : 0;
+    STAT_BACKWARD(text, size, match);
+    return match;
+}
+
+/*
+ * Like needle_find_after and needle_rfind_before, with sizes in bytes
+ * and skip in code units.
+ */
+static unsigned short const *utf16_find_after(
+    compiled const *cn,
+    unsigned short const *match,
+    vsize size,
+    vsize skip,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    unsigned short const *next;
+    vsize from, memory, ix;
+
+    if (cn->engine!=ENGINE_TWOWAY && cn->engine!=ENGINE_TWOFOLD) {
+        return skip<=size/2 ? utf16_find(cn, match+skip, size-skip*2,
+                                         needle, needlesize) : 0;
+    }
+    twoway_resume(&cn->tw, needlesize/2, skip, &from, &memory);
+    ix = cn->engine==ENGINE_TWOWAY
+        ? twoway_scan16(&cn->tw, needle, needlesize/2, match, 1, size/2,
+                        from, memory)
+        : twoway_fold_scan(&cn->tw, cn->folded, needlesize/2, cn->fold,
+                           match, size/2, from, memory);
+    next = ix!=(vsize)-1 ? match+ix : 0;
+    STAT_FORWARD(match+skip, size-skip*2, next, needlesize);
+    return next;
+}
+
+static unsigned short const *utf16_rfind_before(
+    compiled const *cn,
+    unsigned short const *text,
+    unsigned short const *match,
+    unsigned short const *needle,
+    vsize needlesize)
+{
+    unsigned short const *next;
+    vsize length, from, memory, ix;
+
+    length = match-text+needlesize/2;
+    if (cn->engine!=ENGINE_TWOWAY && cn->engine!=ENGINE_TWOFOLD)
+        return utf16_rfind(cn, text, length*2-2, needle, needlesize);
+    twoway_resume(&cn->tw, needlesize/2, 1, &from, &memory);
+    ix = cn->engine==ENGINE_TWOWAY
+        ? twoway_scan16(&cn->tw, (unsigned short const *)cn->rneedle,
+                        needlesize/2, text+length-1, -1, length, from, memory)
+        : twoway_fold_scan(&cn->tw, cn->rneedle, needlesize/2,
+                           cn->fold|FOLD_BACKWARDS, text, length,
+                           from, memory);
+    next = ix!=(vsize)-1 ? text+(length-needlesize/2-ix) : 0;
+    STAT_BACKWARD(text, length*2-2, next);
+    return next;
+}
+
+static unsigned short const *utf16_rfind_nth(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize size,
+    unsigned short const *needle,
+    vsize needlesize,
+    sqlite3_int64 occurrence)
+{
+    unsigned short const *match;
+
+    match = utf16_rfind(cn, text, size, needle, needlesize);
+    while (match && --occurrence>0) {
+        match = utf16_rfind_before(cn, text, match, needle, needlesize);
+    }
+    return match;
+}
+
+static int utf16_count(
+    unsigned short const *text,
+    vsize size,
+    int swapped,
+    sqlite3_int64 *countOut)
+{
+    sqlite3_int64 count;
+    int codepoint;
+
+    count = 0;
+    while (size>0) {
+        UTF16_ADVANCE(text, size, codepoint, swapped);
+        if (codepoint==-1)
+            return -1;
+        count++;
+    }
+    *countOut = count;
+    return 0;
+}
+
+/*
+ * Like utf8_next, with sizes in bytes and offsets in code units.
+ * A needle that starts with a low surrogate can match inside
+ * a character.
+ */
+static int utf16_next(
+    compiled const *cn,
+    unsigned short const *text,
+    vsize size,
+    vsize skip,
+    unsigned short const *needle,
+    vsize needlesize,
+    int trusted,
+    vsize *offsetOut,
+    sqlite3_int64 *countOut)
+{
+    unsigned short const *match;
+    sqlite3_int64 count;
+    int swapped;
+
+    if (skip>size/2)
+        return 0;
+    swapped = cn->kind&SEARCH_SWAPPED;
+    if ((UNIT16(needle, 0, swapped)&0xFC00)==0xDC00) {
+        unsigned short const *walk;
+        vsize rest;
+        int codepoint;
+
+        walk = text;
+        rest = size;
+        count = 0;
+        for (;;) {
+            match = utf16_find(
+                cn, text+skip, size-skip*2, needle, needlesize);
+            if (!match)
+                return 0;
+            while (walk<match) {
+                if (trusted) {
+                    UTF16_SKIP(walk, rest, swapped);
+                } else {
+                    UTF16_ADVANCE(walk, rest, codepoint, swapped);
+                    if (codepoint==-1)
+                        return -1;
+                }
+                count++;
+            }
+            if (walk==match)
+                break;
+            skip = walk-text;
+        }
+    } else {
+        match = skip>0
+            ? utf16_find_after(cn, text, size, skip, needle, needlesize)
+            : utf16_find(cn, text, size, needle, needlesize);
+        if (!match)
+            return 0;
+        if (trusted) {
+            count = kernels->utf16_leads(text, match-text, swapped);
+        } else if (utf16_count(text, (match-text)*2, swapped, &count)) {
+            return -1;
+        }
+    }
+    STAT(STAT_WALKED, count);
+    *offsetOut = match-text;
+    *countOut = count;
+    return 1;
+}
+
+static sqlite3_int64 instr_utf16(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    compiled const *cn,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence,
+    int trusted,
+    charindex *ix)
+{
+    sqlite3_int64 found, count;
+    vsize offset, skip;
+    int status;
+
+    if (needlesize>stacksize)
+        return 0;
+    if (needlesize<=0 && start<=0x7FFFFFFFFFFFFFFFLL-occurrence)
+        start = (start>1 ? start : 1)+occurrence-1;
+    found = utf16_seek(ix, &haystack, &stacksize, start, needlesize,
+                       trusted, cn->kind&SEARCH_SWAPPED);
+    if (found<0)
+        return -1;
+    if (found<start)
+        return 0;
+    if (needlesize<=0)
+        return found;
+    skip = 0;
+    for (;;) {
+        status = utf16_next(cn, haystack, stacksize, skip, needle, needlesize,
+                            trusted, &offset, &count);
+        if (status<=0)
+            return status;
+        found += count;
+        if (--occurrence<=0)
+            return found;
+        haystack += offset;
+        stacksize -= offset*2;
+        skip = 1;
+    }
+}
+
+typedef struct encspec {
+    int rep;
+    int trusted;
+} encspec;
+
+static int native_utf16(void)
+{
+    unsigned short probe = 1;
+
+    return *(unsigned char const *)&probe ? SQLITE_UTF16LE : SQLITE_UTF16BE;
+}
+
+/*
+ * Decide which representation to search text in.  That's the one the
+ * haystack is stored in if SQLite can tell us, so that it isn't
+ * converted just to be searched, and otherwise the one the function
+ * was registered for.  The needle is converted to match instead.
+ */
+static int text_kind(
+    sqlite3_value *haystack,
+    encspec const *enc)
+{
+    int rep;
+
+    rep = enc->rep&(SQLITE_UTF8|SQLITE_UTF16LE|SQLITE_UTF16BE);
+#if SQLITE_VERSION_NUMBER>=3041000
+    if (sqlite3_value_type(haystack)==SQLITE_TEXT
+            && sqlite3_libversion_number()>=3041000)
+        rep = sqlite3_value_encoding(haystack);
+#endif
+    if (rep==SQLITE_UTF8)
+        return SEARCH_UTF8;
+    return rep==native_utf16() ? SEARCH_UTF16 : SEARCH_UTF16|SEARCH_SWAPPED;
+}
+
+static void const *text_of(
+    sqlite3_value *value,
+    int kind)
+{
+    if (kind==SEARCH_UTF8)
+        return sqlite3_value_text(value);
+    if (!(kind&SEARCH_SWAPPED))
+        return sqlite3_value_text16(value);
+    if (native_utf16()==SQLITE_UTF16LE)
+        return sqlite3_value_text16be(value);
+    return sqlite3_value_text16le(value);
+}
+
+static void search_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args,
+    int nocase)
+{
+    int stacktype, needletype;
+    void const *haystack, *needle;
+    vsize stacksize, needlesize;
+    sqlite3_int64 start, occurrence, result;
+    encspec const *enc;
+    char const *malformed;
+    compiled *cn;
+    charindex *ix;
+    int kind, fresh, ixfresh;
+
+    if (argc<2)
+        goto confused;
+    stacktype = sqlite3_value_type(args[0]);
+    if (stacktype==SQLITE_NULL)
+        return;
+    needletype = sqlite3_value_type(args[1]);
+    if (needletype==SQLITE_NULL)
+        return;
+    if (argc>=3) {
+        if (sqlite3_value_type(args[2])==SQLITE_NULL)
+            return;
+        start = sqlite3_value_int64(args[2]);
+    } else {
+        start = 1;
+    }
+    occurrence = 1;
+    if (argc>=4) {
+        if (sqlite3_value_type(args[3])==SQLITE_NULL)
+            return;
+        occurrence = sqlite3_value_int64(args[3]);
+        if (occurrence<=0) {
+            sqlite3_result_error(context, nonpositive,
+                                 sizeof nonpositive-1);
+            return;
+        }
+    }
+    enc = sqlite3_user_data(context);
+    kind = text_kind(args[0], enc);
+    malformed = kind==SEARCH_UTF8 ? malformed_8 : malformed_16;
+    ix = 0;
+    ixfresh = 0;
+    if (stacktype==SQLITE_BLOB && needletype==SQLITE_BLOB) {
+        haystack = sqlite3_value_blob(args[0]);
+        stacksize = sqlite3_value_bytes(args[0]);
+        if (!haystack && stacksize>0)
+            goto nomem;
+        needle = sqlite3_value_blob(args[1]);
+        needlesize = sqlite3_value_bytes(args[1]);
+        if (!needle && needlesize>0)
+            goto nomem;
+        cn = get_needle(context, SEARCH_BLOB|nocase, needle, needlesize,
+                        stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        result = instr_blob(
+            haystack, stacksize, needle, needlesize, cn, start, occurrence);
+    } else if (kind==SEARCH_UTF8) {
+        haystack = sqlite3_value_text(args[0]);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_text(args[1]);
+        if (!needle)
+            goto nomem;
+        needlesize = sqlite3_value_bytes(args[1]);
+        cn = get_needle(context, SEARCH_UTF8|nocase, needle, needlesize,
+                        stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        ix = get_index(context, SEARCH_UTF8, haystack, stacksize, start,
+                       &ixfresh);
+        result = instr_utf8(
+            haystack, stacksize, needle, needlesize, cn, start, occurrence,
+            enc->trusted, ix);
+    } else {
+        haystack = text_of(args[0], kind);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes16(args[0])&~(vsize)1;
+        needle = text_of(args[1], kind);
+        if (!needle)
+            goto nomem;
+        needlesize = sqlite3_value_bytes16(args[1])&~(vsize)1;
+        cn = get_needle(context, kind|nocase, needle, needlesize, stacksize,
+                        &fresh);
+        if (!cn)
+            goto nomem;
+        ix = get_index(context, kind, haystack, stacksize, start, &ixfresh);
+        result = instr_utf16(
+            haystack, stacksize, needle, needlesize, cn, start, occurrence,
+            enc->trusted, ix);
+    }
+    if (result<0) {
+        sqlite3_result_error(context, malformed, -1);
+    } else {
+        sqlite3_result_int64(context, result);
+    }
+    cache_needle(context, cn, fresh);
+    cache_index(context, ix, ixfresh);
+    return;
+
+confused:
+    sqlite3_result_error(context, confused, sizeof confused-1);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void instr_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    search_func(context, argc, args, 0);
+}
+
+static void instr_nocase_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    search_func(context, argc, args, SEARCH_NOCASE);
+}
+
+static sqlite3_int64 rinstr_blob(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    compiled const *cn,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence)
+{
+    unsigned char const *match;
+    vsize limit;
+
+    if (start<=0)
+        return 0;
+    if (needlesize>stacksize)
+        return 0;
+    limit = stacksize-needlesize;
+    if (start-1<(sqlite3_int64)limit)
+        limit = start-1;
+    if (needlesize<=0)
+        return limit+1>=occurrence ? limit+2-occurrence : 0;
+    match = needle_rfind_nth(cn, haystack, limit+needlesize,
+                             needle, needlesize, occurrence);
+    return match ? match-haystack+1 : 0;
+}
+
+/*
+ * Check each character boundary from text up to last for a match of a
+ * needle that may start inside a character.  Returns the position of
+ * the nth match if nth is positive, and otherwise the number of matches.
+ */
+static sqlite3_int64 utf8_boundary_matches(
+    unsigned char const *text,
+    vsize size,
+    unsigned char const *last,
+    unsigned char const *needle,
+    vsize needlesize,
+    sqlite3_int64 nth)
+{
+    sqlite3_int64 pos, count;
+
+    pos = 1;
+    count = 0;
+    for (;;) {
+        if (text[0]==needle[0] && !memcmp(text, needle, needlesize)
+                && ++count==nth)
+            return pos;
+        if (text>=last)
+            return nth>0 ? 0 : count;
+        UTF8_SKIP(text, size);
+        pos++;
+    }
+}
+
+static sqlite3_int64 utf16_boundary_matches(
+    unsigned short const *text,
+    vsize size,
+    unsigned short const *last,
+    unsigned short const *needle,
+    vsize needlesize,
+    int swapped,
+    sqlite3_int64 nth)
+{
+    sqlite3_int64 pos, count;
+
+    pos = 1;
+    count = 0;
+    for (;;) {
+        if (text[0]==needle[0] && !memcmp(text, needle, needlesize)
+                && ++count==nth)
+            return pos;
+        if (text>=last)
+            return nth>0 ? 0 : count;
+        UTF16_SKIP(text, size, swapped);
+        pos++;
+    }
+}
+
+/*
+ * When the start position can't cut the search short, search backwards
+ * from the end and count the characters in front of the match.  Otherwise
+ * walk to the start position and search backwards from there; the text
+ * up to it is known to be well-formed by then, so the match position
+ * is found by counting characters back from it.  Needles that start
+ * with a continuation byte can match inside a character, so for those
+ * every character boundary is checked instead, once to count the matches
+ * and again to find the one that's wanted.
+ */
+static sqlite3_int64 rinstr_utf8(
+    unsigned char const *haystack,
+    vsize stacksize,
+    unsigned char const *needle,
+    vsize needlesize,
+    compiled const *cn,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence,
+    int trusted,
+    charindex *ix)
+{
+    unsigned char const *haystart, *match;
+    sqlite3_int64 found, count, total;
+    int midchar;
+
+    if (start<=0)
+        return 0;
+    if (needlesize>stacksize)
+        return 0;
+    midchar = needlesize>0 && needle[0]>=0x80 && needle[0]<0xC0;
+    if (needlesize>0 && start>stacksize && !midchar) {
+        match = needle_rfind_nth(cn, haystack, stacksize,
+                                 needle, needlesize, occurrence);
+        if (!match)
+            return 0;
+        if (trusted) {
+            count = kernels->utf8_leads(haystack, match-haystack);
+        } else if (kernels->utf8_count(haystack, match-haystack, &count)) {
+            return -1;
+        }
+        STAT(STAT_WALKED, count);
+        return 1+count;
+    }
+    haystart = haystack;
+    found = utf8_seek(ix, &haystack, &stacksize, start, needlesize, trusted);
+    if (found<0)
+        return -1;
+    if (needlesize<=0)
+        return found>=occurrence ? found+1-occurrence : 0;
+    if (midchar) {
+        vsize rest = haystack-haystart+stacksize;
+
+        total = utf8_boundary_matches(haystart, rest, haystack,
+                                      needle, needlesize, 0);
+        if (total<occurrence)
+            return 0;
+        return utf8_boundary_matches(haystart, rest, haystack,
+                                     needle, needlesize, total-occurrence+1);
+    }
+    match = needle_rfind_nth(cn, haystart, haystack-haystart+needlesize,
+                             needle, needlesize, occurrence);
+    if (!match)
+        return 0;
+    count = kernels->utf8_leads(match, haystack-match);
+    STAT(STAT_WALKED, count);
+    return found-count;
+}
+
+static sqlite3_int64 rinstr_utf16(
+    unsigned short const *haystack,
+    vsize stacksize,
+    unsigned short const *needle,
+    vsize needlesize,
+    compiled const *cn,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence,
+    int trusted,
+    charindex *ix)
+{
+    unsigned short const *haystart, *match;
+    sqlite3_int64 found, count, total;
+    int swapped, midchar;
+
+    if (start<=0)
+        return 0;
+    if (needlesize>stacksize)
+        return 0;
+    swapped = cn->kind&SEARCH_SWAPPED;
+    midchar = needlesize>0 && (UNIT16(needle, 0, swapped)&0xFC00)==0xDC00;
+    if (needlesize>0 && start>stacksize/2 && !midchar) {
+        match = utf16_rfind_nth(cn, haystack, stacksize,
+                                needle, needlesize, occurrence);
+        if (!match)
+            return 0;
+        if (trusted) {
+            count = kernels->utf16_leads(haystack, match-haystack, swapped);
+        } else if (utf16_count(haystack, (match-haystack)*2, swapped,
+                               &count)) {
+            return -1;
+        }
+        STAT(STAT_WALKED, count);
+        return 1+count;
+    }
+    haystart = haystack;
+    found = utf16_seek(ix, &haystack, &stacksize, start, needlesize,
+                       trusted, swapped);
+    if (found<0)
+        return -1;
+    if (needlesize<=0)
+        return found>=occurrence ? found+1-occurrence : 0;
+    if (midchar) {
+        vsize rest = (haystack-haystart)*2+stacksize;
+
+        total = utf16_boundary_matches(haystart, rest, haystack,
+                                       needle, needlesize, swapped, 0);
+        if (total<occurrence)
+            return 0;
+        return utf16_boundary_matches(haystart, rest, haystack,
+                                      needle, needlesize, swapped,
+                                      total-occurrence+1);
+    }
+    match = utf16_rfind_nth(cn, haystart, (haystack-haystart)*2+needlesize,
+                            needle, needlesize, occurrence);
+    if (!match)
+        return 0;
+    count = kernels->utf16_leads(match, haystack-match, swapped);
+    STAT(STAT_WALKED, count);
+    return found-count;
+}
+
+static void rsearch_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args,
+    int nocase)
+{
+    int stacktype, needletype;
+    void const *haystack, *needle;
+    vsize stacksize, needlesize;
+    sqlite3_int64 start, occurrence, result;
+    encspec const *enc;
+    char const *malformed;
+    compiled *cn;
+    charindex *ix;
+    int kind, fresh, ixfresh;
+
+    if (argc<2)
+        goto confused;
+    stacktype = sqlite3_value_type(args[0]);
+    if (stacktype==SQLITE_NULL)
+        return;
+    needletype = sqlite3_value_type(args[1]);
+    if (needletype==SQLITE_NULL)
+        return;
+    if (argc>=3) {
+        if (sqlite3_value_type(args[2])==SQLITE_NULL)
+            return;
+        start = sqlite3_value_int64(args[2]);
+    } else {
+        start = 0x7FFFFFFFFFFFFFFFLL;
+    }
+    occurrence = 1;
+    if (argc>=4) {
+        if (sqlite3_value_type(args[3])==SQLITE_NULL)
+            return;
+        occurrence = sqlite3_value_int64(args[3]);
+        if (occurrence<=0) {
+            sqlite3_result_error(context, nonpositive,
+                                 sizeof nonpositive-1);
+            return;
+        }
+    }
+    enc = sqlite3_user_data(context);
+    kind = text_kind(args[0], enc);
+    malformed = kind==SEARCH_UTF8 ? malformed_8 : malformed_16;
+    ix = 0;
+    ixfresh = 0;
+    if (stacktype==SQLITE_BLOB && needletype==SQLITE_BLOB) {
+        haystack = sqlite3_value_blob(args[0]);
+        stacksize = sqlite3_value_bytes(args[0]);
+        if (!haystack && stacksize>0)
+            goto nomem;
+        needle = sqlite3_value_blob(args[1]);
+        needlesize = sqlite3_value_bytes(args[1]);
+        if (!needle && needlesize>0)
+            goto nomem;
+        cn = get_needle(context, SEARCH_BLOB|SEARCH_REVERSE|nocase, needle,
+                        needlesize, stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        result = rinstr_blob(
+            haystack, stacksize, needle, needlesize, cn, start, occurrence);
+    } else if (kind==SEARCH_UTF8) {
+        haystack = sqlite3_value_text(args[0]);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_text(args[1]);
+        if (!needle)
+            goto nomem;
+        needlesize = sqlite3_value_bytes(args[1]);
+        cn = get_needle(context, SEARCH_UTF8|SEARCH_REVERSE|nocase, needle,
+                        needlesize, stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        ix = get_index(context, SEARCH_UTF8, haystack, stacksize, start,
+                       &ixfresh);
+        result = rinstr_utf8(
+            haystack, stacksize, needle, needlesize, cn, start, occurrence,
+            enc->trusted, ix);
+    } else {
+        haystack = text_of(args[0], kind);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes16(args[0])&~(vsize)1;
+        needle = text_of(args[1], kind);
+        if (!needle)
+            goto nomem;
+        needlesize = sqlite3_value_bytes16(args[1])&~(vsize)1;
+        cn = get_needle(context, kind|SEARCH_REVERSE|nocase, needle,
+                        needlesize, stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        ix = get_index(context, kind, haystack, stacksize, start, &ixfresh);
+        result = rinstr_utf16(
+            haystack, stacksize, needle, needlesize, cn, start, occurrence,
+            enc->trusted, ix);
+    }
+    if (result<0) {
+        sqlite3_result_error(context, malformed, -1);
+    } else {
+        sqlite3_result_int64(context, result);
+    }
+    cache_needle(context, cn, fresh);
+    cache_index(context, ix, ixfresh);
+    return;
+
+confused:
+    sqlite3_result_error(context, confused, sizeof confused-1);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void rinstr_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    rsearch_func(context, argc, args, 0);
+}
+
+static void rinstr_nocase_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    rsearch_func(context, argc, args, SEARCH_NOCASE);
+}
+
+/*
+ * instr_any and instr_which look for several needles at once with an
+ * Aho-Corasick automaton, run over bytes for blobs and UTF-8 and over
+ * code units for UTF-16.  Symbols that don't occur in any needle share
+ * a single class, which keeps the transition table narrow.
+ *
+ * The automaton is attached to the first needle argument.  The other
+ * needles could change without that being dropped, so it keeps a copy
+ * of each of them to check against.
+ */
+
+typedef struct automaton {
+    int kind;
+    int nneedles;
+    vsize *sizes;
+    unsigned char *copies;
+    compiled **midneedles;
+    unsigned int *classes;
+    unsigned int nclasses;
+    unsigned int *delta;
+    unsigned int *depth;
+    int *outidx;
+    unsigned int *outlen;
+    int *textidx;
+    unsigned int *textlen;
+} automaton;
+
+static void free_automaton(
+    void *ptr)
+{
+    automaton *ac = ptr;
+    int ix;
+
+    if (ac->midneedles) {
+        for (ix = 0; ix<ac->nneedles; ix++) {
+            sqlite3_free(ac->midneedles[ix]);
+        }
+        sqlite3_free(ac->midneedles);
+    }
+    sqlite3_free(ac->sizes);
+    sqlite3_free(ac->copies);
+    sqlite3_free(ac->classes);
+    sqlite3_free(ac->delta);
+    sqlite3_free(ac->depth);
+    if (ac->textidx!=ac->outidx) {
+        sqlite3_free(ac->textidx);
+        sqlite3_free(ac->textlen);
+    }
+    sqlite3_free(ac->outidx);
+    sqlite3_free(ac->outlen);
+    sqlite3_free(ac);
+}
+
+/*
+ * Get a needle argument in the representation kind calls for.
+ * A NULL needle gets the size (vsize)-1.
+ */
+static int needle_arg(
+    sqlite3_value *arg,
+    int kind,
+    void const **dataOut,
+    vsize *sizeOut)
+{
+    void const *data;
+    vsize size;
+
+    if (sqlite3_value_type(arg)==SQLITE_NULL) {
+        *dataOut = 0;
+        *sizeOut = (vsize)-1;
+        return SQLITE_OK;
+    }
+    if (kind==SEARCH_BLOB) {
+        data = sqlite3_value_blob(arg);
+        size = sqlite3_value_bytes(arg);
+    } else if (kind==SEARCH_UTF8) {
+        data = sqlite3_value_text(arg);
+        size = sqlite3_value_bytes(arg);
+    } else {
+        data = text_of(arg, kind);
+        size = sqlite3_value_bytes16(arg)&~(vsize)1;
+    }
+    if (!data && (kind!=SEARCH_BLOB || size>0))
+        return SQLITE_NOMEM;
+    *dataOut = data;
+    *sizeOut = size;
+    return SQLITE_OK;
+}
+
+static int automaton_matches(
+    automaton const *ac,
+    int kind,
+    int nneedles,
+    sqlite3_value **needles)
+{
+    unsigned char const *copy;
+    void const *data;
+    vsize size;
+    int ix;
+
+    if (ac->kind!=kind || ac->nneedles!=nneedles)
+        return 0;
+    copy = ac->copies;
+    for (ix = 0; ix<nneedles; ix++) {
+        if (needle_arg(needles[ix], kind, &data, &size)!=SQLITE_OK
+                || size!=ac->sizes[ix])
+            return 0;
+        if (size!=(vsize)-1 && size>0) {
+            if (memcmp(copy, data, size))
+                return 0;
+            copy += size;
+        }
+    }
+    return 1;
+}
+
+/*
+ * A needle can only match at a character boundary if it starts with
+ * a lead byte or something other than a low surrogate.
+ */
+static int starts_midchar(
+    int kind,
+    unsigned char const *needle,
+    vsize needlesize)
+{
+    unsigned int unit;
+
+    if (needlesize<=0 || kind==SEARCH_BLOB)
+        return 0;
+    if (kind==SEARCH_UTF8)
+        return needle[0]>=0x80 && needle[0]<0xC0;
+    unit = UNIT16((unsigned short const *)needle, 0, kind&SEARCH_SWAPPED);
+    return (unit&0xFC00)==0xDC00;
+}
+
+/*
+ * Build the tables of an automaton that has its needles copied in,
+ * or free it if that runs out of memory.
+ */
+static automaton *finish_automaton(
+    automaton *ac,
+    sqlite3_uint64 total)
+{
+    unsigned char *copy;
+    unsigned int *fail, *queue;
+    unsigned int symbols, width, nstates, nclasses;
+    unsigned int state, next, head, tail, cls;
+    vsize size, pos;
+    int ix, kind, nneedles;
+
+    kind = ac->kind;
+    nneedles = ac->nneedles;
+    width = (kind&~SEARCH_SWAPPED)==SEARCH_UTF16 ? 2 : 1;
+    symbols = width==2 ? 0x10000 : 0x100;
+    ac->classes = sqlite3_malloc64(symbols*sizeof *ac->classes);
+    if (!ac->classes)
+        goto nomem;
+    memset(ac->classes, 0, symbols*sizeof *ac->classes);
+    nclasses = 1;
+    copy = ac->copies;
+    for (pos = 0; pos<total; pos += width) {
+        unsigned int sym;
+
+        sym = width==2 ? ((unsigned short const *)copy)[pos/2] : copy[pos];
+        if (!ac->classes[sym])
+            ac->classes[sym] = nclasses++;
+    }
+    ac->nclasses = nclasses;
+
+    nstates = (unsigned int)(total/width)+1;
+    ac->delta = sqlite3_malloc64(
+        (sqlite3_uint64)nstates*nclasses*sizeof *ac->delta);
+    ac->depth = sqlite3_malloc64((sqlite3_uint64)nstates*sizeof *ac->depth);
+    ac->outidx = sqlite3_malloc64((sqlite3_uint64)nstates*sizeof *ac->outidx);
+    ac->outlen = sqlite3_malloc64((sqlite3_uint64)nstates*sizeof *ac->outlen);
+    if (!ac->delta || !ac->depth || !ac->outidx || !ac->outlen)
+        goto nomem;
+    memset(ac->delta, 0, (size_t)nstates*nclasses*sizeof *ac->delta);
+
+    /*
+     * Needles that start inside a character are compiled on their own
+     * for text, and only reported by the outputs for bytes.
+     */
+    copy = ac->copies;
+    for (ix = 0; ix<nneedles; ix++) {
+        size = ac->sizes[ix];
+        if (size==(vsize)-1)
+            continue;
+        if (starts_midchar(kind, copy, size)) {
+            if (!ac->midneedles) {
+                ac->midneedles = sqlite3_malloc64(
+                    (sqlite3_uint64)nneedles*sizeof *ac->midneedles);
+                if (!ac->midneedles)
+                    goto nomem;
+                memset(ac->midneedles, 0,
+                       (size_t)nneedles*sizeof *ac->midneedles);
+            }
+            ac->midneedles[ix] = compile_needle(kind, copy, size, PLAN_SMALL);
+            if (!ac->midneedles[ix])
+                goto nomem;
+        }
+        copy += size;
+    }
+    if (ac->midneedles) {
+        ac->textidx = sqlite3_malloc64(
+            (sqlite3_uint64)nstates*sizeof *ac->textidx);
+        ac->textlen = sqlite3_malloc64(
+            (sqlite3_uint64)nstates*sizeof *ac->textlen);
+        if (!ac->textidx || !ac->textlen)
+            goto nomem;
+    } else {
+        ac->textidx = ac->outidx;
+        ac->textlen = ac->outlen;
+    }
+    ac->depth[0] = 0;
+    ac->outidx[0] = ac->textidx[0] = -1;
+    ac->outlen[0] = ac->textlen[0] = 0;
+
+    /* the trie */
+    nstates = 1;
+    copy = ac->copies;
+    for (ix = 0; ix<nneedles; ix++) {
+        size = ac->sizes[ix];
+        if (size==(vsize)-1)
+            continue;
+        state = 0;
+        for (pos = 0; pos<size; pos += width) {
+            unsigned int sym;
+
+            sym = width==2 ? ((unsigned short const *)copy)[pos/2]
+                : copy[pos];
+            cls = ac->classes[sym];
+            next = ac->delta[state*nclasses+cls];
+            if (!next) {
+                next = nstates++;
+                ac->delta[state*nclasses+cls] = next;
+                ac->depth[next] = ac->depth[state]+1;
+                ac->outidx[next] = ac->textidx[next] = -1;
+                ac->outlen[next] = ac->textlen[next] = 0;
+            }
+            state = next;
+        }
+        if (ac->outidx[state]<0) {
+            ac->outidx[state] = ix;
+            ac->outlen[state] = ac->depth[state];
+        }
+        if (ac->textidx[state]<0
+                && !(ac->midneedles && ac->midneedles[ix])) {
+            ac->textidx[state] = ix;
+            ac->textlen[state] = ac->depth[state];
+        }
+        copy += size;
+    }
+
+    /*
+     * Breadth first, fill in the missing transitions from the failure
+     * states, and let each state report the longest needle that ends
+     * there; that one starts first.
+     */
+    fail = sqlite3_malloc64((sqlite3_uint64)nstates*sizeof *fail);
+    queue = sqlite3_malloc64((sqlite3_uint64)nstates*sizeof *queue);
+    if (!fail || !queue) {
+        sqlite3_free(fail);
+        sqlite3_free(queue);
+        goto nomem;
+    }
+    head = tail = 0;
+    for (cls = 0; cls<nclasses; cls++) {
+        next = ac->delta[cls];
+        if (next) {
+            fail[next] = 0;
+            queue[tail++] = next;
+        }
+    }
+    while (head<tail) {
+        unsigned int *row, *failrow;
+
+        state = queue[head++];
+        if (ac->outidx[state]<0) {
+            ac->outidx[state] = ac->outidx[fail[state]];
+            ac->outlen[state] = ac->outlen[fail[state]];
+        }
+        if (ac->textidx[state]<0) {
+            ac->textidx[state] = ac->textidx[fail[state]];
+            ac->textlen[state] = ac->textlen[fail[state]];
+        }
+        row = ac->delta+state*nclasses;
+        failrow = ac->delta+fail[state]*nclasses;
+        for (cls = 0; cls<nclasses; cls++) {
+            next = row[cls];
+            if (next) {
+                fail[next] = failrow[cls];
+                queue[tail++] = next;
+            } else {
+                row[cls] = failrow[cls];
+            }
+        }
+    }
+    sqlite3_free(fail);
+    sqlite3_free(queue);
+    return ac;
+
+nomem:
+    free_automaton(ac);
+    return 0;
+}
+
+static automaton *build_automaton(
+    int kind,
+    int nneedles,
+    sqlite3_value **needles)
+{
+    automaton *ac;
+    unsigned char *copy;
+    sqlite3_uint64 total;
+    void const *data;
+    vsize size;
+    int ix;
+
+    ac = sqlite3_malloc(sizeof *ac);
+    if (!ac)
+        return 0;
+    memset(ac, 0, sizeof *ac);
+    ac->kind = kind;
+    ac->nneedles = nneedles;
+    ac->sizes = sqlite3_malloc64((sqlite3_uint64)nneedles*sizeof *ac->sizes);
+    if (!ac->sizes)
+        goto nomem;
+    total = 0;
+    for (ix = 0; ix<nneedles; ix++) {
+        if (needle_arg(needles[ix], kind, &data, &size)!=SQLITE_OK)
+            goto nomem;
+        ac->sizes[ix] = size;
+        if (size!=(vsize)-1)
+            total += size;
+    }
+    ac->copies = sqlite3_malloc64(total+1);
+    if (!ac->copies)
+        goto nomem;
+    copy = ac->copies;
+    for (ix = 0; ix<nneedles; ix++) {
+        if (ac->sizes[ix]!=(vsize)-1 && ac->sizes[ix]>0) {
+            needle_arg(needles[ix], kind, &data, &size);
+            memcpy(copy, data, size);
+            copy += size;
+        }
+    }
+    return finish_automaton(ac, total);
+
+nomem:
+    free_automaton(ac);
+    return 0;
+}
+
+/*
+ * Run the automaton until no match can start before the best one
+ * found so far.  Returns the offset of the match in symbols and sets
+ * *whichOut to its needle, or returns (vsize)-1 if nothing matches.
+ * The match that starts first wins, and among those the needle that
+ * comes first in the argument list.  If chars is set, needles that
+ * start inside a character aren't reported.
+ */
+static vsize automaton_scan(
+    automaton const *ac,
+    int chars,
+    void const *text,
+    vsize length,
+    int *whichOut)
+{
+    unsigned char const *bytes = text;
+    unsigned short const *units = text;
+    int const *outidx;
+    unsigned int const *outlen;
+    vsize pos, best, start;
+    unsigned int state, nclasses;
+    int bestix, ix;
+
+    outidx = chars ? ac->textidx : ac->outidx;
+    outlen = chars ? ac->textlen : ac->outlen;
+    nclasses = ac->nclasses;
+    best = (vsize)-1;
+    bestix = outidx[0];
+    if (bestix>=0)
+        best = 0;
+    state = 0;
+    for (pos = 0; pos<length; pos++) {
+        unsigned int sym;
+
+        if (best!=(vsize)-1 && pos-ac->depth[state]>best)
+            break;
+        sym = (ac->kind&~SEARCH_SWAPPED)==SEARCH_UTF16 ? units[pos]
+            : bytes[pos];
+        state = ac->delta[state*nclasses+ac->classes[sym]];
+        ix = outidx[state];
+        if (ix>=0) {
+            start = pos+1-outlen[state];
+            if (best==(vsize)-1 || start<best
+                    || start==best && ix<bestix) {
+                best = start;
+                bestix = ix;
+            }
+        }
+    }
+    STAT(STAT_SEARCHES, 1);
+    STAT(STAT_SCANNED, (ac->kind&~SEARCH_SWAPPED)==SEARCH_UTF16 ? pos*2 : pos);
+    *whichOut = bestix;
+    return best;
+}
+
+/*
+ * Count the characters before a match that starts offset symbols into
+ * the haystack.  Returns nonzero if the text before it is malformed.
+ */
+static int match_chars(
+    int kind,
+    int trusted,
+    void const *haystack,
+    vsize offset,
+    sqlite3_int64 *countOut)
+{
+    if (kind==SEARCH_BLOB) {
+        *countOut = offset;
+    } else if (trusted) {
+        *countOut = kind==SEARCH_UTF8 ? kernels->utf8_leads(haystack, offset)
+            : kernels->utf16_leads(haystack, offset, kind&SEARCH_SWAPPED);
+    } else {
+        return kind==SEARCH_UTF8
+            ? kernels->utf8_count(haystack, offset, countOut)
+            : utf16_count(haystack, offset*2, kind&SEARCH_SWAPPED, countOut);
+    }
+    return 0;
+}
+
+/*
+ * Find the first match of any of an automaton's needles, as the
+ * position of a character, 0 if there is none, or -1 if the text
+ * before the first match is malformed.  kind is that of the haystack:
+ * an automaton built for text also searches blobs, as bytes.  In text,
+ * needles that start inside a character only match where malformed
+ * text has one begin at a character boundary, so the automaton doesn't
+ * report those; they are compiled on their own and looked for one at
+ * a time as instr does, and only lead to an error if nothing matches.
+ * *whichOut is set to the needle that matched, the first in the list
+ * among those at the same position.
+ */
+static void automaton_find(
+    automaton const *ac,
+    int kind,
+    int trusted,
+    void const *haystack,
+    vsize stacksize,
+    sqlite3_int64 *resultOut,
+    int *whichOut)
+{
+    unsigned char const *copy;
+    sqlite3_int64 result, found;
+    vsize offset, size, bytes;
+    int which, ix;
+
+    offset = automaton_scan(ac, kind!=SEARCH_BLOB, haystack, stacksize,
+                            &which);
+    if (offset==(vsize)-1) {
+        result = 0;
+    } else if (match_chars(kind, trusted, haystack, offset, &result)) {
+        result = -1;
+    } else {
+        result++;
+    }
+    if (kind!=SEARCH_BLOB && ac->midneedles) {
+        bytes = (ac->kind&~SEARCH_SWAPPED)==SEARCH_UTF16 ? stacksize*2
+            : stacksize;
+        copy = ac->copies;
+        for (ix = 0; ix<ac->nneedles; ix++) {
+            size = ac->sizes[ix];
+            if (size==(vsize)-1)
+                continue;
+            if (ac->midneedles[ix]) {
+                found = ac->kind==SEARCH_UTF8
+                    ? instr_utf8(haystack, bytes, copy, size,
+                                 ac->midneedles[ix], 1, 1, trusted, 0)
+                    : instr_utf16(haystack, bytes,
+                                  (unsigned short const *)copy, size,
+                                  ac->midneedles[ix], 1, 1, trusted, 0);
+                if (found>0 && (result<=0 || found<result
+                                || found==result && ix<which)) {
+                    result = found;
+                    which = ix;
+                } else if (found<0 && result==0) {
+                    result = -1;
+                }
+            }
+            copy += size;
+        }
+    }
+    *resultOut = result;
+    *whichOut = which;
+}
+
+static void multi_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args,
+    int which)
+{
+    encspec const *enc;
+    automaton *ac;
+    void const *haystack;
+    vsize stacksize;
+    sqlite3_int64 result;
+    int kind, ix, matchix, fresh;
+
+    if (argc<2)
+        goto noneedles;
+    if (sqlite3_value_type(args[0])==SQLITE_NULL)
+        return;
+    enc = sqlite3_user_data(context);
+    kind = SEARCH_BLOB;
+    for (ix = 0; ix<argc; ix++) {
+        int type;
+
+        type = sqlite3_value_type(args[ix]);
+        if (type!=SQLITE_BLOB && (type!=SQLITE_NULL || ix==0)) {
+            kind = text_kind(args[0], enc);
+            break;
+        }
+    }
+    if (kind==SEARCH_BLOB) {
+        haystack = sqlite3_value_blob(args[0]);
+        stacksize = sqlite3_value_bytes(args[0]);
+        if (!haystack && stacksize>0)
+            goto nomem;
+    } else if (kind==SEARCH_UTF8) {
+        haystack = sqlite3_value_text(args[0]);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes(args[0]);
+    } else {
+        haystack = text_of(args[0], kind);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes16(args[0])/2;
+    }
+    ac = sqlite3_get_auxdata(context, 1);
+    if (ac && automaton_matches(ac, kind, argc-1, args+1)) {
+        fresh = 0;
+    } else {
+        ac = build_automaton(kind, argc-1, args+1);
+        if (!ac)
+            goto nomem;
+        fresh = 1;
+    }
+    automaton_find(ac, kind, enc->trusted, haystack, stacksize, &result,
+                   &matchix);
+    if (result<0) {
+        sqlite3_result_error(context,
+            kind==SEARCH_UTF8 ? malformed_8 : malformed_16, -1);
+    } else {
+        sqlite3_result_int64(context, which && result ? matchix+1 : result);
+    }
+    if (fresh)
+        sqlite3_set_auxdata(context, 1, ac, free_automaton);
+    return;
+
+noneedles:
+    sqlite3_result_error(context, noneedles, sizeof noneedles-1);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void instr_any_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    multi_func(context, argc, args, 0);
+}
+
+static void instr_which_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    multi_func(context, argc, args, 1);
+}
+
+/*
+ * A matcher is a set of needles compiled once into an automaton for
+ * UTF-8 text, for instr_match, which runs the same tables over the
+ * bytes of blobs.  Nothing changes it after it's built, so threads and
+ * connections can share it without locking anything but its reference
+ * count.  The matcher_compile function makes one to pass straight to
+ * instr_match, and applications can make their own with
+ * instr_matcher_compile and bind them with sqlite3_bind_pointer, under
+ * the type "instr_matcher"; instr.h declares the functions for them.
+ */
+
+struct instr_matcher {
+    sqlite3_mutex *mutex;
+    int refs;
+    automaton *ac;
+};
+
+static char const matchertype[] = "instr_matcher";
+static char const nomatcher[]   = "not a matcher";
+
+static automaton *needles_automaton(
+    int nneedles,
+    void const *const *needles,
+    vsize const *sizes)
+{
+    automaton *ac;
+    unsigned char *copy;
+    sqlite3_uint64 total;
+    int ix;
+
+    ac = sqlite3_malloc(sizeof *ac);
+    if (!ac)
+        return 0;
+    memset(ac, 0, sizeof *ac);
+    ac->kind = SEARCH_UTF8;
+    ac->nneedles = nneedles;
+    ac->sizes = sqlite3_malloc64((sqlite3_uint64)nneedles*sizeof *ac->sizes);
+    if (!ac->sizes)
+        goto nomem;
+    total = 0;
+    for (ix = 0; ix<nneedles; ix++) {
+        ac->sizes[ix] = sizes[ix];
+        if (sizes[ix]!=(vsize)-1)
+            total += sizes[ix];
+    }
+    ac->copies = sqlite3_malloc64(total+1);
+    if (!ac->copies)
+        goto nomem;
+    copy = ac->copies;
+    for (ix = 0; ix<nneedles; ix++) {
+        if (sizes[ix]!=(vsize)-1 && sizes[ix]>0) {
+            memcpy(copy, needles[ix], sizes[ix]);
+            copy += sizes[ix];
+        }
+    }
+    return finish_automaton(ac, total);
+
+nomem:
+    free_automaton(ac);
+    return 0;
+}
+
+/*
+ * Take another reference to a matcher, for handing on with
+ * sqlite3_bind_pointer(stmt, ix, instr_matcher_ref(m),
+ * "instr_matcher", instr_matcher_unref).
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+instr_matcher *instr_matcher_ref(
+    instr_matcher *m)
+{
+    sqlite3_mutex_enter(m->mutex);
+    m->refs++;
+    sqlite3_mutex_leave(m->mutex);
+    return m;
+}
+
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+void instr_matcher_unref(
+    void *ptr)
+{
+    instr_matcher *m = ptr;
+    int refs;
+
+    if (!m)
+        return;
+    sqlite3_mutex_enter(m->mutex);
+    refs = --m->refs;
+    sqlite3_mutex_leave(m->mutex);
+    if (refs>0)
+        return;
+    if (m->ac)
+        free_automaton(m->ac);
+    sqlite3_mutex_free(m->mutex);
+    sqlite3_free(m);
+}
+
+static int new_matcher(
+    int nneedles,
+    void const *const *needles,
+    vsize const *sizes,
+    instr_matcher **matcherOut)
+{
+    instr_matcher *m;
+
+    m = sqlite3_malloc(sizeof *m);
+    if (!m)
+        return SQLITE_NOMEM;
+    memset(m, 0, sizeof *m);
+    m->refs = 1;
+    m->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    if (!m->mutex) {
+        sqlite3_free(m);
+        return SQLITE_NOMEM;
+    }
+    m->ac = needles_automaton(nneedles, needles, sizes);
+    if (!m->ac) {
+        instr_matcher_unref(m);
+        return SQLITE_NOMEM;
+    }
+    *matcherOut = m;
+    return SQLITE_OK;
+}
+
+/*
+ * Compile a matcher from an array of needles, with their sizes in
+ * bytes, or a negative size for one that ends at a NUL; sizes itself
+ * may be null if they all do.  Null needles are left out.  A shared
+ * library can't allocate anything until it has been loaded.
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int instr_matcher_compile(
+    int nneedles,
+    void const *const *needles,
+    int const *sizes,
+    instr_matcher **matcherOut)
+{
+    vsize *lengths;
+    int ix, status;
+
+    *matcherOut = 0;
+#ifndef SQLITE_CORE
+    if (!sqlite3_api)
+        return SQLITE_MISUSE;
+#endif
+    if (nneedles<1)
+        return SQLITE_MISUSE;
+    lengths = sqlite3_malloc64((sqlite3_uint64)nneedles*sizeof *lengths);
+    if (!lengths)
+        return SQLITE_NOMEM;
+    for (ix = 0; ix<nneedles; ix++) {
+        if (!needles[ix]) {
+            lengths[ix] = (vsize)-1;
+        } else if (!sizes || sizes[ix]<0) {
+            lengths[ix] = strlen(needles[ix]);
+        } else {
+            lengths[ix] = sizes[ix];
+        }
+    }
+    status = new_matcher(nneedles, needles, lengths, matcherOut);
+    sqlite3_free(lengths);
+    return status;
+}
+
+static void matcher_compile_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    instr_matcher *m;
+    void const **needles;
+    vsize *sizes;
+    int ix, status;
+
+    if (argc<1) {
+        sqlite3_result_error(context, noneedles, sizeof noneedles-1);
+        return;
+    }
+    needles = sqlite3_malloc64((sqlite3_uint64)argc*sizeof *needles);
+    sizes = sqlite3_malloc64((sqlite3_uint64)argc*sizeof *sizes);
+    status = needles && sizes ? SQLITE_OK : SQLITE_NOMEM;
+    for (ix = 0; ix<argc && status==SQLITE_OK; ix++) {
+        status = needle_arg(args[ix],
+                            sqlite3_value_type(args[ix])==SQLITE_BLOB
+                            ? SEARCH_BLOB : SEARCH_UTF8,
+                            &needles[ix], &sizes[ix]);
+    }
+    if (status==SQLITE_OK)
+        status = new_matcher(argc, needles, sizes, &m);
+    sqlite3_free(needles);
+    sqlite3_free(sizes);
+    if (status!=SQLITE_OK) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    sqlite3_result_pointer(context, m, matchertype, instr_matcher_unref);
+}
+
+static void instr_match_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    encspec const *enc;
+    instr_matcher *m;
+    void const *haystack;
+    vsize stacksize;
+    sqlite3_int64 result;
+    int kind, matchix;
+
+    m = sqlite3_value_pointer(args[1], matchertype);
+    if (!m) {
+        sqlite3_result_error(context, nomatcher, sizeof nomatcher-1);
+        return;
+    }
+    enc = sqlite3_user_data(context);
+    switch (sqlite3_value_type(args[0])) {
+    case SQLITE_NULL:
+        return;
+    case SQLITE_BLOB:
+        kind = SEARCH_BLOB;
+        haystack = sqlite3_value_blob(args[0]);
+        stacksize = sqlite3_value_bytes(args[0]);
+        if (!haystack && stacksize>0)
+            goto nomem;
+        break;
+    default:
+        kind = SEARCH_UTF8;
+        haystack = sqlite3_value_text(args[0]);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes(args[0]);
+        break;
+    }
+    automaton_find(m->ac, kind, enc->trusted, haystack, stacksize, &result,
+                   &matchix);
+    if (result<0) {
+        sqlite3_result_error(context, malformed_8, -1);
+    } else {
+        sqlite3_result_int64(context, result);
+    }
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+/*
+ * Fetch a haystack and needle to be compared byte by byte, as blobs if
+ * they both are, and otherwise as text in the representation the
+ * haystack is stored in.  Sizes are in bytes.
+ */
+static int fetch_pair(
+    sqlite3_context *context,
+    sqlite3_value **args,
+    int *kindOut,
+    void const **haystackOut,
+    vsize *stacksizeOut,
+    void const **needleOut,
+    vsize *needlesizeOut)
+{
+    void const *haystack, *needle;
+    vsize stacksize, needlesize;
+    int kind;
+
+    if (sqlite3_value_type(args[0])==SQLITE_BLOB
+            && sqlite3_value_type(args[1])==SQLITE_BLOB) {
+        kind = SEARCH_BLOB;
+        haystack = sqlite3_value_blob(args[0]);
+        stacksize = sqlite3_value_bytes(args[0]);
+        if (!haystack && stacksize>0)
+            return SQLITE_NOMEM;
+        needle = sqlite3_value_blob(args[1]);
+        needlesize = sqlite3_value_bytes(args[1]);
+        if (!needle && needlesize>0)
+            return SQLITE_NOMEM;
+    } else {
+        kind = text_kind(args[0], sqlite3_user_data(context));
+        haystack = text_of(args[0], kind);
+        if (!haystack)
+            return SQLITE_NOMEM;
+        needle = text_of(args[1], kind);
+        if (!needle)
+            return SQLITE_NOMEM;
+        if (kind==SEARCH_UTF8) {
+            stacksize = sqlite3_value_bytes(args[0]);
+            needlesize = sqlite3_value_bytes(args[1]);
+        } else {
+            stacksize = sqlite3_value_bytes16(args[0])&~(vsize)1;
+            needlesize = sqlite3_value_bytes16(args[1])&~(vsize)1;
+        }
+    }
+    *kindOut = kind;
+    *haystackOut = haystack;
+    *stacksizeOut = stacksize;
+    *needleOut = needle;
+    *needlesizeOut = needlesize;
+    return SQLITE_OK;
+}
+
+/*
+ * The first or last match of a needle fetched by fetch_pair, as a byte
+ * pointer into the haystack, or 0 if there isn't one.
+ */
+static unsigned char const *find_in(
+    compiled const *cn,
+    int kind,
+    void const *haystack,
+    vsize stacksize,
+    void const *needle,
+    vsize needlesize)
+{
+    if ((kind&~(SEARCH_REVERSE|SEARCH_SWAPPED))==SEARCH_UTF16) {
+        if (kind&SEARCH_REVERSE)
+            return (unsigned char const *)utf16_rfind(
+                cn, haystack, stacksize, needle, needlesize);
+        return (unsigned char const *)utf16_find(
+            cn, haystack, stacksize, needle, needlesize);
+    }
+    if (kind&SEARCH_REVERSE)
+        return needle_rfind(cn, haystack, stacksize, needle, needlesize);
+    return needle_find(cn, haystack, stacksize, needle, needlesize);
+}
+
+/*
+ * The first match at least step bytes past one that find_in found
+ * at match, searching forward through the size bytes from there.
+ */
+static unsigned char const *find_next_in(
+    compiled const *cn,
+    int kind,
+    unsigned char const *match,
+    vsize size,
+    vsize step,
+    void const *needle,
+    vsize needlesize)
+{
+    if ((kind&~SEARCH_SWAPPED)==SEARCH_UTF16)
+        return (unsigned char const *)utf16_find_after(
+            cn, (unsigned short const *)match, size, step/2,
+            needle, needlesize);
+    return needle_find_after(cn, match, size, step, needle, needlesize);
+}
+
+/*
+ * contains, starts_with and ends_with only say whether there's a match
+ * at all, so they compare bytes and never walk or check the characters.
+ */
+
+#define MATCH_ANYWHERE  0
+#define MATCH_START     1
+#define MATCH_END       2
+
+static void match_func(
+    sqlite3_context *context,
+    sqlite3_value **args,
+    int where)
+{
+    void const *haystack, *needle;
+    vsize stacksize, needlesize;
+    compiled *cn;
+    int kind, fresh, result;
+
+    if (sqlite3_value_type(args[0])==SQLITE_NULL
+            || sqlite3_value_type(args[1])==SQLITE_NULL)
+        return;
+    if (fetch_pair(context, args, &kind, &haystack, &stacksize,
+                   &needle, &needlesize)!=SQLITE_OK)
+        goto nomem;
+    if (needlesize>stacksize) {
+        result = 0;
+    } else if (needlesize<=0) {
+        result = 1;
+    } else if (where==MATCH_START) {
+        result = !memcmp(haystack, needle, needlesize);
+    } else if (where==MATCH_END) {
+        result = !memcmp((unsigned char const *)haystack+stacksize-needlesize,
+                         needle, needlesize);
+    } else {
+        cn = get_needle(context, kind, needle, needlesize, stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        result = find_in(cn, kind, haystack, stacksize,
+                         needle, needlesize)!=0;
+        cache_needle(context, cn, fresh);
+    }
+    sqlite3_result_int(context, result);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void contains_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    match_func(context, args, MATCH_ANYWHERE);
+}
+
+static void starts_with_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    match_func(context, args, MATCH_START);
+}
+
+static void ends_with_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    match_func(context, args, MATCH_END);
+}
+
+/*
+ * instr_bytes and rinstr_bytes count bytes rather than characters,
+ * in the UTF-8 form for text, so their results can be handed straight
+ * to substr_bytes without walking the text a second time.
+ */
+static void bytes_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args,
+    int reverse)
+{
+    int stacktype, needletype;
+    unsigned char const *haystack, *needle;
+    vsize stacksize, needlesize;
+    sqlite3_int64 start, result;
+    compiled *cn;
+    int fresh;
+
+    if (argc<2)
+        goto confused;
+    stacktype = sqlite3_value_type(args[0]);
+    if (stacktype==SQLITE_NULL)
+        return;
+    needletype = sqlite3_value_type(args[1]);
+    if (needletype==SQLITE_NULL)
+        return;
+    if (argc>=3) {
+        if (sqlite3_value_type(args[2])==SQLITE_NULL)
+            return;
+        start = sqlite3_value_int64(args[2]);
+    } else {
+        start = reverse ? 0x7FFFFFFFFFFFFFFFLL : 1;
+    }
+    if (stacktype==SQLITE_BLOB && needletype==SQLITE_BLOB) {
+        haystack = sqlite3_value_blob(args[0]);
+        stacksize = sqlite3_value_bytes(args[0]);
+        if (!haystack && stacksize>0)
+            goto nomem;
+        needle = sqlite3_value_blob(args[1]);
+        needlesize = sqlite3_value_bytes(args[1]);
+        if (!needle && needlesize>0)
+            goto nomem;
+    } else {
+        haystack = sqlite3_value_text(args[0]);
+        if (!haystack)
+            goto nomem;
+        stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_text(args[1]);
+        if (!needle)
+            goto nomem;
+        needlesize = sqlite3_value_bytes(args[1]);
+    }
+    cn = get_needle(context,
+                    reverse ? SEARCH_BLOB|SEARCH_REVERSE : SEARCH_BLOB,
+                    needle, needlesize, stacksize, &fresh);
+    if (!cn)
+        goto nomem;
+    if (reverse) {
+        result = rinstr_blob(
+            haystack, stacksize, needle, needlesize, cn, start, 1);
+    } else {
+        result = instr_blob(
+            haystack, stacksize, needle, needlesize, cn, start, 1);
+    }
+    sqlite3_result_int64(context, result);
+    cache_needle(context, cn, fresh);
+    return;
+
+confused:
+    sqlite3_result_error(context, confused, sizeof confused-1);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void instr_bytes_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    bytes_func(context, argc, args, 0);
+}
+
+static void rinstr_bytes_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    bytes_func(context, argc, args, 1);
+}
+
+/*
+ * Like substr, but start and length count bytes.  Text is sliced in
+ * its UTF-8 form, and it's an error for either end of the slice
+ * to fall inside a character.
+ */
+static void substr_bytes_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    int type;
+    unsigned char const *data;
+    sqlite3_int64 size, start, length;
+    int neglength;
+
+    type = sqlite3_value_type(args[0]);
+    if (type==SQLITE_NULL || sqlite3_value_type(args[1])==SQLITE_NULL)
+        return;
+    neglength = 0;
+    if (argc>=3) {
+        if (sqlite3_value_type(args[2])==SQLITE_NULL)
+            return;
+        length = sqlite3_value_int64(args[2]);
+        if (length<0) {
+            length = -length;
+            neglength = 1;
+        }
+    } else {
+        length = 0x7FFFFFFFFFFFFFFFLL;
+    }
+    if (type==SQLITE_BLOB) {
+        data = sqlite3_value_blob(args[0]);
+        size = sqlite3_value_bytes(args[0]);
+        if (!data && size>0)
+            goto nomem;
+    } else {
+        data = sqlite3_value_text(args[0]);
+        if (!data)
+            goto nomem;
+        size = sqlite3_value_bytes(args[0]);
+    }
+    start = sqlite3_value_int64(args[1]);
+    if (start<0) {
+        start += size;
+        if (start<0) {
+            length += start;
+            if (length<0)
+                length = 0;
+            start = 0;
+        }
+    } else if (start>0) {
+        start--;
+    } else if (length>0) {
+        length--;
+    }
+    if (neglength) {
+        start -= length;
+        if (start<0) {
+            length += start;
+            start = 0;
+        }
+    }
+    if (start>=size) {
+        start = length = 0;
+    } else if (length>size-start) {
+        length = size-start;
+    }
+    if (type==SQLITE_BLOB) {
+        sqlite3_result_blob(context, size>0 ? data+start : (void const *)"",
+                            (int)length, SQLITE_TRANSIENT);
+    } else if (length>0
+               && (data[start]>=0x80 && data[start]<0xC0
+                   || start+length<size && data[start+length]>=0x80
+                   && data[start+length]<0xC0)) {
+        sqlite3_result_error(context, splitchar, sizeof splitchar-1);
+    } else {
+        sqlite3_result_text(context, (char const *)data+start, (int)length,
+                            SQLITE_TRANSIENT);
+    }
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+/*
+ * The SQLite encoding of text in the representation kind.
+ */
+static int kind_rep(
+    int kind)
+{
+    if (kind==SEARCH_UTF8)
+        return SQLITE_UTF8;
+    if (!(kind&SEARCH_SWAPPED))
+        return native_utf16();
+    return native_utf16()==SQLITE_UTF16LE ? SQLITE_UTF16BE : SQLITE_UTF16LE;
+}
+
+/*
+ * Return part of a haystack fetched by fetch_pair, in the same form.
+ * SQLite has to make its own copy, since the haystack belongs to
+ * an argument that may not outlive the call.
+ */
+static void result_slice(
+    sqlite3_context *context,
+    int kind,
+    void const *data,
+    vsize size)
+{
+    if (kind==SEARCH_BLOB) {
+        sqlite3_result_blob(context, size>0 ? data : (void const *)"",
+                            (int)size, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_text64(context, data, size, SQLITE_TRANSIENT,
+                              kind_rep(kind));
+    }
+}
+
+/*
+ * substr_before and friends find the separator with one byte-level
+ * search and return what's on one side of it, or NULL if it isn't there.
+ */
+
+#define SLICE_AFTER     1
+#define SLICE_LAST      2
+
+static void slice_func(
+    sqlite3_context *context,
+    sqlite3_value **args,
+    int how)
+{
+    void const *haystack, *needle;
+    vsize stacksize, needlesize, offset;
+    unsigned char const *match;
+    compiled *cn;
+    int kind, fresh;
+
+    if (sqlite3_value_type(args[0])==SQLITE_NULL
+            || sqlite3_value_type(args[1])==SQLITE_NULL)
+        return;
+    if (fetch_pair(context, args, &kind, &haystack, &stacksize,
+                   &needle, &needlesize)!=SQLITE_OK)
+        goto nomem;
+    if (needlesize>stacksize)
+        return;
+    if (needlesize<=0) {
+        if (!(how&SLICE_AFTER)==!(how&SLICE_LAST)) {
+            result_slice(context, kind, haystack, 0);
+        } else {
+            result_slice(context, kind, haystack, stacksize);
+        }
+        return;
+    }
+    if (how&SLICE_LAST)
+        kind |= SEARCH_REVERSE;
+    cn = get_needle(context, kind, needle, needlesize, stacksize, &fresh);
+    if (!cn)
+        goto nomem;
+    match = find_in(cn, kind, haystack, stacksize, needle, needlesize);
+    kind &= ~SEARCH_REVERSE;
+    if (match) {
+        offset = match-(unsigned char const *)haystack;
+        if (how&SLICE_AFTER) {
+            result_slice(context, kind, match+needlesize,
+                         stacksize-offset-needlesize);
+        } else {
+            result_slice(context, kind, haystack, offset);
+        }
+    }
+    cache_needle(context, cn, fresh);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void substr_before_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    slice_func(context, args, 0);
+}
+
+static void substr_after_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    slice_func(context, args, SLICE_AFTER);
+}
+
+static void substr_before_last_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    slice_func(context, args, SLICE_LAST);
+}
+
+static void substr_after_last_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    slice_func(context, args, SLICE_AFTER|SLICE_LAST);
+}
+
+/*
+ * split_part follows PostgreSQL: fields count from 1, or from -1 at
+ * the end, and one that isn't there is an empty string.
+ */
+static void split_part_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    void const *haystack, *needle;
+    unsigned char const *start, *end, *match;
+    vsize stacksize, needlesize;
+    sqlite3_int64 field, nseps;
+    compiled *cn;
+    int kind, fresh;
+
+    if (sqlite3_value_type(args[0])==SQLITE_NULL
+            || sqlite3_value_type(args[1])==SQLITE_NULL
+            || sqlite3_value_type(args[2])==SQLITE_NULL)
+        return;
+    field = sqlite3_value_int64(args[2]);
+    if (field==0) {
+        sqlite3_result_error(context, zerofield, sizeof zerofield-1);
+        return;
+    }
+    if (fetch_pair(context, args, &kind, &haystack, &stacksize,
+                   &needle, &needlesize)!=SQLITE_OK)
+        goto nomem;
+    if (stacksize<=0 || needlesize<=0) {
+        if (stacksize>0 && (field==1 || field==-1)) {
+            result_slice(context, kind, haystack, stacksize);
+        } else {
+            result_slice(context, kind, haystack, 0);
+        }
+        return;
+    }
+    cn = get_needle(context, kind, needle, needlesize, stacksize, &fresh);
+    if (!cn)
+        goto nomem;
+    start = haystack;
+    end = start+stacksize;
+    if (field<0) {
+        nseps = 0;
+        while ((match = find_in(cn, kind, start, end-start,
+                                needle, needlesize))!=0) {
+            nseps++;
+            start = match+needlesize;
+        }
+        field += nseps+2;
+        start = haystack;
+    }
+    while (field>1) {
+        match = find_in(cn, kind, start, end-start, needle, needlesize);
+        if (!match)
+            break;
+        start = match+needlesize;
+        field--;
+    }
+    if (field==1) {
+        match = find_in(cn, kind, start, end-start, needle, needlesize);
+        result_slice(context, kind, start, (match ? match : end)-start);
+    } else {
+        result_slice(context, kind, haystack, 0);
+    }
+    cache_needle(context, cn, fresh);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+/*
+ * Like replace, but with the compiled-needle search.  A first pass
+ * counts the matches, so that the result can be allocated at its exact
+ * size and filled by copying the runs between them.
+ */
+static void replace_all_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    void const *haystack, *needle, *repl;
+    unsigned char const *rest, *end, *match;
+    unsigned char *result, *out;
+    vsize stacksize, needlesize, replsize;
+    sqlite3_int64 limit, nmatches;
+    sqlite3_uint64 resultsize;
+    compiled *cn;
+    int kind, fresh, ix;
+
+    for (ix = 0; ix<argc; ix++) {
+        if (sqlite3_value_type(args[ix])==SQLITE_NULL)
+            return;
+    }
+    limit = argc>=4 ? sqlite3_value_int64(args[3]) : -1;
+    if (fetch_pair(context, args, &kind, &haystack, &stacksize,
+                   &needle, &needlesize)!=SQLITE_OK)
+        goto nomem;
+    if (kind==SEARCH_BLOB) {
+        repl = sqlite3_value_blob(args[2]);
+        replsize = sqlite3_value_bytes(args[2]);
+        if (!repl && replsize>0)
+            goto nomem;
+    } else {
+        repl = text_of(args[2], kind);
+        if (!repl)
+            goto nomem;
+        replsize = kind==SEARCH_UTF8 ? sqlite3_value_bytes(args[2])
+            : sqlite3_value_bytes16(args[2])&~(vsize)1;
+    }
+    if (needlesize<=0 || needlesize>stacksize || limit==0) {
+        result_slice(context, kind, haystack, stacksize);
+        return;
+    }
+    cn = get_needle(context, kind, needle, needlesize, stacksize, &fresh);
+    if (!cn)
+        goto nomem;
+    rest = haystack;
+    end = rest+stacksize;
+    nmatches = 0;
+    while (nmatches!=limit
+           && (match = find_in(cn, kind, rest, end-rest,
+                               needle, needlesize))!=0) {
+        nmatches++;
+        rest = match+needlesize;
+    }
+    if (nmatches==0) {
+        result_slice(context, kind, haystack, stacksize);
+        goto done;
+    }
+    resultsize = stacksize-(sqlite3_uint64)nmatches*needlesize
+        +(sqlite3_uint64)nmatches*replsize;
+    if (resultsize>(sqlite3_uint64)sqlite3_limit(
+            sqlite3_context_db_handle(context), SQLITE_LIMIT_LENGTH, -1)) {
+        sqlite3_result_error_toobig(context);
+        goto done;
+    }
+    result = sqlite3_malloc64(resultsize+1);
+    if (!result) {
+        sqlite3_result_error_nomem(context);
+        goto done;
+    }
+    out = result;
+    rest = haystack;
+    while (nmatches-->0) {
+        match = find_in(cn, kind, rest, end-rest, needle, needlesize);
+        memcpy(out, rest, match-rest);
+        out += match-rest;
+        if (replsize>0)
+            memcpy(out, repl, replsize);
+        out += replsize;
+        rest = match+needlesize;
+    }
+    memcpy(out, rest, end-rest);
+    if (kind==SEARCH_BLOB) {
+        sqlite3_result_blob64(context, result, resultsize, sqlite3_free);
+    } else {
+        sqlite3_result_text64(context, (char *)result, resultsize,
+                              sqlite3_free, kind_rep(kind));
+    }
+done:
+    cache_needle(context, cn, fresh);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+/*
+ * Count the matches with the byte-level search, which for a single-byte
+ * needle is a straight count_byte over the haystack.
+ */
+static void instr_count_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    void const *haystack, *needle;
+    unsigned char const *end, *match;
+    vsize stacksize, needlesize, step;
+    sqlite3_int64 count;
+    compiled *cn;
+    int kind, fresh, ix;
+
+    for (ix = 0; ix<argc; ix++) {
+        if (sqlite3_value_type(args[ix])==SQLITE_NULL)
+            return;
+    }
+    if (fetch_pair(context, args, &kind, &haystack, &stacksize,
+                   &needle, &needlesize)!=SQLITE_OK)
+        goto nomem;
+    if (needlesize<=0 || needlesize>stacksize) {
+        count = 0;
+    } else if (needlesize==1) {
+        STAT(STAT_SEARCHES, 1);
+        STAT(STAT_SCANNED, stacksize);
+        count = kernels->count_byte(
+            haystack, stacksize, ((unsigned char const *)needle)[0]);
+    } else {
+        cn = get_needle(context, kind, needle, needlesize, stacksize, &fresh);
+        if (!cn)
+            goto nomem;
+        step = needlesize;
+        if (argc>=3 && sqlite3_value_int(args[2]))
+            step = kind==SEARCH_UTF8 || kind==SEARCH_BLOB ? 1 : 2;
+        end = (unsigned char const *)haystack+stacksize;
+        count = 0;
+        match = find_in(cn, kind, haystack, stacksize, needle, needlesize);
+        while (match) {
+            count++;
+            match = find_next_in(cn, kind, match, end-match, step,
+                                 needle, needlesize);
+        }
+        cache_needle(context, cn, fresh);
+    }
+    sqlite3_result_int64(context, count);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+/*
+ * Search a stored blob through incremental I/O, a chunk at a time,
+ * so that a huge value is never held in memory all at once and is only
+ * read up to the first match.  The last needlesize-1 bytes of each chunk
+ * are carried over to the next, for matches that straddle them.
+ */
+
+#define STREAM_CHUNK    65536
+
+static void instr_blob_stream_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    sqlite3 *db;
+    sqlite3_blob *blob;
+    unsigned char const *needle, *match;
+    unsigned char *buf;
+    vsize needlesize, total, offset, base, have, carry, chunk;
+    sqlite3_int64 start, result;
+    compiled *cn;
+    int ix, status;
+
+    for (ix = 0; ix<argc; ix++) {
+        if (sqlite3_value_type(args[ix])==SQLITE_NULL)
+            return;
+    }
+    start = argc>=6 ? sqlite3_value_int64(args[5]) : 1;
+    if (start<1)
+        start = 1;
+    needle = sqlite3_value_blob(args[4]);
+    needlesize = sqlite3_value_bytes(args[4]);
+    if (!needle && needlesize>0)
+        goto nomem;
+    db = sqlite3_context_db_handle(context);
+    status = sqlite3_blob_open(
+        db,
+        (char const *)sqlite3_value_text(args[0]),
+        (char const *)sqlite3_value_text(args[1]),
+        (char const *)sqlite3_value_text(args[2]),
+        sqlite3_value_int64(args[3]),
+        0,
+        &blob);
+    if (status!=SQLITE_OK) {
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+        sqlite3_blob_close(blob);
+        return;
+    }
+    total = sqlite3_blob_bytes(blob);
+    buf = 0;
+    cn = 0;
+    result = 0;
+    if (start-1>(sqlite3_int64)total) {
+        goto done;
+    } else if (needlesize<=0) {
+        result = start;
+        goto done;
+    }
+    STAT(STAT_SEARCHES, 1);
+    cn = compile_needle(SEARCH_BLOB, needle, needlesize, total);
+    buf = sqlite3_malloc64((sqlite3_uint64)STREAM_CHUNK+needlesize);
+    if (!cn || !buf) {
+        sqlite3_result_error_nomem(context);
+        goto close;
+    }
+    offset = base = start-1;
+    carry = 0;
+    while (offset<total) {
+        chunk = total-offset<STREAM_CHUNK ? total-offset : STREAM_CHUNK;
+        status = sqlite3_blob_read(blob, buf+carry, chunk, offset);
+        if (status!=SQLITE_OK) {
+            sqlite3_result_error_code(context, status);
+            goto close;
+        }
+        offset += chunk;
+        have = carry+chunk;
+        match = needle_find(cn, buf, have, needle, needlesize);
+        if (match) {
+            result = base+(match-buf)+1;
+            break;
+        }
+        carry = have<needlesize ? have : needlesize-1;
+        memmove(buf, buf+have-carry, carry);
+        base = offset-carry;
+    }
+done:
+    sqlite3_result_int64(context, result);
+close:
+    sqlite3_free(buf);
+    sqlite3_free(cn);
+    sqlite3_blob_close(blob);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+#if HAVE_FILES
+
+/*
+ * instr_file and rinstr_file search a file outside the database for
+ * a byte string, without loading it into a value.  The file is mapped
+ * and searched in place, a window of at most FILE_WINDOW bytes at
+ * a time since the search engines count in vsize; windows overlap by
+ * needlesize-1 bytes for matches that straddle them.  A file that
+ * can't be mapped is read with pread into a buffer of STREAM_CHUNK
+ * bytes plus that overlap instead.  Like any mapping, a file that's
+ * truncated while it's being searched can take the process down.
+ */
+
+#define FILE_WINDOW     (1U<<30)
+
+typedef struct srcfile {
+    int fd;
+    unsigned char const *map;
+    sqlite3_uint64 size;
+    unsigned char *buf;
+} srcfile;
+
+static int read_at(
+    srcfile *src,
+    unsigned char *buf,
+    vsize size,
+    sqlite3_uint64 offset)
+{
+    ssize_t got;
+
+    while (size>0) {
+        got = pread(src->fd, buf, size, (off_t)offset);
+        if (got<0 && errno==EINTR)
+            continue;
+        if (got<=0)
+            return SQLITE_IOERR_READ;
+        buf += got;
+        size -= (vsize)got;
+        offset += got;
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * Point *dataOut at size bytes of the file from offset.
+ */
+static int file_window(
+    srcfile *src,
+    sqlite3_uint64 offset,
+    vsize size,
+    unsigned char const **dataOut)
+{
+    if (src->map) {
+        *dataOut = src->map+offset;
+        return SQLITE_OK;
+    }
+    *dataOut = src->buf;
+    return read_at(src, src->buf, size, offset);
+}
+
+static int open_file(
+    char const *path,
+    vsize needlesize,
+    int reverse,
+    srcfile *src)
+{
+    struct stat st;
+    void *map;
+
+    src->map = 0;
+    src->buf = 0;
+    src->fd = open(path, O_RDONLY);
+    if (src->fd<0)
+        return SQLITE_CANTOPEN;
+    if (fstat(src->fd, &st) || !S_ISREG(st.st_mode)) {
+        close(src->fd);
+        return SQLITE_CANTOPEN;
+    }
+    src->size = st.st_size;
+    if (src->size==0)
+        return SQLITE_OK;
+    if (src->size==(size_t)src->size) {
+        map = mmap(0, (size_t)src->size, PROT_READ, MAP_SHARED, src->fd, 0);
+        if (map!=MAP_FAILED) {
+            src->map = map;
+            if (!reverse)
+                posix_madvise(map, (size_t)src->size, POSIX_MADV_SEQUENTIAL);
+            return SQLITE_OK;
+        }
+    }
+    src->buf = sqlite3_malloc64((sqlite3_uint64)STREAM_CHUNK+needlesize);
+    if (!src->buf) {
+        close(src->fd);
+        return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+}
+
+static void close_file(
+    srcfile *src)
+{
+    if (src->map)
+        munmap((void *)src->map, (size_t)src->size);
+    sqlite3_free(src->buf);
+    close(src->fd);
+}
+
+/*
+ * The first match from offset on, as a position counting from 1,
+ * or 0 if there's none.
+ */
+static int file_find(
+    srcfile *src,
+    compiled const *cn,
+    unsigned char const *needle,
+    vsize needlesize,
+    sqlite3_uint64 offset,
+    sqlite3_int64 *resultOut)
+{
+    unsigned char const *data, *match;
+    sqlite3_uint64 rest;
+    vsize window, size;
+    int status;
+
+    window = (src->map ? FILE_WINDOW : STREAM_CHUNK)+needlesize-1;
+    *resultOut = 0;
+    while (offset<src->size) {
+        rest = src->size-offset;
+        size = rest<window ? (vsize)rest : window;
+        if (size<needlesize)
+            break;
+        status = file_window(src, offset, size, &data);
+        if (status!=SQLITE_OK)
+            return status;
+        match = needle_find(cn, data, size, needle, needlesize);
+        if (match) {
+            *resultOut = offset+(match-data)+1;
+            break;
+        }
+        offset += size-(needlesize-1);
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * The last match that ends by end, the same way.
+ */
+static int file_rfind(
+    srcfile *src,
+    compiled const *cn,
+    unsigned char const *needle,
+    vsize needlesize,
+    sqlite3_uint64 end,
+    sqlite3_int64 *resultOut)
+{
+    unsigned char const *data, *match;
+    sqlite3_uint64 offset;
+    vsize window, size;
+    int status;
+
+    window = (src->map ? FILE_WINDOW : STREAM_CHUNK)+needlesize-1;
+    *resultOut = 0;
+    while (end>=needlesize) {
+        size = end<window ? (vsize)end : window;
+        offset = end-size;
+        status = file_window(src, offset, size, &data);
+        if (status!=SQLITE_OK)
+            return status;
+        match = needle_rfind(cn, data, size, needle, needlesize);
+        if (match) {
+            *resultOut = offset+(match-data)+1;
+            break;
+        }
+        if (offset==0)
+            break;
+        end = offset+needlesize-1;
+    }
+    return SQLITE_OK;
+}
+
+static void file_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args,
+    int reverse)
+{
+    char const *path;
+    unsigned char const *needle;
+    vsize needlesize;
+    sqlite3_int64 start, result;
+    sqlite3_uint64 limit;
+    compiled *cn;
+    srcfile src;
+    char *msg;
+    int ix, status;
+
+    for (ix = 0; ix<argc; ix++) {
+        if (sqlite3_value_type(args[ix])==SQLITE_NULL)
+            return;
+    }
+    path = (char const *)sqlite3_value_text(args[0]);
+    if (sqlite3_value_type(args[1])==SQLITE_BLOB) {
+        needle = sqlite3_value_blob(args[1]);
+    } else {
+        needle = sqlite3_value_text(args[1]);
+    }
+    needlesize = sqlite3_value_bytes(args[1]);
+    if (!path || !needle && needlesize>0)
+        goto nomem;
+    start = argc>=3 ? sqlite3_value_int64(args[2])
+        : reverse ? 0x7FFFFFFFFFFFFFFFLL : 1;
+    status = open_file(path, needlesize, reverse, &src);
+    if (status==SQLITE_CANTOPEN) {
+        msg = sqlite3_mprintf("cannot open file %s", path);
+        if (!msg)
+            goto nomem;
+        sqlite3_result_error(context, msg, -1);
+        sqlite3_free(msg);
+        return;
+    } else if (status!=SQLITE_OK) {
+        goto nomem;
+    }
+    cn = 0;
+    result = 0;
+    if (!reverse) {
+        if (start<1)
+            start = 1;
+        if ((sqlite3_uint64)start-1>src.size) {
+            result = 0;
+        } else if (needlesize<=0) {
+            result = start;
+        } else {
+            STAT(STAT_SEARCHES, 1);
+            cn = compile_needle(SEARCH_BLOB, needle, needlesize,
+                                src.size<FILE_WINDOW ? (vsize)src.size
+                                : FILE_WINDOW);
+            status = cn ? file_find(&src, cn, needle, needlesize,
+                                    start-1, &result) : SQLITE_NOMEM;
+        }
+    } else if (start>0 && needlesize<=src.size) {
+        limit = src.size-needlesize;
+        if ((sqlite3_uint64)start-1<limit)
+            limit = start-1;
+        if (needlesize<=0) {
+            result = limit+1;
+        } else {
+            STAT(STAT_SEARCHES, 1);
+            cn = compile_needle(SEARCH_BLOB|SEARCH_REVERSE, needle, needlesize,
+                                src.size<FILE_WINDOW ? (vsize)src.size
+                                : FILE_WINDOW);
+            status = cn ? file_rfind(&src, cn, needle, needlesize,
+                                     limit+needlesize, &result)
+                : SQLITE_NOMEM;
+        }
+    }
+    sqlite3_free(cn);
+    close_file(&src);
+    if (status!=SQLITE_OK) {
+        sqlite3_result_error_code(context, status);
+        return;
+    }
+    sqlite3_result_int64(context, result);
+    return;
+
+nomem:
+    sqlite3_result_error_nomem(context);
+}
+
+static void instr_file_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    file_func(context, argc, args, 0);
+}
+
+static void rinstr_file_func(
+    sqlite3_context *context,
+    int argc,
+    sqlite3_value **args)
+{
+    file_func(context, argc, args, 1);
+}
+
+#endif
+
+/*
+ * The instr_all table-valued function.  The cursor keeps its own copy
+ * of the haystack and needle, and the byte offset and character position
+ * of the current match, so each step only scans from there to the next.
+ */
+
+#define ALL_POSITION    0
+#define ALL_OFFSET      1
+#define ALL_HAYSTACK    2
+#define ALL_NEEDLE      3
+#define ALL_OVERLAPPING 4
+
+typedef struct allcursor {
+    sqlite3_vtab_cursor base;
+    encspec const *enc;
+    unsigned char *haystack;
+    vsize stacksize;
+    unsigned char *needle;
+    vsize needlesize;
+    compiled *cn;
+    int blob;
+    int overlapping;
+    vsize offset;
+    sqlite3_int64 position;
+    sqlite3_int64 rowid;
+    int eof;
+} allcursor;
+
+typedef struct alltab {
+    sqlite3_vtab base;
+    encspec const *enc;
+} alltab;
+
+static int all_connect(
+    sqlite3 *db,
+    void *aux,
+    int argc,
+    char const *const *argv,
+    sqlite3_vtab **vtabOut,
+    char **errmsgOut)
+{
+    alltab *tab;
+    int status;
+
+    status = sqlite3_declare_vtab(
+        db,
+        "CREATE TABLE x(position, byte_offset,"
+        " haystack HIDDEN, needle HIDDEN, overlapping HIDDEN)");
+    if (status!=SQLITE_OK)
+        return status;
+    tab = sqlite3_malloc(sizeof *tab);
+    if (!tab)
+        return SQLITE_NOMEM;
+    memset(tab, 0, sizeof *tab);
+    tab->enc = aux;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    *vtabOut = &tab->base;
+    return SQLITE_OK;
+}
+
+static int all_disconnect(
+    sqlite3_vtab *vtab)
+{
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+/*
+ * Pass the equality constraints on a table-valued function's nargs
+ * hidden argument columns, starting at column first, to xFilter in
+ * column order, flagging the ones present in idxNum.  The plan is only
+ * cheap if the first nrequired of them are all there.
+ */
+static int args_best_index(
+    sqlite3_index_info *info,
+    int first,
+    int nargs,
+    int nrequired)
+{
+    int argix[8];
+    int unusable, ix, col, argc, required;
+
+    for (col = 0; col<nargs; col++) {
+        argix[col] = -1;
+    }
+    unusable = 0;
+    for (ix = 0; ix<info->nConstraint; ix++) {
+        struct sqlite3_index_constraint const *cons;
+
+        cons = &info->aConstraint[ix];
+        col = cons->iColumn-first;
+        if (col<0 || col>=nargs)
+            continue;
+        if (!cons->usable) {
+            unusable |= 1<<col;
+        } else if (cons->op==SQLITE_INDEX_CONSTRAINT_EQ) {
+            argix[col] = ix;
+        }
+    }
+    info->idxNum = 0;
+    argc = 0;
+    for (col = 0; col<nargs; col++) {
+        if (argix[col]>=0) {
+            info->aConstraintUsage[argix[col]].argvIndex = ++argc;
+            info->aConstraintUsage[argix[col]].omit = 1;
+            info->idxNum |= 1<<col;
+        }
+    }
+    if (unusable & ~info->idxNum)
+        return SQLITE_CONSTRAINT;
+    required = (1<<nrequired)-1;
+    if ((info->idxNum&required)==required) {
+        info->estimatedCost = 1000;
+        info->estimatedRows = 100;
+    } else {
+        info->estimatedCost = 1e12;
+        info->estimatedRows = 0;
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * The haystack and needle must both be given; the arguments that are
+ * present are passed to all_filter in column order, flagged in idxNum.
+ */
+static int all_best_index(
+    sqlite3_vtab *vtab,
+    sqlite3_index_info *info)
+{
+    int status;
+
+    status = args_best_index(info, ALL_HAYSTACK, 3, 2);
+    if (status!=SQLITE_OK)
+        return status;
+    if (info->nOrderBy==1
+            && (info->aOrderBy[0].iColumn==ALL_POSITION
+                || info->aOrderBy[0].iColumn==ALL_OFFSET)
+            && !info->aOrderBy[0].desc)
+        info->orderByConsumed = 1;
+    return SQLITE_OK;
+}
+
+static int all_open(
+    sqlite3_vtab *vtab,
+    sqlite3_vtab_cursor **cursorOut)
+{
+    allcursor *cur;
+
+    cur = sqlite3_malloc(sizeof *cur);
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof *cur);
+    cur->enc = ((alltab *)vtab)->enc;
+    cur->eof = 1;
+    *cursorOut = &cur->base;
+    return SQLITE_OK;
+}
+
+static void all_reset(
+    allcursor *cur)
+{
+    sqlite3_free(cur->haystack);
+    sqlite3_free(cur->cn);
+    cur->haystack = cur->needle = 0;
+    cur->cn = 0;
+    cur->eof = 1;
+}
+
+static int all_close(
+    sqlite3_vtab_cursor *cursor)
+{
+    all_reset((allcursor *)cursor);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+/*
+ * Move to the first match at least skip bytes past the current one.
+ */
+static int all_advance(
+    allcursor *cur,
+    vsize skip)
+{
+    unsigned char const *rest, *match;
+    vsize restsize, offset;
+    sqlite3_int64 count;
+    int status;
+
+    rest = cur->haystack+cur->offset;
+    restsize = cur->stacksize-cur->offset;
+    if (cur->blob) {
+        match = skip>0 ? needle_find_after(
+            cur->cn, rest, restsize, skip, cur->needle, cur->needlesize)
+            : needle_find(cur->cn, rest, restsize,
+                          cur->needle, cur->needlesize);
+        if (match) {
+            cur->offset = match-cur->haystack;
+            cur->position = cur->offset+1;
+        }
+        status = match!=0;
+    } else {
+        status = utf8_next(
+            cur->cn, rest, restsize, skip, cur->needle, cur->needlesize,
+            cur->enc->trusted, &offset, &count);
+        if (status<0) {
+            sqlite3_free(cur->base.pVtab->zErrMsg);
+            cur->base.pVtab->zErrMsg = sqlite3_mprintf("%s", malformed_8);
+            return cur->base.pVtab->zErrMsg ? SQLITE_ERROR : SQLITE_NOMEM;
+        }
+        if (status) {
+            cur->offset += offset;
+            cur->position += count;
+        }
+    }
+    if (!status) {
+        cur->eof = 1;
+    } else {
+        cur->rowid++;
+    }
+    return SQLITE_OK;
+}
+
+static int all_filter(
+    sqlite3_vtab_cursor *cursor,
+    int idxNum,
+    char const *idxStr,
+    int argc,
+    sqlite3_value **args)
+{
+    allcursor *cur = (allcursor *)cursor;
+    void const *haystack, *needle;
+
+    all_reset(cur);
+    if ((idxNum&3)!=3)
+        return SQLITE_OK;
+    if (sqlite3_value_type(args[0])==SQLITE_NULL
+            || sqlite3_value_type(args[1])==SQLITE_NULL)
+        return SQLITE_OK;
+    cur->overlapping = 0;
+    if (idxNum&4) {
+        if (sqlite3_value_type(args[2])==SQLITE_NULL)
+            return SQLITE_OK;
+        cur->overlapping = sqlite3_value_int(args[2])!=0;
+    }
+    cur->blob = sqlite3_value_type(args[0])==SQLITE_BLOB
+        && sqlite3_value_type(args[1])==SQLITE_BLOB;
+    if (cur->blob) {
+        haystack = sqlite3_value_blob(args[0]);
+        cur->stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_blob(args[1]);
+        cur->needlesize = sqlite3_value_bytes(args[1]);
+    } else {
+        haystack = sqlite3_value_text(args[0]);
+        cur->stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_text(args[1]);
+        cur->needlesize = sqlite3_value_bytes(args[1]);
+    }
+    if (!haystack && cur->stacksize>0 || !needle && cur->needlesize>0)
+        return SQLITE_NOMEM;
+    if (cur->needlesize<=0 || cur->needlesize>cur->stacksize)
+        return SQLITE_OK;
+    cur->haystack = sqlite3_malloc64((sqlite3_uint64)cur->stacksize
+                                     +cur->needlesize);
+    if (!cur->haystack)
+        return SQLITE_NOMEM;
+    cur->needle = cur->haystack+cur->stacksize;
+    memcpy(cur->haystack, haystack, cur->stacksize);
+    memcpy(cur->needle, needle, cur->needlesize);
+    STAT(STAT_SEARCHES, 1);
+    cur->cn = compile_needle(cur->blob ? SEARCH_BLOB : SEARCH_UTF8,
+                             cur->needle, cur->needlesize, cur->stacksize);
+    if (!cur->cn)
+        return SQLITE_NOMEM;
+    cur->offset = 0;
+    cur->position = 1;
+    cur->rowid = 0;
+    cur->eof = 0;
+    return all_advance(cur, 0);
+}
+
+static int all_next(
+    sqlite3_vtab_cursor *cursor)
+{
+    allcursor *cur = (allcursor *)cursor;
+
+    return all_advance(cur, cur->overlapping ? 1 : cur->needlesize);
+}
+
+static int all_eof(
+    sqlite3_vtab_cursor *cursor)
+{
+    return ((allcursor *)cursor)->eof;
+}
+
+static int all_column(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_context *context,
+    int col)
+{
+    allcursor *cur = (allcursor *)cursor;
+
+    switch (col) {
+    case ALL_POSITION:
+        sqlite3_result_int64(context, cur->position);
+        break;
+    case ALL_OFFSET:
+        sqlite3_result_int64(context, cur->offset);
+        break;
+    case ALL_HAYSTACK:
+        if (cur->blob) {
+            sqlite3_result_blob(context, cur->haystack, cur->stacksize,
+                                SQLITE_TRANSIENT);
+        } else {
+            sqlite3_result_text(context, (char const *)cur->haystack,
+                                cur->stacksize, SQLITE_TRANSIENT);
+        }
+        break;
+    case ALL_NEEDLE:
+        if (cur->blob) {
+            sqlite3_result_blob(context, cur->needle, cur->needlesize,
+                                SQLITE_TRANSIENT);
+        } else {
+            sqlite3_result_text(context, (char const *)cur->needle,
+                                cur->needlesize, SQLITE_TRANSIENT);
+        }
+        break;
+    case ALL_OVERLAPPING:
+        sqlite3_result_int(context, cur->overlapping);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int all_rowid(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_int64 *rowidOut)
+{
+    *rowidOut = ((allcursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module const all_module =
+{
+    0,                  /* iVersion */
+    0,                  /* xCreate: eponymous only */
+    all_connect,
+    all_best_index,
+    all_disconnect,
+    0,                  /* xDestroy */
+    all_open,
+    all_close,
+    all_filter,
+    all_next,
+    all_eof,
+    all_column,
+    all_rowid,
+    0,                  /* xUpdate */
+    0,                  /* xBegin */
+    0,                  /* xSync */
+    0,                  /* xCommit */
+    0,                  /* xRollback */
+    0,                  /* xFindFunction */
+    0                   /* xRename */
+};
+
+/*
+ * The split table-valued function.  Like instr_all, the cursor copies
+ * the haystack once, and each step searches on from the end of the
+ * current field to the next separator, so the fields cost one pass
+ * in all.  An empty separator gives the whole haystack as one field,
+ * and an empty haystack gives no fields at all.
+ */
+
+#define SPLIT_ORDINAL   0
+#define SPLIT_VALUE     1
+#define SPLIT_POSITION  2
+#define SPLIT_HAYSTACK  3
+#define SPLIT_SEPARATOR 4
+
+typedef struct splitcursor {
+    sqlite3_vtab_cursor base;
+    encspec const *enc;
+    unsigned char *haystack;
+    vsize stacksize;
+    unsigned char *needle;
+    vsize needlesize;
+    sqlite3_int64 needlechars;
+    compiled *cn;
+    int blob;
+    vsize start;
+    vsize end;
+    sqlite3_int64 position;
+    sqlite3_int64 endposition;
+    int last;
+    sqlite3_int64 rowid;
+    int eof;
+} splitcursor;
+
+static int split_connect(
+    sqlite3 *db,
+    void *aux,
+    int argc,
+    char const *const *argv,
+    sqlite3_vtab **vtabOut,
+    char **errmsgOut)
+{
+    alltab *tab;
+    int status;
+
+    status = sqlite3_declare_vtab(
+        db,
+        "CREATE TABLE x(ordinal, value, char_pos,"
+        " haystack HIDDEN, separator HIDDEN)");
+    if (status!=SQLITE_OK)
+        return status;
+    tab = sqlite3_malloc(sizeof *tab);
+    if (!tab)
+        return SQLITE_NOMEM;
+    memset(tab, 0, sizeof *tab);
+    tab->enc = aux;
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    *vtabOut = &tab->base;
+    return SQLITE_OK;
+}
+
+static int split_best_index(
+    sqlite3_vtab *vtab,
+    sqlite3_index_info *info)
+{
+    int status;
+
+    status = args_best_index(info, SPLIT_HAYSTACK, 2, 2);
+    if (status!=SQLITE_OK)
+        return status;
+    if (info->nOrderBy==1
+            && (info->aOrderBy[0].iColumn==SPLIT_ORDINAL
+                || info->aOrderBy[0].iColumn==SPLIT_POSITION)
+            && !info->aOrderBy[0].desc)
+        info->orderByConsumed = 1;
+    return SQLITE_OK;
+}
+
+static int split_open(
+    sqlite3_vtab *vtab,
+    sqlite3_vtab_cursor **cursorOut)
+{
+    splitcursor *cur;
+
+    cur = sqlite3_malloc(sizeof *cur);
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof *cur);
+    cur->enc = ((alltab *)vtab)->enc;
+    cur->eof = 1;
+    *cursorOut = &cur->base;
+    return SQLITE_OK;
+}
+
+static void split_reset(
+    splitcursor *cur)
+{
+    sqlite3_free(cur->haystack);
+    sqlite3_free(cur->cn);
+    cur->haystack = cur->needle = 0;
+    cur->cn = 0;
+    cur->eof = 1;
+}
+
+static int split_close(
+    sqlite3_vtab_cursor *cursor)
+{
+    split_reset((splitcursor *)cursor);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+static int split_malformed(
+    splitcursor *cur)
+{
+    sqlite3_free(cur->base.pVtab->zErrMsg);
+    cur->base.pVtab->zErrMsg = sqlite3_mprintf("%s", malformed_8);
+    return cur->base.pVtab->zErrMsg ? SQLITE_ERROR : SQLITE_NOMEM;
+}
+
+/*
+ * Find the end of the field that starts at cur->start.
+ */
+static int split_field(
+    splitcursor *cur)
+{
+    unsigned char const *rest, *match;
+    vsize restsize, offset;
+    sqlite3_int64 count;
+    int status;
+
+    rest = cur->haystack+cur->start;
+    restsize = cur->stacksize-cur->start;
+    if (cur->needlesize<=0) {
+        status = 0;
+    } else if (cur->blob) {
+        match = needle_find(cur->cn, rest, restsize,
+                            cur->needle, cur->needlesize);
+        if (match)
+            cur->end = match-cur->haystack;
+        status = match!=0;
+    } else {
+        status = utf8_next(
+            cur->cn, rest, restsize, 0, cur->needle, cur->needlesize,
+            cur->enc->trusted, &offset, &count);
+        if (status<0)
+            return split_malformed(cur);
+        if (status) {
+            cur->end = cur->start+offset;
+            cur->endposition = cur->position+count;
+        }
+    }
+    if (!status) {
+        cur->end = cur->stacksize;
+        cur->last = 1;
+    }
+    return SQLITE_OK;
+}
+
+static int split_filter(
+    sqlite3_vtab_cursor *cursor,
+    int idxNum,
+    char const *idxStr,
+    int argc,
+    sqlite3_value **args)
+{
+    splitcursor *cur = (splitcursor *)cursor;
+    void const *haystack, *needle;
+
+    split_reset(cur);
+    if ((idxNum&3)!=3)
+        return SQLITE_OK;
+    if (sqlite3_value_type(args[0])==SQLITE_NULL
+            || sqlite3_value_type(args[1])==SQLITE_NULL)
+        return SQLITE_OK;
+    cur->blob = sqlite3_value_type(args[0])==SQLITE_BLOB
+        && sqlite3_value_type(args[1])==SQLITE_BLOB;
+    if (cur->blob) {
+        haystack = sqlite3_value_blob(args[0]);
+        cur->stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_blob(args[1]);
+        cur->needlesize = sqlite3_value_bytes(args[1]);
+    } else {
+        haystack = sqlite3_value_text(args[0]);
+        cur->stacksize = sqlite3_value_bytes(args[0]);
+        needle = sqlite3_value_text(args[1]);
+        cur->needlesize = sqlite3_value_bytes(args[1]);
+    }
+    if (!haystack && cur->stacksize>0 || !needle && cur->needlesize>0)
+        return SQLITE_NOMEM;
+    if (cur->stacksize<=0)
+        return SQLITE_OK;
+    cur->haystack = sqlite3_malloc64((sqlite3_uint64)cur->stacksize
+                                     +cur->needlesize);
+    if (!cur->haystack)
+        return SQLITE_NOMEM;
+    cur->needle = cur->haystack+cur->stacksize;
+    memcpy(cur->haystack, haystack, cur->stacksize);
+    if (cur->needlesize>0)
+        memcpy(cur->needle, needle, cur->needlesize);
+    cur->needlechars = cur->needlesize;
+    if (!cur->blob) {
+        if (cur->enc->trusted) {
+            cur->needlechars = kernels->utf8_leads(cur->needle,
+                                                   cur->needlesize);
+        } else if (kernels->utf8_count(cur->needle, cur->needlesize,
+                                       &cur->needlechars)) {
+            return split_malformed(cur);
+        }
+    }
+    STAT(STAT_SEARCHES, 1);
+    cur->cn = compile_needle(cur->blob ? SEARCH_BLOB : SEARCH_UTF8,
+                             cur->needle, cur->needlesize, cur->stacksize);
+    if (!cur->cn)
+        return SQLITE_NOMEM;
+    cur->start = 0;
+    cur->position = 1;
+    cur->last = 0;
+    cur->rowid = 1;
+    cur->eof = 0;
+    return split_field(cur);
+}
+
+static int split_next(
+    sqlite3_vtab_cursor *cursor)
+{
+    splitcursor *cur = (splitcursor *)cursor;
+
+    if (cur->last) {
+        cur->eof = 1;
+        return SQLITE_OK;
+    }
+    cur->start = cur->end+cur->needlesize;
+    if (cur->blob) {
+        cur->position = cur->start+1;
+    } else {
+        cur->position = cur->endposition+cur->needlechars;
+    }
+    cur->rowid++;
+    return split_field(cur);
+}
+
+static int split_eof(
+    sqlite3_vtab_cursor *cursor)
+{
+    return ((splitcursor *)cursor)->eof;
+}
+
+static int split_column(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_context *context,
+    int col)
+{
+    splitcursor *cur = (splitcursor *)cursor;
+
+    switch (col) {
+    case SPLIT_ORDINAL:
+        sqlite3_result_int64(context, cur->rowid);
+        break;
+    case SPLIT_VALUE:
+        result_slice(context, cur->blob ? SEARCH_BLOB : SEARCH_UTF8,
+                     cur->haystack+cur->start, cur->end-cur->start);
+        break;
+    case SPLIT_POSITION:
+        sqlite3_result_int64(context, cur->position);
+        break;
+    case SPLIT_HAYSTACK:
+        result_slice(context, cur->blob ? SEARCH_BLOB : SEARCH_UTF8,
+                     cur->haystack, cur->stacksize);
+        break;
+    case SPLIT_SEPARATOR:
+        result_slice(context, cur->blob ? SEARCH_BLOB : SEARCH_UTF8,
+                     cur->needle, cur->needlesize);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int split_rowid(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_int64 *rowidOut)
+{
+    *rowidOut = ((splitcursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+static sqlite3_module const split_module =
+{
+    0,                  /* iVersion */
+    0,                  /* xCreate: eponymous only */
+    split_connect,
+    split_best_index,
+    all_disconnect,
+    0,                  /* xDestroy */
+    split_open,
+    split_close,
+    split_filter,
+    split_next,
+    split_eof,
+    split_column,
+    split_rowid,
+    0,                  /* xUpdate */
+    0,                  /* xBegin */
+    0,                  /* xSync */
+    0,                  /* xCommit */
+    0,                  /* xRollback */
+    0,                  /* xFindFunction */
+    0                   /* xRename */
+};
+
+/*
+ * The instr_trigram module keeps a column of values together with
+ * a posting list of the byte trigrams in each, in two shadow tables:
+ *
+ *   CREATE VIRTUAL TABLE logs USING instr_trigram;
+ *   INSERT INTO logs(value) VALUES (...);
+ *   SELECT rowid, value FROM logs WHERE contains(value, 'needle');
+ *
+ * A contains or instr call on the value column that is a condition
+ * on its own, as in WHERE instr(value, ?) but not instr(value, ?)>0,
+ * is passed to xFilter, which steps through the rowids whose values
+ * have all the needle's trigrams by seeking in each of their posting
+ * lists in turn.  SQLite still evaluates the call itself for each
+ * candidate, so the results are exactly what the functions give.
+ * Blobs are indexed by their bytes and everything else by its UTF-8
+ * text; in a UTF-16 database the functions compare unlike bytes,
+ * so there the index isn't used and every row is checked.
+ */
+
+#define GRAM_VALUE      0
+
+#define GRAM_SCAN       0
+#define GRAM_ROWID      1
+#define GRAM_NEEDLE     2
+
+#ifdef SQLITE_INDEX_CONSTRAINT_FUNCTION
+#define GRAM_CONTAINS   SQLITE_INDEX_CONSTRAINT_FUNCTION
+#define GRAM_INSTR      (SQLITE_INDEX_CONSTRAINT_FUNCTION+1)
+#else
+#define GRAM_CONTAINS   0
+#define GRAM_INSTR      0
+#endif
+
+/*
+ * A needle's posting lists are intersected by seeking in each one;
+ * more than this many distinct trigrams rarely narrow things further.
+ */
+#define GRAM_MAX        8
+
+#define GS_INSERT       0
+#define GS_DELETE       1
+#define GS_FETCH        2
+#define GS_POST         3
+#define GS_UNPOST       4
+#define NGS             5
+
+static char const *const gram_sql[NGS] =
+{
+    "INSERT INTO \"%w\".\"%w_content\"(id, value) VALUES (?1, ?2)",
+    "DELETE FROM \"%w\".\"%w_content\" WHERE id=?1",
+    "SELECT value FROM \"%w\".\"%w_content\" WHERE id=?1",
+    "INSERT OR IGNORE INTO \"%w\".\"%w_postings\"(gram, id) VALUES (?1, ?2)",
+    "DELETE FROM \"%w\".\"%w_postings\" WHERE gram=?1 AND id=?2"
+};
+
+typedef struct gramtab {
+    sqlite3_vtab base;
+    sqlite3 *db;
+    encspec const *enc;
+    char *schema;
+    char *name;
+    int utf8;
+    sqlite3_stmt *stmts[NGS];
+} gramtab;
+
+typedef struct gramcursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt *rows;
+    sqlite3_stmt *seek;
+    int mode;
+    unsigned int grams[GRAM_MAX];
+    int ngrams;
+    sqlite3_int64 rowid;
+    int eof;
+} gramcursor;
+
+static int gram_prepare(
+    gramtab *tab,
+    char const *format,
+    sqlite3_stmt **stmtOut)
+{
+    char *sql;
+    int status;
+
+    sql = sqlite3_mprintf(format, tab->schema, tab->name);
+    if (!sql)
+        return SQLITE_NOMEM;
+    status = sqlite3_prepare_v2(tab->db, sql, -1, stmtOut, 0);
+    sqlite3_free(sql);
+    return status;
+}
+
+static void gram_free(
+    gramtab *tab)
+{
+    int ix;
+
+    for (ix = 0; ix<NGS; ix++) {
+        sqlite3_finalize(tab->stmts[ix]);
+    }
+    sqlite3_free(tab->schema);
+    sqlite3_free(tab->name);
+    sqlite3_free(tab);
+}
+
+static int gram_init(
+    sqlite3 *db,
+    void *aux,
+    int argc,
+    char const *const *argv,
+    sqlite3_vtab **vtabOut,
+    char **errmsgOut,
+    int create)
+{
+    gramtab *tab;
+    sqlite3_stmt *stmt;
+    char *sql;
+    int status, ix;
+
+    status = sqlite3_declare_vtab(db, "CREATE TABLE x(value)");
+    if (status!=SQLITE_OK)
+        return status;
+    tab = sqlite3_malloc(sizeof *tab);
+    if (!tab)
+        return SQLITE_NOMEM;
+    memset(tab, 0, sizeof *tab);
+    tab->db = db;
+    tab->enc = aux;
+    tab->schema = sqlite3_mprintf("%s", argv[1]);
+    tab->name = sqlite3_mprintf("%s", argv[2]);
+    if (!tab->schema || !tab->name)
+        goto nomem;
+    if (create) {
+        sql = sqlite3_mprintf(
+            "CREATE TABLE \"%w\".\"%w_content\""
+            "(id INTEGER PRIMARY KEY, value);"
+            "CREATE TABLE \"%w\".\"%w_postings\""
+            "(gram INTEGER, id INTEGER, PRIMARY KEY (gram, id))"
+            " WITHOUT ROWID",
+            argv[1], argv[2], argv[1], argv[2]);
+        if (!sql)
+            goto nomem;
+        status = sqlite3_exec(db, sql, 0, 0, errmsgOut);
+        sqlite3_free(sql);
+        if (status!=SQLITE_OK)
+            goto bail;
+    }
+    for (ix = 0; ix<NGS; ix++) {
+        status = gram_prepare(tab, gram_sql[ix], &tab->stmts[ix]);
+        if (status!=SQLITE_OK)
+            goto error;
+    }
+    status = sqlite3_prepare_v2(db, "PRAGMA encoding", -1, &stmt, 0);
+    if (status!=SQLITE_OK)
+        goto error;
+    if (sqlite3_step(stmt)==SQLITE_ROW)
+        tab->utf8 = !sqlite3_stricmp(
+            (char const *)sqlite3_column_text(stmt, 0), "UTF-8");
+    status = sqlite3_finalize(stmt);
+    if (status!=SQLITE_OK)
+        goto error;
+    *vtabOut = &tab->base;
+    return SQLITE_OK;
+
+error:
+    *errmsgOut = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    goto bail;
+
+nomem:
+    status = SQLITE_NOMEM;
+
+bail:
+    gram_free(tab);
+    return status;
+}
+
+static int gram_create(
+    sqlite3 *db,
+    void *aux,
+    int argc,
+    char const *const *argv,
+    sqlite3_vtab **vtabOut,
+    char **errmsgOut)
+{
+    return gram_init(db, aux, argc, argv, vtabOut, errmsgOut, 1);
+}
+
+static int gram_connect(
+    sqlite3 *db,
+    void *aux,
+    int argc,
+    char const *const *argv,
+    sqlite3_vtab **vtabOut,
+    char **errmsgOut)
+{
+    return gram_init(db, aux, argc, argv, vtabOut, errmsgOut, 0);
+}
+
+static int gram_disconnect(
+    sqlite3_vtab *vtab)
+{
+    gram_free((gramtab *)vtab);
+    return SQLITE_OK;
+}
+
+static int gram_destroy(
+    sqlite3_vtab *vtab)
+{
+    gramtab *tab = (gramtab *)vtab;
+    char *sql;
+    int status;
+
+    sql = sqlite3_mprintf(
+        "DROP TABLE \"%w\".\"%w_content\";"
+        "DROP TABLE \"%w\".\"%w_postings\"",
+        tab->schema, tab->name, tab->schema, tab->name);
+    if (!sql)
+        return SQLITE_NOMEM;
+    status = sqlite3_exec(tab->db, sql, 0, 0, 0);
+    sqlite3_free(sql);
+    if (status==SQLITE_OK)
+        gram_free(tab);
+    return status;
+}
+
+/*
+ * Rename the shadow tables along with the table, and prepare the
+ * statements again for the new names.  If anything fails SQLite rolls
+ * back the whole ALTER TABLE.
+ */
+static int gram_rename(
+    sqlite3_vtab *vtab,
+    char const *newname)
+{
+    gramtab *tab = (gramtab *)vtab;
+    char *sql, *name, *errmsg = 0;
+    int status, prepared, ix;
+
+    for (ix = 0; ix<NGS; ix++) {
+        sqlite3_finalize(tab->stmts[ix]);
+        tab->stmts[ix] = 0;
+    }
+    sql = sqlite3_mprintf(
+        "ALTER TABLE \"%w\".\"%w_content\" RENAME TO \"%w_content\";"
+        "ALTER TABLE \"%w\".\"%w_postings\" RENAME TO \"%w_postings\"",
+        tab->schema, tab->name, newname, tab->schema, tab->name, newname);
+    name = sqlite3_mprintf("%s", newname);
+    if (!sql || !name) {
+        sqlite3_free(sql);
+        sqlite3_free(name);
+        return SQLITE_NOMEM;
+    }
+    status = sqlite3_exec(tab->db, sql, 0, 0, &errmsg);
+    sqlite3_free(sql);
+    if (status!=SQLITE_OK) {
+        sqlite3_free(tab->base.zErrMsg);
+        tab->base.zErrMsg = errmsg;
+        sqlite3_free(name);
+        name = tab->name;
+    } else {
+        sqlite3_free(tab->name);
+    }
+    tab->name = name;
+    for (ix = 0; ix<NGS; ix++) {
+        prepared = gram_prepare(tab, gram_sql[ix], &tab->stmts[ix]);
+        if (status==SQLITE_OK)
+            status = prepared;
+    }
+    return status;
+}
+
+/*
+ * Take a rowid constraint if there is one, or else a contains or instr
+ * call on the value, whose result SQLite still checks.
+ */
+static int gram_best_index(
+    sqlite3_vtab *vtab,
+    sqlite3_index_info *info)
+{
+    gramtab *tab = (gramtab *)vtab;
+    int ix, rowidix, needleix;
+
+    rowidix = needleix = -1;
+    for (ix = 0; ix<info->nConstraint; ix++) {
+        struct sqlite3_index_constraint const *cons;
+
+        cons = &info->aConstraint[ix];
+        if (!cons->usable)
+            continue;
+        if (cons->iColumn<0 && cons->op==SQLITE_INDEX_CONSTRAINT_EQ) {
+            rowidix = ix;
+        } else if (cons->iColumn==GRAM_VALUE && tab->utf8
+                   && (cons->op==GRAM_CONTAINS || cons->op==GRAM_INSTR)) {
+            needleix = ix;
+        }
+    }
+    if (rowidix>=0) {
+        info->idxNum = GRAM_ROWID;
+        info->aConstraintUsage[rowidix].argvIndex = 1;
+        info->aConstraintUsage[rowidix].omit = 1;
+        info->estimatedCost = 10;
+        info->estimatedRows = 1;
+        info->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    } else if (needleix>=0) {
+        info->idxNum = GRAM_NEEDLE;
+        info->aConstraintUsage[needleix].argvIndex = 1;
+        info->estimatedCost = 1000;
+        info->estimatedRows = 100;
+    } else {
+        info->idxNum = GRAM_SCAN;
+        info->estimatedCost = 1e6;
+        info->estimatedRows = 1000000;
+    }
+    if (info->nOrderBy==1 && info->aOrderBy[0].iColumn<0
+            && !info->aOrderBy[0].desc)
+        info->orderByConsumed = 1;
+    return SQLITE_OK;
+}
+
+static int gram_find_function(
+    sqlite3_vtab *vtab,
+    int argc,
+    char const *name,
+    void (**implOut)(sqlite3_context *, int, sqlite3_value **),
+    void **argOut)
+{
+#if GRAM_CONTAINS>0
+    if (argc!=2)
+        return 0;
+    *argOut = (void *)((gramtab *)vtab)->enc;
+    if (!sqlite3_stricmp(name, "contains")) {
+        *implOut = contains_func;
+        return GRAM_CONTAINS;
+    }
+    if (!sqlite3_stricmp(name, "instr")) {
+        *implOut = instr_func;
+        return GRAM_INSTR;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * The bytes a value is indexed and searched by.
+ */
+static unsigned char const *gram_bytes(
+    sqlite3_value *value,
+    vsize *sizeOut)
+{
+    unsigned char const *data;
+
+    if (sqlite3_value_type(value)==SQLITE_BLOB) {
+        data = sqlite3_value_blob(value);
+    } else {
+        data = sqlite3_value_text(value);
+    }
+    *sizeOut = sqlite3_value_bytes(value);
+    return data;
+}
+
+static int gram_compare(
+    void const *a,
+    void const *b)
+{
+    unsigned int x = *(unsigned int const *)a, y = *(unsigned int const *)b;
+
+    return x<y ? -1 : x>y;
+}
+
+/*
+ * The distinct trigrams of the data, in ascending order, in an array
+ * that the caller frees.
+ */
+static int gram_list(
+    unsigned char const *data,
+    vsize size,
+    unsigned int **gramsOut,
+    vsize *countOut)
+{
+    unsigned int *grams;
+    vsize ix, count;
+
+    *gramsOut = 0;
+    *countOut = 0;
+    if (size<3)
+        return SQLITE_OK;
+    grams = sqlite3_malloc64((sqlite3_uint64)(size-2)*sizeof *grams);
+    if (!grams)
+        return SQLITE_NOMEM;
+    for (ix = 0; ix<size-2; ix++) {
+        grams[ix] = (unsigned int)data[ix]<<16 | data[ix+1]<<8 | data[ix+2];
+    }
+    qsort(grams, size-2, sizeof *grams, gram_compare);
+    count = 1;
+    for (ix = 1; ix<size-2; ix++) {
+        if (grams[ix]!=grams[count-1])
+            grams[count++] = grams[ix];
+    }
+    *gramsOut = grams;
+    *countOut = count;
+    return SQLITE_OK;
+}
+
+/*
+ * Run a statement that returns no rows with two integers bound to it.
+ */
+static int gram_run(
+    sqlite3_stmt *stmt,
+    sqlite3_int64 first,
+    sqlite3_int64 second)
+{
+    sqlite3_bind_int64(stmt, 1, first);
+    sqlite3_bind_int64(stmt, 2, second);
+    sqlite3_step(stmt);
+    return sqlite3_reset(stmt);
+}
+
+static int gram_post(
+    sqlite3_stmt *stmt,
+    sqlite3_int64 rowid,
+    sqlite3_value *value)
+{
+    unsigned char const *data;
+    unsigned int *grams;
+    vsize size, count, ix;
+    int status;
+
+    if (sqlite3_value_type(value)==SQLITE_NULL)
+        return SQLITE_OK;
+    data = gram_bytes(value, &size);
+    if (!data && size>0)
+        return SQLITE_NOMEM;
+    status = gram_list(data, size, &grams, &count);
+    for (ix = 0; ix<count && status==SQLITE_OK; ix++) {
+        status = gram_run(stmt, grams[ix], rowid);
+    }
+    sqlite3_free(grams);
+    return status;
+}
+
+static int gram_remove(
+    gramtab *tab,
+    sqlite3_int64 rowid)
+{
+    sqlite3_stmt *fetch;
+    int status;
+
+    fetch = tab->stmts[GS_FETCH];
+    sqlite3_bind_int64(fetch, 1, rowid);
+    if (sqlite3_step(fetch)==SQLITE_ROW) {
+        status = gram_post(tab->stmts[GS_UNPOST], rowid,
+                           sqlite3_column_value(fetch, 0));
+        sqlite3_reset(fetch);
+    } else {
+        status = sqlite3_reset(fetch);
+    }
+    if (status!=SQLITE_OK)
+        return status;
+    return gram_run(tab->stmts[GS_DELETE], rowid, 0);
+}
+
+static int gram_update(
+    sqlite3_vtab *vtab,
+    int argc,
+    sqlite3_value **args,
+    sqlite3_int64 *rowidOut)
+{
+    gramtab *tab = (gramtab *)vtab;
+    sqlite3_stmt *insert;
+    sqlite3_int64 rowid;
+    int status;
+
+    if (sqlite3_value_type(args[0])!=SQLITE_NULL) {
+        status = gram_remove(tab, sqlite3_value_int64(args[0]));
+        if (status!=SQLITE_OK || argc==1)
+            return status;
+    }
+    insert = tab->stmts[GS_INSERT];
+    sqlite3_bind_value(insert, 1, args[1]);
+    sqlite3_bind_value(insert, 2, args[2]);
+    sqlite3_step(insert);
+    status = sqlite3_reset(insert);
+    sqlite3_clear_bindings(insert);
+    if (status!=SQLITE_OK)
+        return status;
+    rowid = sqlite3_last_insert_rowid(tab->db);
+    *rowidOut = rowid;
+    return gram_post(tab->stmts[GS_POST], rowid, args[2]);
+}
+
+static int gram_open(
+    sqlite3_vtab *vtab,
+    sqlite3_vtab_cursor **cursorOut)
+{
+    gramcursor *cur;
+
+    cur = sqlite3_malloc(sizeof *cur);
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof *cur);
+    cur->eof = 1;
+    *cursorOut = &cur->base;
+    return SQLITE_OK;
+}
+
+static void gram_reset(
+    gramcursor *cur)
+{
+    sqlite3_finalize(cur->rows);
+    sqlite3_finalize(cur->seek);
+    cur->rows = cur->seek = 0;
+    cur->ngrams = 0;
+    cur->eof = 1;
+}
+
+static int gram_close(
+    sqlite3_vtab_cursor *cursor)
+{
+    gram_reset((gramcursor *)cursor);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+/*
+ * Step the row statement of a scan, or move to the first rowid from
+ * rowid on that's in every one of the needle's posting lists.
+ */
+static int gram_step(
+    gramcursor *cur,
+    sqlite3_int64 rowid)
 {
-    bmh_skips skips;
-    unsigned char const *haystart = haystack;
     sqlite3_int64 found;
-    int codepoint;
-
-    if (start<=0)
-        return 0;
-    if (needlesize>stacksize)
-        return 0;
-    found = 1;
-    while (found<start && stacksize>needlesize) {
-        unsigned char const *oldhaystack = haystack;
-        vsize oldstacksize = stacksize;
+    int status, ix, agreed;
 
-        UTF8_ADVANCE(haystack, stacksize, codepoint);
-        if (codepoint==-1)
-            return -1;
-        if (stacksize<needlesize) {
-            haystack = oldhaystack;
-            stacksize = oldstacksize;
-            break;
+    if (cur->mode!=GRAM_NEEDLE || cur->ngrams==0) {
+        status = sqlite3_step(cur->rows);
+        if (status==SQLITE_ROW) {
+            cur->rowid = sqlite3_column_int64(cur->rows, 0);
+            return SQLITE_OK;
         }
-        found++;
+        cur->eof = 1;
+        return status==SQLITE_DONE ? SQLITE_OK : status;
     }
-    if (needlesize<=0)
-        return found;
-    stacksize = haystack-haystart;
-    if (needlesize>1) {
-        unsigned char const *next;
-
-        rbmh_setup(needle, needlesize, 0, skips);
-        next = haystack;
-        for (;;) {
-            if (haystack<=next) {
-                vsize skip;
-
-                if (!memcmp(haystack, needle, needlesize))
-                    return found;
-                skip = skips[haystack[0]];
-                if (skip>stacksize)
-                    return 0;
-                next = haystack-skip;
+    for (;;) {
+        ix = agreed = 0;
+        while (agreed<cur->ngrams) {
+            sqlite3_bind_int64(cur->seek, 1, cur->grams[ix]);
+            sqlite3_bind_int64(cur->seek, 2, rowid);
+            if (sqlite3_step(cur->seek)!=SQLITE_ROW) {
+                cur->eof = 1;
+                return sqlite3_reset(cur->seek);
             }
-            if (stacksize<=0)
-                return 0;
-            UTF8_RETREAT(haystack, stacksize, codepoint);
-            found--;
+            found = sqlite3_column_int64(cur->seek, 0);
+            sqlite3_reset(cur->seek);
+            if (found!=rowid) {
+                rowid = found;
+                agreed = 1;
+            } else {
+                agreed++;
+            }
+            ix = (ix+1)%cur->ngrams;
         }
-    } else {
-        unsigned int first;
-
-        first = needle[0];
-        for (;;) {
-            if (haystack[0]==first)
-                return found;
-            if (stacksize<=0)
-                return 0;
-            UTF8_RETREAT(haystack, stacksize, codepoint);
-            found--;
+        sqlite3_reset(cur->rows);
+        sqlite3_bind_int64(cur->rows, 1, rowid);
+        status = sqlite3_step(cur->rows);
+        if (status==SQLITE_ROW) {
+            cur->rowid = rowid;
+            return SQLITE_OK;
+        }
+        if (status!=SQLITE_DONE)
+            return sqlite3_reset(cur->rows);
+        if (rowid==0x7FFFFFFFFFFFFFFFLL) {
+            cur->eof = 1;
+            return SQLITE_OK;
         }
+        rowid++;
     }
 }
 
-static sqlite3_int64 rinstr_utf16(
-    unsigned short const *haystack,
-    vsize stacksize,
-    unsigned short const *needle,
-    vsize needlesize,
-    sqlite3_int64 start)
+static int gram_filter(
+    sqlite3_vtab_cursor *cursor,
+    int idxNum,
+    char const *idxStr,
+    int argc,
+    sqlite3_value **args)
 {
-    bmh_skips skips;
-    unsigned short const *haystart = haystack;
-    sqlite3_int64 found;
-    int codepoint;
-
-    if (start<=0)
-        return 0;
-    if (needlesize>stacksize)
-        return 0;
-    found = 1;
-    while (found<start && stacksize>needlesize) {
-        unsigned short const *oldhaystack = haystack;
-        vsize oldstacksize = stacksize;
+    gramcursor *cur = (gramcursor *)cursor;
+    gramtab *tab = (gramtab *)cursor->pVtab;
+    unsigned char const *needle;
+    unsigned int *grams;
+    vsize needlesize, count, ix;
+    int status;
 
-        UTF16_ADVANCE(haystack, stacksize, codepoint);
-        if (codepoint==-1)
-            return -1;
-        if (stacksize<needlesize) {
-            haystack = oldhaystack;
-            stacksize = oldstacksize;
-            break;
+    gram_reset(cur);
+    cur->mode = idxNum;
+    if (idxNum==GRAM_NEEDLE) {
+        if (sqlite3_value_type(args[0])==SQLITE_NULL)
+            return SQLITE_OK;
+        needle = gram_bytes(args[0], &needlesize);
+        if (!needle && needlesize>0)
+            return SQLITE_NOMEM;
+        status = gram_list(needle, needlesize, &grams, &count);
+        if (status!=SQLITE_OK)
+            return status;
+        /*
+         * Take trigrams from across the sorted list, so that a needle
+         * with many of them isn't just narrowed by its smallest.
+         */
+        cur->ngrams = count<GRAM_MAX ? (int)count : GRAM_MAX;
+        for (ix = 0; ix<(vsize)cur->ngrams; ix++) {
+            cur->grams[ix] = grams[ix*count/cur->ngrams];
         }
-        found++;
+        sqlite3_free(grams);
     }
-    if (needlesize<=0)
-        return found;
-    stacksize = (haystack-haystart)*2;
-    if (needlesize>2) {
-        unsigned short const *next;
-
-        rbmh_setup((unsigned char const *)needle, needlesize, 1, skips);
-        next = haystack;
-        for (;;) {
-            if (haystack<=next) {
-                vsize skip;
-
-                if (!memcmp(haystack, needle, needlesize))
-                    return found;
-                skip = skips[((unsigned char const *)haystack)[0]];
-                if (skip>stacksize)
-                    return 0;
-                next = haystack-skip/2;
-            }
-            if (stacksize<=0)
-                return 0;
-            UTF16_RETREAT(haystack, stacksize, codepoint);
-            found--;
-        }
+    if (idxNum==GRAM_ROWID || cur->ngrams>0) {
+        status = gram_prepare(
+            tab, "SELECT id, value FROM \"%w\".\"%w_content\" WHERE id=?1",
+            &cur->rows);
+        if (status==SQLITE_OK && idxNum==GRAM_ROWID)
+            status = sqlite3_bind_value(cur->rows, 1, args[0]);
     } else {
-        unsigned int first;
+        status = gram_prepare(
+            tab, "SELECT id, value FROM \"%w\".\"%w_content\" ORDER BY id",
+            &cur->rows);
+    }
+    if (status==SQLITE_OK && cur->ngrams>0)
+        status = gram_prepare(
+            tab,
+            "SELECT id FROM \"%w\".\"%w_postings\""
+            " WHERE gram=?1 AND id>=?2 ORDER BY id LIMIT 1",
+            &cur->seek);
+    if (status!=SQLITE_OK)
+        return status;
+    cur->eof = 0;
+    return gram_step(cur, -0x7FFFFFFFFFFFFFFFLL-1);
+}
 
-        first = needle[0];
-        for (;;) {
-            if (haystack[0]==first)
-                return found;
-            if (stacksize<=0)
-                return 0;
-            UTF16_RETREAT(haystack, stacksize, codepoint);
-            found--;
-        }
+static int gram_next(
+    sqlite3_vtab_cursor *cursor)
+{
+    gramcursor *cur = (gramcursor *)cursor;
+
+    if (cur->mode==GRAM_NEEDLE && cur->rowid==0x7FFFFFFFFFFFFFFFLL) {
+        cur->eof = 1;
+        return SQLITE_OK;
     }
+    return gram_step(cur, cur->rowid+1);
 }
 
-static void rinstr_func(
+static int gram_eof(
+    sqlite3_vtab_cursor *cursor)
+{
+    return ((gramcursor *)cursor)->eof;
+}
+
+static int gram_column(
+    sqlite3_vtab_cursor *cursor,
     sqlite3_context *context,
+    int col)
+{
+    gramcursor *cur = (gramcursor *)cursor;
+
+    if (col==GRAM_VALUE)
+        sqlite3_result_value(context, sqlite3_column_value(cur->rows, 1));
+    return SQLITE_OK;
+}
+
+static int gram_rowid(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_int64 *rowidOut)
+{
+    *rowidOut = ((gramcursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+/*
+ * Marking the tables that hold the index as shadow tables keeps
+ * ordinary SQL from writing to them under SQLITE_DBCONFIG_DEFENSIVE,
+ * where it could leave them out of step with each other.
+ */
+#if SQLITE_VERSION_NUMBER>=3026000
+static int gram_shadow_name(
+    char const *suffix)
+{
+    return !sqlite3_stricmp(suffix, "content")
+        || !sqlite3_stricmp(suffix, "postings");
+}
+#endif
+
+static sqlite3_module const gram_module =
+{
+#if SQLITE_VERSION_NUMBER>=3026000
+    3,                  /* iVersion */
+#else
+    0,                  /* iVersion */
+#endif
+    gram_create,
+    gram_connect,
+    gram_best_index,
+    gram_disconnect,
+    gram_destroy,
+    gram_open,
+    gram_close,
+    gram_filter,
+    gram_next,
+    gram_eof,
+    gram_column,
+    gram_rowid,
+    gram_update,
+    0,                  /* xBegin */
+    0,                  /* xSync */
+    0,                  /* xCommit */
+    0,                  /* xRollback */
+    gram_find_function,
+    gram_rename,
+#if SQLITE_VERSION_NUMBER>=3026000
+    0,                  /* xSavepoint */
+    0,                  /* xRelease */
+    0,                  /* xRollbackTo */
+    gram_shadow_name
+#endif
+};
+
+#ifdef INSTR_STATS
+
+/*
+ * The instr_stats table-valued function, with a row for each counter
+ * and one more for the average Horspool shift.  Given a true argument,
+ * it zeroes the counters as it reads them.
+ */
+
+#define STATS_COUNTER   0
+#define STATS_VALUE     1
+#define STATS_RESET     2
+
+static char const *const stat_names[NSTATS+1] =
+{
+    "searches",
+    "bytes_scanned",
+    "candidates",
+    "shifts",
+    "shift_total",
+    "needles_compiled",
+    "needles_cached",
+    "chars_walked",
+    "average_shift"
+};
+
+typedef struct statscursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_int64 values[NSTATS];
+    int row;
+} statscursor;
+
+static int stats_connect(
+    sqlite3 *db,
+    void *aux,
+    int argc,
+    char const *const *argv,
+    sqlite3_vtab **vtabOut,
+    char **errmsgOut)
+{
+    sqlite3_vtab *tab;
+    int status;
+
+    status = sqlite3_declare_vtab(
+        db, "CREATE TABLE x(counter, value, reset HIDDEN)");
+    if (status!=SQLITE_OK)
+        return status;
+    tab = sqlite3_malloc(sizeof *tab);
+    if (!tab)
+        return SQLITE_NOMEM;
+    memset(tab, 0, sizeof *tab);
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+    *vtabOut = tab;
+    return SQLITE_OK;
+}
+
+static int stats_best_index(
+    sqlite3_vtab *vtab,
+    sqlite3_index_info *info)
+{
+    return args_best_index(info, STATS_RESET, 1, 0);
+}
+
+static int stats_open(
+    sqlite3_vtab *vtab,
+    sqlite3_vtab_cursor **cursorOut)
+{
+    statscursor *cur;
+
+    cur = sqlite3_malloc(sizeof *cur);
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof *cur);
+    cur->row = NSTATS+1;
+    *cursorOut = &cur->base;
+    return SQLITE_OK;
+}
+
+static int stats_close(
+    sqlite3_vtab_cursor *cursor)
+{
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+static int stats_filter(
+    sqlite3_vtab_cursor *cursor,
+    int idxNum,
+    char const *idxStr,
     int argc,
     sqlite3_value **args)
 {
-    int stacktype, needletype;
-    void const *haystack, *needle;
-    vsize stacksize, needlesize;
-    sqlite3_int64 start, result;
-    char const *malformed;
+    statscursor *cur = (statscursor *)cursor;
+    int reset, ix;
 
-    if (argc<2)
-        goto confused;
-    stacktype = sqlite3_value_type(args[0]);
-    if (stacktype==SQLITE_NULL)
-        return;
-    needletype = sqlite3_value_type(args[1]);
-    if (needletype==SQLITE_NULL)
-        return;
-    if (argc>=3) {
-        if (sqlite3_value_type(args[2])==SQLITE_NULL)
-            return;
-        start = sqlite3_value_int64(args[2]);
-    } else {
-        start = 0x7FFFFFFFFFFFFFFFLL;
-    }
-    malformed = sqlite3_user_data(context);
-    if (stacktype==SQLITE_BLOB && needletype==SQLITE_BLOB) {
-        haystack = sqlite3_value_blob(args[0]);
-        stacksize = sqlite3_value_bytes(args[0]);
-        if (!haystack && stacksize>0)
-            goto nomem;
-        needle = sqlite3_value_blob(args[1]);
-        needlesize = sqlite3_value_bytes(args[1]);
-        if (!needle && needlesize>0)
-            goto nomem;
-        result = rinstr_blob(haystack, stacksize, needle, needlesize, start);
-    } else if (malformed==malformed_8) {
-        haystack = sqlite3_value_text(args[0]);
-        if (!haystack)
-            goto nomem;
-        stacksize = sqlite3_value_bytes(args[0]);
-        needle = sqlite3_value_text(args[1]);
-        if (!needle)
-            goto nomem;
-        needlesize = sqlite3_value_bytes(args[1]);
-        result = rinstr_utf8(haystack, stacksize, needle, needlesize, start);
-    } else if (malformed==malformed_16) {
-        haystack = sqlite3_value_text16(args[0]);
-        if (!haystack)
-            goto nomem;
-        stacksize = sqlite3_value_bytes16(args[0])&~(vsize)1;
-        needle = sqlite3_value_text16(args[1]);
-        if (!needle)
-            goto nomem;
-        needlesize = sqlite3_value_bytes16(args[1])&~(vsize)1;
-        result = rinstr_utf16(haystack, stacksize, needle, needlesize, start);
-    } else {
-        goto confused;
-    }
-    if (result<0) {
-        sqlite3_result_error(context, malformed, -1);
-    } else {
-        sqlite3_result_int64(context, result);
+    reset = idxNum&1 && sqlite3_value_int(args[0]);
+    for (ix = 0; ix<NSTATS; ix++) {
+        cur->values[ix] = STAT_TAKE(ix, reset);
     }
-    return;
+    cur->row = 0;
+    return SQLITE_OK;
+}
 
-confused:
-    sqlite3_result_error(context, confused, sizeof confused-1);
-    return;
+static int stats_next(
+    sqlite3_vtab_cursor *cursor)
+{
+    ((statscursor *)cursor)->row++;
+    return SQLITE_OK;
+}
 
-nomem:
-    sqlite3_result_error_nomem(context);
+static int stats_eof(
+    sqlite3_vtab_cursor *cursor)
+{
+    return ((statscursor *)cursor)->row>NSTATS;
 }
 
+static int stats_column(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_context *context,
+    int col)
+{
+    statscursor *cur = (statscursor *)cursor;
+
+    switch (col) {
+    case STATS_COUNTER:
+        sqlite3_result_text(context, stat_names[cur->row], -1,
+                            SQLITE_STATIC);
+        break;
+    case STATS_VALUE:
+        if (cur->row<NSTATS) {
+            sqlite3_result_int64(context, cur->values[cur->row]);
+        } else if (cur->values[STAT_SHIFTS]>0) {
+            sqlite3_result_double(
+                context,
+                (double)cur->values[STAT_SHIFTED]/cur->values[STAT_SHIFTS]);
+        }
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int stats_rowid(
+    sqlite3_vtab_cursor *cursor,
+    sqlite3_int64 *rowidOut)
+{
+    *rowidOut = ((statscursor *)cursor)->row+1;
+    return SQLITE_OK;
+}
+
+static sqlite3_module const stats_module =
+{
+    0,                  /* iVersion */
+    0,                  /* xCreate: eponymous only */
+    stats_connect,
+    stats_best_index,
+    all_disconnect,
+    0,                  /* xDestroy */
+    stats_open,
+    stats_close,
+    stats_filter,
+    stats_next,
+    stats_eof,
+    stats_column,
+    stats_rowid,
+    0,                  /* xUpdate */
+    0,                  /* xBegin */
+    0,                  /* xSync */
+    0,                  /* xCommit */
+    0,                  /* xRollback */
+    0,                  /* xFindFunction */
+    0                   /* xRename */
+};
+
+#endif
+
 typedef struct funcspec {
     char const *name;
     void (*impl)(
         sqlite3_context *context,
         int argc,
         sqlite3_value **args);
+    int minargs;
+    int maxargs;
 } funcspec;
 
-typedef struct encspec {
-    int rep;
-    void *ptr;
-} encspec;
+static funcspec const funcs[] =
+{
+    {"instr",              instr_func,               2,  4},
+    {"rinstr",             rinstr_func,              2,  4},
+    {"instr_nocase",       instr_nocase_func,        2,  4},
+    {"rinstr_nocase",      rinstr_nocase_func,       2,  4},
+    {"instr_any",          instr_any_func,           -1, -1},
+    {"instr_which",        instr_which_func,         -1, -1},
+    {"contains",           contains_func,            2,  2},
+    {"starts_with",        starts_with_func,         2,  2},
+    {"ends_with",          ends_with_func,           2,  2},
+    {"instr_bytes",        instr_bytes_func,         2,  3},
+    {"rinstr_bytes",       rinstr_bytes_func,        2,  3},
+    {"substr_bytes",       substr_bytes_func,        2,  3},
+    {"substr_before",      substr_before_func,       2,  2},
+    {"substr_after",       substr_after_func,        2,  2},
+    {"substr_before_last", substr_before_last_func,  2,  2},
+    {"substr_after_last",  substr_after_last_func,   2,  2},
+    {"split_part",         split_part_func,          3,  3},
+    {"replace_all",        replace_all_func,         3,  4},
+    {"instr_count",        instr_count_func,         2,  3}
+};
 
-static funcspec const funcs[2] =
+#define NENCS 3
+
+static encspec const encs[NENCS] =
 {
-    {"instr",  instr_func},
-    {"rinstr", rinstr_func}
+    {SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, 0},
+    {SQLITE_UTF16LE | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, 0},
+    {SQLITE_UTF16BE | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, 0}
 };
 
-static encspec const encs[2] =
+static encspec const trusted_encs[NENCS] =
 {
-    {
-        SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
-        malformed_8
-    },
-    {
-        SQLITE_UTF16 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
-        malformed_16
-    }
+    {SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, 1},
+    {SQLITE_UTF16LE | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, 1},
+    {SQLITE_UTF16BE | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, 1}
 };
 
-#ifdef _WIN32
-__declspec(dllexport)
-#endif
-int sqlite3_extension_init(
+static int register_funcs(
     sqlite3 *db,
     char **errmsgOut,
-    sqlite3_api_routines const *api)
+    encspec const *encs)
 {
     int funcix, argc, encix;
     int status;
 
-    SQLITE_EXTENSION_INIT2(api);
-
-    for (funcix = 0; funcix<2; funcix++) {
-        for (argc = 2; argc<=3; argc++) {
-            for (encix = 0; encix<2; encix++) {
+    for (funcix = 0; funcix<(int)(sizeof funcs/sizeof funcs[0]); funcix++) {
+        for (argc = funcs[funcix].minargs;
+                argc<=funcs[funcix].maxargs; argc++) {
+            for (encix = 0; encix<NENCS; encix++) {
                 status = sqlite3_create_function(
                     db,
                     funcs[funcix].name,
                     argc,
                     encs[encix].rep,
-                    encs[encix].ptr,
+                    (void *)&encs[encix],
                     funcs[funcix].impl,
                     0,
                     0);
@@ -758,6 +9216,82 @@ int sqlite3_extension_init(
             }
         }
     }
+    for (argc = 5; argc<=6; argc++) {
+        status = sqlite3_create_function(
+            db,
+            "instr_blob_stream",
+            argc,
+            SQLITE_UTF8 | SQLITE_DIRECTONLY,
+            0,
+            instr_blob_stream_func,
+            0,
+            0);
+        if (status!=SQLITE_OK)
+            goto bail;
+    }
+#if HAVE_FILES
+    for (argc = 2; argc<=3; argc++) {
+        status = sqlite3_create_function(
+            db,
+            "instr_file",
+            argc,
+            SQLITE_UTF8 | SQLITE_DIRECTONLY,
+            0,
+            instr_file_func,
+            0,
+            0);
+        if (status!=SQLITE_OK)
+            goto bail;
+        status = sqlite3_create_function(
+            db,
+            "rinstr_file",
+            argc,
+            SQLITE_UTF8 | SQLITE_DIRECTONLY,
+            0,
+            rinstr_file_func,
+            0,
+            0);
+        if (status!=SQLITE_OK)
+            goto bail;
+    }
+#endif
+    status = sqlite3_create_function(
+        db,
+        "matcher_compile",
+        -1,
+        SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS,
+        0,
+        matcher_compile_func,
+        0,
+        0);
+    if (status!=SQLITE_OK)
+        goto bail;
+    status = sqlite3_create_function(
+        db,
+        "instr_match",
+        2,
+        encs[0].rep,
+        (void *)&encs[0],
+        instr_match_func,
+        0,
+        0);
+    if (status!=SQLITE_OK)
+        goto bail;
+    status = sqlite3_create_module(
+        db, "instr_all", &all_module, (void *)&encs[0]);
+    if (status!=SQLITE_OK)
+        goto bail;
+    status = sqlite3_create_module(
+        db, "split", &split_module, (void *)&encs[0]);
+    if (status!=SQLITE_OK)
+        goto bail;
+    status = sqlite3_create_module(
+        db, "instr_trigram", &gram_module, (void *)&encs[0]);
+#ifdef INSTR_STATS
+    if (status!=SQLITE_OK)
+        goto bail;
+    status = sqlite3_create_module(db, "instr_stats", &stats_module, 0);
+#endif
 
 bail:
     if (status!=SQLITE_OK && status!=SQLITE_OK_LOAD_PERMANENTLY)
@@ -765,3 +9299,80 @@ bail:
     return status;
 }
 
+/*
+ * Kernel selection, and the thread pool's kernel table with it, is
+ * process-wide state that's set up by whichever connection loads
+ * the extension first; later ones only register the functions.
+ */
+static void init_once(void)
+{
+    static int done;
+    sqlite3_mutex *mutex;
+
+    mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_MAIN);
+    sqlite3_mutex_enter(mutex);
+    if (!done) {
+        select_kernels();
+        done = 1;
+    }
+    sqlite3_mutex_leave(mutex);
+}
+
+/*
+ * Named for the library, so that it can live alongside other extensions
+ * built into the same application; sqlite3_extension_init is only there
+ * for loading it as a shared library.
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_instr_init(
+    sqlite3 *db,
+    char **errmsgOut,
+    sqlite3_api_routines const *api)
+{
+    SQLITE_EXTENSION_INIT2(api);
+    init_once();
+    return register_funcs(db, errmsgOut, encs);
+}
+
+#ifndef SQLITE_CORE
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_extension_init(
+    sqlite3 *db,
+    char **errmsgOut,
+    sqlite3_api_routines const *api)
+{
+    int status;
+
+    status = sqlite3_instr_init(db, errmsgOut, api);
+#if INSTR_THREADS>1
+    /*
+     * Only ever loaded with dlopen, so this is where the library can
+     * be pinned and the pool started; the named entry points may be
+     * auto extensions, which can only return SQLITE_OK.
+     */
+    if (status==SQLITE_OK && kernels==&threaded_kernels && pin_pool())
+        status = SQLITE_OK_LOAD_PERMANENTLY;
+#endif
+    return status;
+}
+#endif
+
+/*
+ * For text that's known to be well-formed.
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_instrtrusted_init(
+    sqlite3 *db,
+    char **errmsgOut,
+    sqlite3_api_routines const *api)
+{
+    SQLITE_EXTENSION_INIT2(api);
+    init_once();
+    return register_funcs(db, errmsgOut, trusted_encs);
+}
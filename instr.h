@@ -0,0 +1,69 @@
+/*
+ * Declarations for applications that use instr.c from C: the entry
+ * points, for registering it with sqlite3_auto_extension when it's
+ * built in with SQLITE_CORE, and matchers for binding to instr_match
+ * as parameters:
+ *
+ *   instr_matcher *m;
+ *
+ *   if (instr_matcher_compile(n, needles, 0, &m)==SQLITE_OK)
+ *       sqlite3_bind_pointer(stmt, 2, m, "instr_matcher",
+ *                            instr_matcher_unref);
+ *
+ * The matcher functions allocate with SQLite, and a shared library
+ * only has SQLite's routines once it has been loaded into a connection,
+ * so they can't be called before that; instr_matcher_compile returns
+ * SQLITE_MISUSE if they are.  Built in, they work once SQLite does.
+ */
+
+#ifndef INSTR_H
+#define INSTR_H
+
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct instr_matcher instr_matcher;
+
+int sqlite3_instr_init(
+    sqlite3 *db,
+    char **errmsgOut,
+    sqlite3_api_routines const *api);
+
+int sqlite3_instrtrusted_init(
+    sqlite3 *db,
+    char **errmsgOut,
+    sqlite3_api_routines const *api);
+
+/*
+ * Compile a matcher from an array of needles, with their sizes in
+ * bytes, or a negative size for one that ends at a NUL; sizes itself
+ * may be null if they all do.  Null needles are left out.  The matcher
+ * starts with one reference, which binding it with instr_matcher_unref
+ * as the destructor hands on.
+ */
+int instr_matcher_compile(
+    int nneedles,
+    void const *const *needles,
+    int const *sizes,
+    instr_matcher **matcherOut);
+
+/*
+ * Take another reference to a matcher, to bind it more than once.
+ */
+instr_matcher *instr_matcher_ref(
+    instr_matcher *m);
+
+/*
+ * Drop a reference to a matcher, freeing it with the last one.
+ */
+void instr_matcher_unref(
+    void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * Benchmark for instr.c against SQLite's own instr.
+ *
+ * Times instr and rinstr from the extension, and the built-in instr
+ * on a connection without it, over blobs and UTF-8 and UTF-16 text.
+ * Haystacks run from 64 bytes up to a maximum, 64MB unless given,
+ * of ASCII letters, CJK characters, random bytes (blobs only) or one
+ * letter repeated, which is the worst case for a naive search.  Each
+ * needle, of 1 to 256 characters, ends in a character the haystack
+ * doesn't have, and is put in at the start, in the middle, at the end,
+ * or nowhere.
+ *
+ * The report on standard output has a header line and then a line
+ * of tab-separated fields for each measurement:
+ *
+ *   function impl mode alphabet needle haystack hit calls ns_per_call
+ *   gb_per_s position
+ *
+ * where needle is in characters, haystack in bytes, gb_per_s counts
+ * the bytes a search has to get through to the match, or all of them
+ * for a miss, and position is the result, checked against where the
+ * needle was put.  It isn't part of tests/run.sh; from the top
+ * directory,
+ *
+ *   cc -O2 -o bench tests/bench.c -lsqlite3
+ *   ./bench [max haystack bytes [substring of function/impl/mode/alphabet]]
+ */
+
+#define SQLITE_CORE 1
+#include "../instr.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define MAXSTACK    (64<<20)
+#define MINTIME     0.02
+
+#define MODE_BLOB   0
+#define MODE_UTF8   1
+#define MODE_UTF16  2
+
+static char const *const modes[] = {"blob", "utf8", "utf16"};
+
+typedef struct alphabet {
+    char const *name;
+    unsigned int first;
+    unsigned int count;
+    unsigned int missing;
+    int blobonly;
+} alphabet;
+
+static alphabet const alphabets[] = {
+    {"ascii", 'a', 26, '#', 0},
+    {"cjk", 0x4E00, 256, 0x9FA0, 0},
+    {"binary", 0, 255, 255, 1},
+    {"periodic", 'a', 1, 'b', 0}
+};
+
+static char const *const hits[] = {"start", "middle", "end", "miss"};
+
+static int const needles[] = {1, 4, 16, 64, 256};
+
+static int const stacks[] = {64, 4<<10, 256<<10, 16<<20, 64<<20};
+
+static unsigned long long seed = 1;
+
+static unsigned int rnd(
+    unsigned int n)
+{
+    seed = seed*6364136223846793005ULL+1442695040888963407ULL;
+    return (unsigned int)(seed>>33)%n;
+}
+
+/*
+ * Every character of an alphabet takes the same number of bytes, so
+ * a needle can be put in at any character without breaking the text.
+ */
+static int put(
+    unsigned int c,
+    int mode,
+    int binary,
+    unsigned char *out)
+{
+    if (binary) {
+        out[0] = c;
+        return 1;
+    } else if (mode==MODE_UTF16) {
+        out[0] = c&0xFF;
+        out[1] = c>>8;
+        return 2;
+    } else if (c<0x80) {
+        out[0] = c;
+        return 1;
+    }
+    out[0] = 0xE0|c>>12;
+    out[1] = 0x80|(c>>6&0x3F);
+    out[2] = 0x80|(c&0x3F);
+    return 3;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+/*
+ * Run a query until it has taken long enough to time, and return the
+ * seconds per call.
+ */
+static double time_query(
+    sqlite3 *db,
+    char const *sql,
+    int mode,
+    unsigned char const *stack,
+    sqlite3_int64 stacksize,
+    unsigned char const *needle,
+    int needlesize,
+    sqlite3_int64 *callsOut,
+    sqlite3_int64 *resultOut)
+{
+    sqlite3_stmt *stmt;
+    sqlite3_int64 calls;
+    double start, elapsed;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0)!=SQLITE_OK) {
+        fprintf(stderr, "can't prepare %s: %s\n", sql, sqlite3_errmsg(db));
+        exit(2);
+    }
+    if (mode==MODE_BLOB) {
+        sqlite3_bind_blob64(stmt, 1, stack, stacksize, SQLITE_STATIC);
+        sqlite3_bind_blob64(stmt, 2, needle, needlesize, SQLITE_STATIC);
+    } else {
+        unsigned char enc;
+
+        enc = mode==MODE_UTF8 ? SQLITE_UTF8 : SQLITE_UTF16LE;
+        sqlite3_bind_text64(stmt, 1, (char const *)stack, stacksize,
+                            SQLITE_STATIC, enc);
+        sqlite3_bind_text64(stmt, 2, (char const *)needle, needlesize,
+                            SQLITE_STATIC, enc);
+    }
+    calls = 0;
+    start = now();
+    do {
+        if (sqlite3_step(stmt)!=SQLITE_ROW) {
+            fprintf(stderr, "%s: %s\n", sql, sqlite3_errmsg(db));
+            exit(2);
+        }
+        *resultOut = sqlite3_column_int64(stmt, 0);
+        sqlite3_reset(stmt);
+        calls++;
+        elapsed = now()-start;
+    } while (elapsed<MINTIME);
+    sqlite3_finalize(stmt);
+    *callsOut = calls;
+    return elapsed/calls;
+}
+
+static sqlite3 *open_db(
+    int mode,
+    int extension)
+{
+    sqlite3 *db;
+    char *errmsg = 0;
+
+    if (sqlite3_open(":memory:", &db)!=SQLITE_OK)
+        exit(2);
+    if (mode==MODE_UTF16)
+        sqlite3_exec(db, "PRAGMA encoding='UTF-16le'", 0, 0, 0);
+    if (extension && sqlite3_instr_init(db, &errmsg, 0)!=SQLITE_OK) {
+        fprintf(stderr, "can't load instr: %s\n", errmsg);
+        exit(2);
+    }
+    return db;
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+    static char const *const sqls[] = {
+        "SELECT instr(?1, ?2)",
+        "SELECT instr(?1, ?2)",
+        "SELECT rinstr(?1, ?2)"
+    };
+    static char const *const funcs[] = {"instr", "instr", "rinstr"};
+    static char const *const impls[] = {"ext", "core", "ext"};
+    unsigned char *stack, needle[256*3], saved[256*3];
+    sqlite3 *dbs[3][2];
+    sqlite3_int64 maxstack, calls, result, want, covered;
+    char const *filter;
+    char label[64];
+    int mode, ax, sx, size, nx, hx, fx, width, chars, length, at, needlesize;
+    int failures, ix;
+    double seconds;
+
+    maxstack = argc>1 ? atoll(argv[1]) : MAXSTACK;
+    filter = argc>2 ? argv[2] : 0;
+    stack = malloc(maxstack+16);
+    if (!stack)
+        exit(2);
+    for (mode = 0; mode<3; mode++) {
+        dbs[mode][0] = open_db(mode, 1);
+        dbs[mode][1] = open_db(mode, 0);
+    }
+    printf("function\timpl\tmode\talphabet\tneedle\thaystack\thit\tcalls"
+           "\tns_per_call\tgb_per_s\tposition\n");
+    failures = 0;
+    for (mode = 0; mode<3; mode++) {
+        for (ax = 0; ax<(int)(sizeof alphabets/sizeof alphabets[0]); ax++) {
+            alphabet const *a = &alphabets[ax];
+
+            if (a->blobonly && mode!=MODE_BLOB)
+                continue;
+            width = put(a->first, mode, a->blobonly, stack);
+            for (sx = 0; sx<5 && stacks[sx]<=maxstack; sx++) {
+                chars = stacks[sx]/width;
+                size = 0;
+                for (ix = 0; ix<chars; ix++) {
+                    size += put(a->first+rnd(a->count), mode, a->blobonly,
+                                stack+size);
+                }
+                for (nx = 0; nx<5; nx++) {
+                    length = needles[nx];
+                    if (length>chars)
+                        continue;
+                    needlesize = 0;
+                    for (ix = 0; ix<length-1; ix++) {
+                        needlesize += put(a->first+rnd(a->count), mode,
+                                          a->blobonly, needle+needlesize);
+                    }
+                    needlesize += put(a->missing, mode, a->blobonly,
+                                      needle+needlesize);
+                    for (hx = 0; hx<4; hx++) {
+                        at = hx==0 ? 0 : hx==1 ? (chars-length)/2
+                            : chars-length;
+                        if (hx<3) {
+                            memcpy(saved, stack+(sqlite3_int64)at*width,
+                                   needlesize);
+                            memcpy(stack+(sqlite3_int64)at*width, needle,
+                                   needlesize);
+                        }
+                        for (fx = 0; fx<3; fx++) {
+                            sprintf(label, "%s/%s/%s/%s", funcs[fx],
+                                    impls[fx], modes[mode], a->name);
+                            if (filter && !strstr(label, filter))
+                                continue;
+                            seconds = time_query(
+                                dbs[mode][fx==1], sqls[fx], mode,
+                                stack, size, needle, needlesize,
+                                &calls, &result);
+                            want = hx==3 ? 0
+                                : mode==MODE_BLOB ? (sqlite3_int64)at*width+1
+                                : at+1;
+                            covered = hx==3 ? size
+                                : fx<2 ? (sqlite3_int64)at*width+needlesize
+                                : size-(sqlite3_int64)at*width;
+                            printf("%s\t%s\t%s\t%s\t%d\t%d\t%s\t%lld"
+                                   "\t%.1f\t%.3f\t%lld%s\n",
+                                   funcs[fx], impls[fx], modes[mode],
+                                   a->name, length, size, hits[hx],
+                                   (long long)calls, seconds*1e9,
+                                   covered/seconds*1e-9, (long long)result,
+                                   result==want ? "" : "\tWRONG");
+                            fflush(stdout);
+                            if (result!=want)
+                                failures++;
+                        }
+                        if (hx<3) {
+                            memcpy(stack+(sqlite3_int64)at*width, saved,
+                                   needlesize);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return failures!=0;
+}
@@ -0,0 +1,1071 @@
+/*
+ * Differential tests for instr.c.
+ *
+ * Random haystacks and needles, as blobs and as text in each of the
+ * three encodings, are searched with every kernel set this CPU can run
+ * and checked against the naive searches below.  Well-formed text must
+ * give the reference answer in all three encodings, through the plain
+ * entry point and the trusted one alike.  Malformed text has no reference,
+ * so it must give the same answer, or the same error, with every kernel
+ * set, and instr_any must agree with instr on each of its needles.
+ *
+ * tests/run.sh builds and runs this; by hand, from the top directory,
+ *
+ *   cc -O2 -o differential tests/differential.c -lsqlite3
+ *   ./differential [cases [seed]]
+ *
+ * Built with INSTR_THREADS, it runs every kernel set threaded too.
+ */
+
+#define SQLITE_CORE 1
+#include "../instr.c"
+
+#include <stdio.h>
+
+#define MAXSTACK    40000
+#define MAXNEEDLE   96
+#define NCONNS      6
+
+typedef unsigned int sym;
+
+/*
+ * A haystack or needle: bytes for blobs, code points for well-formed
+ * text, and bytes or code units, as they'll be stored, for raw text.
+ */
+typedef struct str {
+    sym *s;
+    int n;
+} str;
+
+#define KIND_BLOB   0
+#define KIND_TEXT   1
+#define KIND_RAW8   2
+#define KIND_RAW16  3
+
+typedef struct conn {
+    char const *name;
+    sqlite3 *db;
+    int enc;
+    int trusted;
+} conn;
+
+static conn conns[NCONNS] = {
+    {"utf8", 0, SQLITE_UTF8, 0},
+    {"utf16le", 0, SQLITE_UTF16LE, 0},
+    {"utf16be", 0, SQLITE_UTF16BE, 0},
+    {"trusted utf8", 0, SQLITE_UTF8, 1},
+    {"trusted utf16le", 0, SQLITE_UTF16LE, 1},
+    {"trusted utf16be", 0, SQLITE_UTF16BE, 1}
+};
+
+typedef struct kset {
+    char const *name;
+    kernelset const *set;
+} kset;
+
+static kset ksets[8];
+static int nksets;
+
+static unsigned long long seed;
+static long failures;
+
+static unsigned int rnd(
+    unsigned int n)
+{
+    seed ^= seed<<13;
+    seed ^= seed>>7;
+    seed ^= seed<<17;
+    return n ? (unsigned int)(seed>>11)%n : 0;
+}
+
+static void find_kernels(void)
+{
+    ksets[nksets].name = "scalar";
+    ksets[nksets++].set = &scalar_kernels;
+#if HAVE_X86 && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        ksets[nksets].name = "sse2";
+        ksets[nksets++].set = &sse2_kernels;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        ksets[nksets].name = "avx2";
+        ksets[nksets++].set = &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("avx512bw")) {
+        ksets[nksets].name = "avx512";
+        ksets[nksets++].set = &avx512_kernels;
+    }
+#elif HAVE_NEON
+    ksets[nksets].name = "neon";
+    ksets[nksets++].set = &neon_kernels;
+#endif
+}
+
+static void use_kernels(
+    kernelset const *set)
+{
+#if INSTR_THREADS>1
+    kernels = threaded(set);
+#else
+    kernels = set;
+#endif
+}
+
+/*
+ * Encoding
+ */
+
+static int put_utf8(
+    sym cp,
+    unsigned char *out)
+{
+    if (cp<0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp<0x800) {
+        out[0] = 0xC0|cp>>6;
+        out[1] = 0x80|(cp&0x3F);
+        return 2;
+    }
+    if (cp<0x10000) {
+        out[0] = 0xE0|cp>>12;
+        out[1] = 0x80|(cp>>6&0x3F);
+        out[2] = 0x80|(cp&0x3F);
+        return 3;
+    }
+    out[0] = 0xF0|cp>>18;
+    out[1] = 0x80|(cp>>12&0x3F);
+    out[2] = 0x80|(cp>>6&0x3F);
+    out[3] = 0x80|(cp&0x3F);
+    return 4;
+}
+
+static int put_unit(
+    unsigned int unit,
+    int enc,
+    unsigned char *out)
+{
+    if (enc==SQLITE_UTF16BE) {
+        out[0] = unit>>8;
+        out[1] = unit&0xFF;
+    } else {
+        out[0] = unit&0xFF;
+        out[1] = unit>>8;
+    }
+    return 2;
+}
+
+/*
+ * The bytes to bind for a string of the given kind in an encoding.
+ */
+static int encode(
+    str const *x,
+    int kind,
+    int enc,
+    unsigned char *out)
+{
+    int ix, len;
+
+    len = 0;
+    for (ix = 0; ix<x->n; ix++) {
+        sym c = x->s[ix];
+
+        if (kind==KIND_BLOB || kind==KIND_RAW8) {
+            out[len++] = c;
+        } else if (kind==KIND_RAW16) {
+            len += put_unit(c, enc, out+len);
+        } else if (enc==SQLITE_UTF8) {
+            len += put_utf8(c, out+len);
+        } else if (c>=0x10000) {
+            len += put_unit(0xD800+((c-0x10000)>>10), enc, out+len);
+            len += put_unit(0xDC00+(c&0x3FF), enc, out+len);
+        } else {
+            len += put_unit(c, enc, out+len);
+        }
+    }
+    return len;
+}
+
+/*
+ * Results are compared as strings: one line per row with its columns,
+ * and text shown as the hex of its UTF-8 form.
+ */
+
+typedef struct out {
+    char buf[1<<20];
+    size_t len;
+} out;
+
+static void out_add(
+    out *o,
+    char const *fmt,
+    ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (o->len<sizeof o->buf)
+        o->len += vsnprintf(o->buf+o->len, sizeof o->buf-o->len, fmt, ap);
+    if (o->len>sizeof o->buf)
+        o->len = sizeof o->buf;
+    va_end(ap);
+}
+
+static void out_hex(
+    out *o,
+    unsigned char const *data,
+    int size)
+{
+    int ix;
+
+    for (ix = 0; ix<size; ix++) {
+        out_add(o, "%02x", data[ix]);
+    }
+}
+
+/*
+ * The expected form of a text or blob result from the reference.
+ */
+static void out_str(
+    out *o,
+    str const *x,
+    int blob)
+{
+    static unsigned char buf[MAXSTACK*8];
+    int len;
+
+    len = encode(x, blob ? KIND_BLOB : KIND_TEXT, SQLITE_UTF8, buf);
+    out_add(o, blob ? "x'" : "'");
+    out_hex(o, buf, len);
+    out_add(o, "'");
+}
+
+typedef struct arg {
+    int type;
+    str const *x;
+    int kind;
+    sqlite3_int64 i;
+} arg;
+
+static arg arg_str(
+    str const *x,
+    int kind)
+{
+    arg a;
+
+    a.type = kind==KIND_BLOB ? SQLITE_BLOB : SQLITE_TEXT;
+    a.x = x;
+    a.kind = kind;
+    a.i = 0;
+    return a;
+}
+
+static arg arg_int(
+    sqlite3_int64 i)
+{
+    arg a;
+
+    a.type = SQLITE_INTEGER;
+    a.x = 0;
+    a.kind = 0;
+    a.i = i;
+    return a;
+}
+
+static void run(
+    conn const *c,
+    char const *sql,
+    arg const *args,
+    int nargs,
+    out *o)
+{
+    static unsigned char buf[4][MAXSTACK*4];
+    sqlite3_stmt *stmt;
+    int ix, col, status, len;
+
+    o->len = 0;
+    if (sqlite3_prepare_v2(c->db, sql, -1, &stmt, 0)!=SQLITE_OK) {
+        fprintf(stderr, "can't prepare %s: %s\n", sql, sqlite3_errmsg(c->db));
+        exit(2);
+    }
+    for (ix = 0; ix<nargs; ix++) {
+        switch (args[ix].type) {
+        case SQLITE_NULL:
+            sqlite3_bind_null(stmt, ix+1);
+            break;
+        case SQLITE_INTEGER:
+            sqlite3_bind_int64(stmt, ix+1, args[ix].i);
+            break;
+        case SQLITE_BLOB:
+            len = encode(args[ix].x, KIND_BLOB, c->enc, buf[ix]);
+            sqlite3_bind_blob(stmt, ix+1, buf[ix], len, SQLITE_STATIC);
+            break;
+        default:
+            len = encode(args[ix].x, args[ix].kind, c->enc, buf[ix]);
+            sqlite3_bind_text64(stmt, ix+1, (char const *)buf[ix], len,
+                                SQLITE_STATIC, c->enc);
+            break;
+        }
+    }
+    while ((status = sqlite3_step(stmt))==SQLITE_ROW) {
+        for (col = 0; col<sqlite3_column_count(stmt); col++) {
+            if (col>0)
+                out_add(o, " ");
+            switch (sqlite3_column_type(stmt, col)) {
+            case SQLITE_NULL:
+                out_add(o, "NULL");
+                break;
+            case SQLITE_INTEGER:
+                out_add(o, "%lld", sqlite3_column_int64(stmt, col));
+                break;
+            case SQLITE_BLOB:
+                out_add(o, "x'");
+                out_hex(o, sqlite3_column_blob(stmt, col),
+                        sqlite3_column_bytes(stmt, col));
+                out_add(o, "'");
+                break;
+            default:
+                out_add(o, "'");
+                out_hex(o, sqlite3_column_text(stmt, col),
+                        sqlite3_column_bytes(stmt, col));
+                out_add(o, "'");
+                break;
+            }
+        }
+        out_add(o, "\n");
+    }
+    if (status!=SQLITE_DONE)
+        out_add(o, "error: %s\n", sqlite3_errmsg(c->db));
+    sqlite3_finalize(stmt);
+}
+
+/*
+ * The reference searches.  Positions count from 1, in symbols.
+ */
+
+static sym fold(
+    sym c,
+    int blob)
+{
+    return blob ? ASCII_FOLD(c) : fold_codepoint(c);
+}
+
+static int match_at(
+    str const *h,
+    str const *n,
+    int pos,
+    int nocase,
+    int blob)
+{
+    int ix;
+
+    if (pos<0 || pos+n->n>h->n)
+        return 0;
+    for (ix = 0; ix<n->n; ix++) {
+        sym a = h->s[pos+ix], b = n->s[ix];
+
+        if (nocase ? fold(a, blob)!=fold(b, blob) : a!=b)
+            return 0;
+    }
+    return 1;
+}
+
+static sqlite3_int64 ref_instr(
+    str const *h,
+    str const *n,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence,
+    int nocase,
+    int blob)
+{
+    sqlite3_int64 pos;
+
+    if (start<1)
+        start = 1;
+    if (start>h->n+1)
+        return 0;
+    if (n->n==0) {
+        start += occurrence-1;
+        return start<=h->n+1 ? start : 0;
+    }
+    if (start>h->n)
+        return 0;
+    for (pos = start-1; pos+n->n<=h->n; pos++) {
+        if (match_at(h, n, (int)pos, nocase, blob) && --occurrence==0)
+            return pos+1;
+    }
+    return 0;
+}
+
+static sqlite3_int64 ref_rinstr(
+    str const *h,
+    str const *n,
+    sqlite3_int64 start,
+    sqlite3_int64 occurrence,
+    int nocase,
+    int blob)
+{
+    sqlite3_int64 pos;
+
+    if (start<=0 || n->n>h->n)
+        return 0;
+    if (n->n==0) {
+        pos = start<h->n+1 ? start : h->n+1;
+        return pos>=occurrence ? pos+1-occurrence : 0;
+    }
+    pos = h->n-n->n;
+    if (start-1<pos)
+        pos = start-1;
+    for (; pos>=0; pos--) {
+        if (match_at(h, n, (int)pos, nocase, blob) && --occurrence==0)
+            return pos+1;
+    }
+    return 0;
+}
+
+static sqlite3_int64 ref_count(
+    str const *h,
+    str const *n,
+    int overlapping)
+{
+    sqlite3_int64 count;
+    int pos;
+
+    count = 0;
+    if (n->n==0)
+        return 0;
+    for (pos = 0; pos+n->n<=h->n; ) {
+        if (match_at(h, n, pos, 0, 0)) {
+            count++;
+            pos += overlapping ? 1 : n->n;
+        } else {
+            pos++;
+        }
+    }
+    return count;
+}
+
+static void ref_replace(
+    str const *h,
+    str const *n,
+    str const *r,
+    str *result)
+{
+    int pos, ix;
+
+    result->n = 0;
+    for (pos = 0; pos<h->n; ) {
+        if (n->n>0 && match_at(h, n, pos, 0, 0)) {
+            for (ix = 0; ix<r->n; ix++) {
+                result->s[result->n++] = r->s[ix];
+            }
+            pos += n->n;
+        } else {
+            result->s[result->n++] = h->s[pos++];
+        }
+    }
+}
+
+static void ref_all(
+    str const *h,
+    str const *n,
+    int overlapping,
+    out *o)
+{
+    int pos, any;
+
+    o->len = 0;
+    any = 0;
+    if (n->n>0) {
+        for (pos = 0; pos+n->n<=h->n; ) {
+            if (match_at(h, n, pos, 0, 0)) {
+                out_add(o, any ? ",%d" : "'%d", pos+1);
+                any = 1;
+                pos += overlapping ? 1 : n->n;
+            } else {
+                pos++;
+            }
+        }
+    }
+    out_add(o, any ? "'\n" : "NULL\n");
+}
+
+/*
+ * instr_all's positions come back as text from group_concat, which
+ * out_str would show in hex; turn them back into plain digits.
+ */
+static void unhex_line(
+    out *o)
+{
+    size_t ix, len;
+
+    if (o->len<3 || o->buf[0]!='\'')
+        return;
+    len = 1;
+    for (ix = 1; ix+1<o->len && o->buf[ix]!='\''; ix += 2) {
+        unsigned int c;
+
+        sscanf(o->buf+ix, "%2x", &c);
+        o->buf[len++] = (char)c;
+    }
+    o->buf[len++] = '\'';
+    o->buf[len++] = '\n';
+    o->len = len;
+}
+
+/*
+ * Random data
+ */
+
+static sym const alphabet_ab[] = {'a', 'b'};
+static sym const alphabet_ascii[] = {
+    'a', 'b', 'c', 'A', 'B', 'C', 'x', 'X', ' ', '0', 0
+};
+static sym const alphabet_folding[] = {
+    'a', 'A', 0xE9, 0xC9, 0x3B1, 0x391, 0x436, 0x416, 0x561, 0x531,
+    0x1E01, 0x1E00, 0xFF41, 0xFF21, 0x2170, 0x2160
+};
+static sym const alphabet_wide[] = {
+    'a', 'b', 0x4E00, 0x4E01, 0x65E5, 0x1F600, 0x1F601, 0x10000, 0xFFFD,
+    0xDF, 0x800
+};
+static sym const alphabet_bytes[] = {
+    0, 1, 'a', 'A', 0x80, 0xFF
+};
+
+typedef struct alphabet {
+    sym const *syms;
+    int n;
+} alphabet;
+
+static alphabet const text_alphabets[] = {
+    {alphabet_ab, 2},
+    {alphabet_ascii, sizeof alphabet_ascii/sizeof (sym)},
+    {alphabet_folding, sizeof alphabet_folding/sizeof (sym)},
+    {alphabet_wide, sizeof alphabet_wide/sizeof (sym)}
+};
+
+static alphabet const blob_alphabets[] = {
+    {alphabet_ab, 2},
+    {alphabet_ascii, sizeof alphabet_ascii/sizeof (sym)},
+    {alphabet_bytes, sizeof alphabet_bytes/sizeof (sym)},
+    {0, 256}
+};
+
+static sym pick(
+    alphabet const *a)
+{
+    return a->syms ? a->syms[rnd(a->n)] : rnd(a->n);
+}
+
+static int random_length(void)
+{
+    switch (rnd(10)) {
+    case 0:
+        return rnd(20);
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        return rnd(400);
+    case 9:
+        return 5000+rnd(MAXSTACK-5000);
+    default:
+        return rnd(5000);
+    }
+}
+
+/*
+ * A haystack: random symbols, or a short pattern repeated with
+ * the odd symbol changed, which periodic needles get stuck on.
+ */
+static void random_stack(
+    alphabet const *a,
+    str *h)
+{
+    sym pattern[4];
+    int ix, plen;
+
+    h->n = random_length();
+    if (rnd(3)) {
+        for (ix = 0; ix<h->n; ix++) {
+            h->s[ix] = pick(a);
+        }
+        return;
+    }
+    plen = 1+rnd(4);
+    for (ix = 0; ix<plen; ix++) {
+        pattern[ix] = pick(a);
+    }
+    for (ix = 0; ix<h->n; ix++) {
+        h->s[ix] = rnd(200) ? pattern[ix%plen] : pick(a);
+    }
+}
+
+/*
+ * A needle: part of the haystack, perhaps with its case changed,
+ * random symbols, or a periodic one with its last symbol changed.
+ */
+static void random_needle(
+    alphabet const *a,
+    str const *h,
+    str *n,
+    int blob)
+{
+    int ix, start, plen;
+    sym pattern[4];
+
+    switch (rnd(3)) {
+    case 0:
+        n->n = rnd(MAXNEEDLE);
+        if (n->n>h->n)
+            n->n = h->n;
+        start = rnd(h->n-n->n+1);
+        for (ix = 0; ix<n->n; ix++) {
+            sym c = h->s[start+ix];
+
+            if (!rnd(4)) {
+                if (blob && c<0x80 && (c|0x20)>='a' && (c|0x20)<='z') {
+                    c ^= 0x20;
+                } else if (!blob) {
+                    c = fold(c, 0);
+                }
+            }
+            n->s[ix] = c;
+        }
+        break;
+    case 1:
+        n->n = rnd(4) ? rnd(12) : rnd(MAXNEEDLE);
+        for (ix = 0; ix<n->n; ix++) {
+            n->s[ix] = pick(a);
+        }
+        break;
+    default:
+        n->n = 8+rnd(MAXNEEDLE-8);
+        plen = 1+rnd(4);
+        for (ix = 0; ix<plen; ix++) {
+            pattern[ix] = pick(a);
+        }
+        for (ix = 0; ix<n->n; ix++) {
+            n->s[ix] = pattern[ix%plen];
+        }
+        if (rnd(2))
+            n->s[n->n-1] = pick(a);
+        break;
+    }
+}
+
+static sqlite3_int64 random_start(
+    str const *h)
+{
+    switch (rnd(6)) {
+    case 0:
+        return (sqlite3_int64)rnd(4)-1;
+    case 1:
+        return h->n+(sqlite3_int64)rnd(4)-1;
+    case 2:
+        return 0x7FFFFFFFFFFFFFFFLL;
+    default:
+        return 1+rnd(h->n+2);
+    }
+}
+
+/*
+ * Raw text: random bytes or code units, leaning towards the ones that
+ * make malformed sequences, or well-formed text with some of it mangled.
+ */
+static void random_raw(
+    int kind,
+    str *h)
+{
+    static sym const bytes8[] = {
+        'a', 'b', 0x80, 0xBF, 0xC3, 0xA9, 0xE4, 0xB8, 0xF0, 0x9F, 0xC0, 0xFF
+    };
+    static sym const units16[] = {
+        'a', 'b', 0xD800, 0xDBFF, 0xDC00, 0xDFFF, 0x4E00, 0xE9, 0xFFFF
+    };
+    int ix;
+
+    h->n = random_length();
+    for (ix = 0; ix<h->n; ix++) {
+        if (kind==KIND_RAW8) {
+            h->s[ix] = rnd(2) ? bytes8[rnd(sizeof bytes8/sizeof (sym))]
+                : rnd(256);
+        } else {
+            h->s[ix] = units16[rnd(sizeof units16/sizeof (sym))];
+        }
+    }
+}
+
+static void random_raw_needle(
+    int kind,
+    str const *h,
+    str *n)
+{
+    int ix, start;
+
+    if (rnd(3)) {
+        n->n = rnd(40);
+        if (n->n>h->n)
+            n->n = h->n;
+        start = rnd(h->n-n->n+1);
+        for (ix = 0; ix<n->n; ix++) {
+            n->s[ix] = h->s[start+ix];
+        }
+    } else {
+        random_raw(kind, n);
+        if (n->n>40)
+            n->n = rnd(40);
+    }
+}
+
+/*
+ * Checking
+ */
+
+static void report(
+    char const *what,
+    conn const *c,
+    char const *kname,
+    char const *sql,
+    out const *got,
+    out const *want,
+    unsigned long long caseseed)
+{
+    size_t at;
+
+    failures++;
+    if (failures>20)
+        return;
+    for (at = 0; at<got->len && at<want->len; at++) {
+        if (got->buf[at]!=want->buf[at])
+            break;
+    }
+    at = at>40 ? at-40 : 0;
+    fprintf(stderr, "FAIL %s: %s, %s kernels, case seed %llu\n  %s\n"
+            "  got:  %s%.*s  want: %s%.*s",
+            what, c->name, kname, caseseed, sql,
+            at ? "..." : "", (int)(got->len-at>120 ? 120 : got->len-at),
+            got->buf+at,
+            at ? "..." : "", (int)(want->len-at>120 ? 120 : want->len-at),
+            want->buf+at);
+}
+
+static void want_int(
+    out *o,
+    sqlite3_int64 value)
+{
+    o->len = 0;
+    out_add(o, "%lld\n", value);
+}
+
+typedef struct testcase {
+    int kind;
+    str h;
+    str n[3];
+    str r;
+    sqlite3_int64 start;
+    sqlite3_int64 occurrence;
+    int overlapping;
+} testcase;
+
+#define NQUERIES 16
+
+static char const *const queries[NQUERIES] = {
+    "SELECT instr(?1, ?2)",
+    "SELECT instr(?1, ?2, ?3)",
+    "SELECT instr(?1, ?2, ?3, ?4)",
+    "SELECT rinstr(?1, ?2)",
+    "SELECT rinstr(?1, ?2, ?3)",
+    "SELECT rinstr(?1, ?2, ?3, ?4)",
+    "SELECT instr_nocase(?1, ?2, ?3, ?4)",
+    "SELECT rinstr_nocase(?1, ?2, ?3, ?4)",
+    "SELECT contains(?1, ?2)",
+    "SELECT instr_count(?1, ?2, ?3)",
+    "SELECT instr_any(?1, ?2, ?3, ?4)",
+    "SELECT instr_which(?1, ?2, ?3, ?4)",
+    "SELECT replace_all(?1, ?2, ?3)",
+    "SELECT group_concat(position) FROM "
+        "(SELECT position FROM instr_all(?1, ?2, ?3))",
+    "SELECT instr_nocase(?1, ?2)",
+    "SELECT rinstr_nocase(?1, ?2)"
+};
+
+/*
+ * The arguments for a query, and what the reference says it gives,
+ * or nothing if there's no reference for this kind of data.
+ */
+static int setup_query(
+    testcase const *t,
+    int q,
+    arg *args,
+    out *want)
+{
+    static sym space[MAXSTACK*2+MAXNEEDLE];
+    str result;
+    str const *h, *n;
+    sqlite3_int64 pos, best;
+    int blob, nargs, ix, which;
+
+    h = &t->h;
+    n = &t->n[0];
+    blob = t->kind==KIND_BLOB;
+    args[0] = arg_str(h, t->kind);
+    args[1] = arg_str(n, t->kind);
+    nargs = 2;
+    switch (q) {
+    case 0:
+        want_int(want, ref_instr(h, n, 1, 1, 0, blob));
+        break;
+    case 1:
+    case 2:
+        args[nargs++] = arg_int(t->start);
+        if (q==2)
+            args[nargs++] = arg_int(t->occurrence);
+        want_int(want, ref_instr(h, n, t->start,
+                                 q==2 ? t->occurrence : 1, 0, blob));
+        break;
+    case 3:
+        want_int(want, ref_rinstr(h, n, 0x7FFFFFFFFFFFFFFFLL, 1, 0, blob));
+        break;
+    case 4:
+    case 5:
+        args[nargs++] = arg_int(t->start);
+        if (q==5)
+            args[nargs++] = arg_int(t->occurrence);
+        want_int(want, ref_rinstr(h, n, t->start,
+                                  q==5 ? t->occurrence : 1, 0, blob));
+        break;
+    case 6:
+    case 7:
+        args[nargs++] = arg_int(t->start);
+        args[nargs++] = arg_int(t->occurrence);
+        want_int(want, q==6
+                 ? ref_instr(h, n, t->start, t->occurrence, 1, blob)
+                 : ref_rinstr(h, n, t->start, t->occurrence, 1, blob));
+        break;
+    case 8:
+        want_int(want, n->n<=h->n && ref_instr(h, n, 1, 1, 0, blob)!=0);
+        break;
+    case 9:
+        args[nargs++] = arg_int(t->overlapping);
+        want_int(want, ref_count(h, n, t->overlapping));
+        break;
+    case 10:
+    case 11:
+        best = 0;
+        which = 0;
+        for (ix = 0; ix<3; ix++) {
+            args[1+ix] = arg_str(&t->n[ix], t->kind);
+            pos = ref_instr(h, &t->n[ix], 1, 1, 0, blob);
+            if (pos>0 && (best==0 || pos<best)) {
+                best = pos;
+                which = ix+1;
+            }
+        }
+        nargs = 4;
+        want_int(want, q==10 ? best : which);
+        break;
+    case 12:
+        args[nargs++] = arg_str(&t->r, t->kind);
+        result.s = space;
+        ref_replace(h, n, &t->r, &result);
+        want->len = 0;
+        out_str(want, &result, blob);
+        out_add(want, "\n");
+        break;
+    case 13:
+        args[nargs++] = arg_int(t->overlapping);
+        ref_all(h, n, t->overlapping, want);
+        break;
+    case 14:
+        want_int(want, ref_instr(h, n, 1, 1, 1, blob));
+        break;
+    case 15:
+        want_int(want, ref_rinstr(h, n, 0x7FFFFFFFFFFFFFFFLL, 1, 1, blob));
+        break;
+    }
+    return nargs;
+}
+
+static void check_case(
+    testcase const *t,
+    unsigned long long caseseed)
+{
+    static out got, want, first;
+    arg args[4];
+    int q, cx, kx, nargs;
+
+    for (q = 0; q<NQUERIES; q++) {
+        nargs = setup_query(t, q, args, &want);
+        for (cx = 0; cx<NCONNS; cx++) {
+            conn const *c = &conns[cx];
+
+            if (t->kind==KIND_BLOB && c->enc!=SQLITE_UTF8
+                    || t->kind==KIND_RAW8 && c->enc!=SQLITE_UTF8
+                    || t->kind==KIND_RAW16 && c->enc==SQLITE_UTF8)
+                continue;
+            for (kx = 0; kx<nksets; kx++) {
+                use_kernels(ksets[kx].set);
+                run(c, queries[q], args, nargs, &got);
+                if (q==13)
+                    unhex_line(&got);
+                if (t->kind==KIND_BLOB || t->kind==KIND_TEXT) {
+                    if (got.len!=want.len
+                            || memcmp(got.buf, want.buf, got.len))
+                        report("reference", c, ksets[kx].name,
+                               queries[q], &got, &want, caseseed);
+                } else if (kx==0) {
+                    first = got;
+                } else if (got.len!=first.len
+                           || memcmp(got.buf, first.buf, got.len)) {
+                    report("kernels differ", c, ksets[kx].name,
+                           queries[q], &got, &first, caseseed);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * On raw text, instr_any must say what instr says about the needle
+ * that matches first: the smallest position any of them is found at,
+ * or an error if there's none and one of them ran into malformed text.
+ * The trusted entry point promises nothing about malformed text.
+ */
+static void check_any(
+    testcase const *t,
+    unsigned long long caseseed)
+{
+    static out got, want;
+    arg args[4];
+    sqlite3_int64 best, pos;
+    int cx, ix, error;
+
+    for (cx = 0; cx<NCONNS; cx++) {
+        conn const *c = &conns[cx];
+
+        if (c->trusted
+                || t->kind==KIND_RAW8 && c->enc!=SQLITE_UTF8
+                || t->kind==KIND_RAW16 && c->enc==SQLITE_UTF8)
+            continue;
+        args[0] = arg_str(&t->h, t->kind);
+        best = 0;
+        error = 0;
+        for (ix = 0; ix<3; ix++) {
+            args[1] = arg_str(&t->n[ix], t->kind);
+            run(c, "SELECT instr(?1, ?2)", args, 2, &got);
+            if (!strncmp(got.buf, "error", 5)) {
+                error = 1;
+                continue;
+            }
+            pos = strtoll(got.buf, 0, 10);
+            if (pos>0 && (best==0 || pos<best))
+                best = pos;
+        }
+        if (best==0 && error)
+            continue;
+        for (ix = 0; ix<3; ix++) {
+            args[1+ix] = arg_str(&t->n[ix], t->kind);
+        }
+        run(c, "SELECT instr_any(?1, ?2, ?3, ?4)", args, 4, &got);
+        want_int(&want, best);
+        if (got.len!=want.len || memcmp(got.buf, want.buf, got.len))
+            report("instr_any against instr", c, "selected",
+                   "SELECT instr_any(?1, ?2, ?3, ?4)", &got, &want,
+                   caseseed);
+    }
+}
+
+static void random_case(
+    testcase *t)
+{
+    alphabet const *a;
+    int ix;
+
+    t->kind = rnd(10);
+    t->kind = t->kind<3 ? KIND_BLOB : t->kind<8 ? KIND_TEXT
+        : t->kind<9 ? KIND_RAW8 : KIND_RAW16;
+    if (t->kind==KIND_RAW8 || t->kind==KIND_RAW16) {
+        random_raw(t->kind, &t->h);
+        for (ix = 0; ix<3; ix++) {
+            random_raw_needle(t->kind, &t->h, &t->n[ix]);
+        }
+        random_raw_needle(t->kind, &t->h, &t->r);
+    } else {
+        a = t->kind==KIND_BLOB ? &blob_alphabets[rnd(4)]
+            : &text_alphabets[rnd(4)];
+        random_stack(a, &t->h);
+        for (ix = 0; ix<3; ix++) {
+            random_needle(a, &t->h, &t->n[ix], t->kind==KIND_BLOB);
+        }
+        random_needle(a, &t->h, &t->r, t->kind==KIND_BLOB);
+    }
+    t->start = random_start(&t->h);
+    t->occurrence = 1+rnd(3);
+    t->overlapping = rnd(2);
+}
+
+static void open_conns(void)
+{
+    char *errmsg;
+    int cx, status;
+
+    for (cx = 0; cx<NCONNS; cx++) {
+        conn *c = &conns[cx];
+
+        if (sqlite3_open(":memory:", &c->db)!=SQLITE_OK) {
+            fprintf(stderr, "can't open a database\n");
+            exit(2);
+        }
+        sqlite3_exec(c->db,
+                     c->enc==SQLITE_UTF8 ? "PRAGMA encoding='UTF-8'"
+                     : c->enc==SQLITE_UTF16LE ? "PRAGMA encoding='UTF-16le'"
+                     : "PRAGMA encoding='UTF-16be'", 0, 0, 0);
+        errmsg = 0;
+        status = c->trusted ? sqlite3_instrtrusted_init(c->db, &errmsg, 0)
+            : sqlite3_instr_init(c->db, &errmsg, 0);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr, "can't load instr: %s\n", errmsg);
+            exit(2);
+        }
+    }
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+    static sym space[6][MAXSTACK];
+    static testcase t;
+    unsigned long long caseseed;
+    long cases, ix;
+
+    cases = argc>1 ? atol(argv[1]) : 2000;
+    seed = argc>2 ? strtoull(argv[2], 0, 10) : 1;
+    t.h.s = space[0];
+    t.n[0].s = space[1];
+    t.n[1].s = space[2];
+    t.n[2].s = space[3];
+    t.r.s = space[4];
+    open_conns();
+    find_kernels();
+    for (ix = 0; ix<cases; ix++) {
+        caseseed = seed;
+        random_case(&t);
+        check_case(&t, caseseed);
+        if (t.kind==KIND_RAW8 || t.kind==KIND_RAW16)
+            check_any(&t, caseseed);
+    }
+    printf("%ld cases, %d kernel sets%s: %ld failures\n", cases, nksets,
+#if INSTR_THREADS>1
+           " threaded",
+#else
+           "",
+#endif
+           failures);
+    return failures!=0;
+}
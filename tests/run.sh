@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Build and run the tests: the differential driver serially and with
+# threads, and the worst-case timings.  Run from anywhere; builds go
+# in a temporary directory.  CC and CFLAGS are taken from the
+# environment, and extra arguments go to the differential driver
+# as its case count and seed.
+#
+#   tests/run.sh [cases [seed]]
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+
+cc=${CC:-cc}
+cflags=${CFLAGS:--O2}
+libs="-lsqlite3 -lm"
+threads="-DINSTR_THREADS=4 -DINSTR_THREAD_MIN=1024 -pthread"
+
+$cc $cflags -o "$build/differential" "$top/tests/differential.c" $libs
+$cc $cflags $threads -o "$build/differential-threaded" \
+    "$top/tests/differential.c" $libs
+$cc $cflags -DINSTR_STATS -o "$build/differential-stats" \
+    "$top/tests/differential.c" $libs
+$cc $cflags -o "$build/worstcase" "$top/tests/worstcase.c" $libs
+
+status=0
+"$build/differential" "$@" || status=1
+"$build/differential-threaded" "$@" || status=1
+"$build/differential-stats" "$@" || status=1
+"$build/worstcase" || status=1
+exit $status
@@ -0,0 +1,294 @@
+/*
+ * Worst-case timing tests for instr.c.
+ *
+ * Each case searches a long run of one character for a needle that
+ * almost matches everywhere, once with a short needle and once with
+ * a long one.  A search that's linear in the haystack takes about the
+ * same time for both; one that compares the whole needle at every
+ * position takes hundreds of times longer for the long one, and that's
+ * what gets reported.  Cases that enumerate overlapping matches check
+ * that finding the next match doesn't start over from the last one.
+ *
+ * tests/run.sh builds and runs this; by hand, from the top directory,
+ *
+ *   cc -O2 -o worstcase tests/worstcase.c -lsqlite3
+ *   ./worstcase [substring of case names]
+ */
+
+#define SQLITE_CORE 1
+#include "../instr.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define STACKSIZE   (1<<20)
+#define SHORT       8
+#define LONG        4000
+
+/*
+ * How much slower the long needle may be: a factor, and some slack
+ * for timer noise on the fast cases.
+ */
+#define SLOWDOWN    4.0
+#define SLACK       0.05
+
+typedef struct store {
+    char const *name;
+    int enc;
+    int blob;
+} store;
+
+static store const stores[] = {
+    {"blob", SQLITE_UTF8, 1},
+    {"utf8", SQLITE_UTF8, 0},
+    {"utf16le", SQLITE_UTF16LE, 0},
+    {"utf16be", SQLITE_UTF16BE, 0}
+};
+
+/*
+ * A needle is made of characters from a pattern: %c is the haystack
+ * character, repeated for the needle's length, and anything else is
+ * itself.  So "%cb" is a long run of the haystack character and a b.
+ */
+typedef struct wcase {
+    char const *name;
+    char const *sql;
+    unsigned int fill;
+    char const *needle;
+    int nocase;
+} wcase;
+
+static wcase const cases[] = {
+    {"instr prefix", "SELECT instr(?1, ?2)", 'a', "%cb", 0},
+    {"instr suffix", "SELECT instr(?1, ?2)", 'a', "b%c", 0},
+    {"instr prefix2", "SELECT instr(?1, ?2)", 'a', "%cba", 0},
+    {"instr start", "SELECT instr(?1, ?2, 100)", 'a', "%cb", 0},
+    {"rinstr prefix", "SELECT rinstr(?1, ?2)", 'a', "%cb", 0},
+    {"rinstr suffix", "SELECT rinstr(?1, ?2)", 'a', "b%c", 0},
+    {"rinstr prefix2", "SELECT rinstr(?1, ?2)", 'a', "%cba", 0},
+    {"contains", "SELECT contains(?1, ?2)", 'a', "%cba", 0},
+    {"instr_count", "SELECT instr_count(?1, ?2)", 'a', "%cba", 0},
+    {"instr_count overlapping", "SELECT instr_count(?1, ?2, 1)",
+     'a', "%c", 0},
+    {"instr nth", "SELECT instr(?1, ?2, 1, 100000)", 'a', "%c", 0},
+    {"rinstr nth",
+     "SELECT rinstr(?1, ?2, 9223372036854775807, 100000)", 'a', "%c", 0},
+    {"instr_all overlapping",
+     "SELECT count(*) FROM instr_all(?1, ?2, 1)", 'a', "%c", 0},
+    {"instr wide", "SELECT instr(?1, ?2)", 0x4E00, "%cb", 0},
+    {"instr astral", "SELECT instr(?1, ?2)", 0x1F600, "%cb", 0},
+    {"instr_nocase prefix", "SELECT instr_nocase(?1, ?2)",
+     'a', "%cB", 1},
+    {"instr_nocase prefix2", "SELECT instr_nocase(?1, ?2)",
+     'a', "%cBA", 1},
+    {"rinstr_nocase prefix2", "SELECT rinstr_nocase(?1, ?2)",
+     'a', "%cBA", 1},
+    {"instr_nocase accent", "SELECT instr_nocase(?1, ?2)",
+     0xE9, "%cB", 1},
+    {"rinstr_nocase accent", "SELECT rinstr_nocase(?1, ?2)",
+     0xE9, "%cB", 1},
+    {"instr_nocase nth", "SELECT instr_nocase(?1, ?2, 1, 100000)",
+     'a', "%c", 1}
+};
+
+static int put(
+    unsigned int c,
+    store const *s,
+    unsigned char *out)
+{
+    unsigned char *start = out;
+
+    if (s->blob || s->enc==SQLITE_UTF8) {
+        if (c<0x80) {
+            *out++ = c;
+        } else if (c<0x800) {
+            *out++ = 0xC0|c>>6;
+            *out++ = 0x80|(c&0x3F);
+        } else if (c<0x10000) {
+            *out++ = 0xE0|c>>12;
+            *out++ = 0x80|(c>>6&0x3F);
+            *out++ = 0x80|(c&0x3F);
+        } else {
+            *out++ = 0xF0|c>>18;
+            *out++ = 0x80|(c>>12&0x3F);
+            *out++ = 0x80|(c>>6&0x3F);
+            *out++ = 0x80|(c&0x3F);
+        }
+    } else {
+        unsigned int units[2];
+        int n, ix;
+
+        if (c>=0x10000) {
+            units[0] = 0xD800+((c-0x10000)>>10);
+            units[1] = 0xDC00+(c&0x3FF);
+            n = 2;
+        } else {
+            units[0] = c;
+            n = 1;
+        }
+        for (ix = 0; ix<n; ix++) {
+            if (s->enc==SQLITE_UTF16BE) {
+                *out++ = units[ix]>>8;
+                *out++ = units[ix]&0xFF;
+            } else {
+                *out++ = units[ix]&0xFF;
+                *out++ = units[ix]>>8;
+            }
+        }
+    }
+    return out-start;
+}
+
+/*
+ * The nocase cases search a haystack of the upper-case form.
+ */
+static unsigned int upper(
+    unsigned int c)
+{
+    return c=='a' ? 'A' : c==0xE9 ? 0xC9 : c;
+}
+
+static int build_needle(
+    wcase const *w,
+    store const *s,
+    int length,
+    unsigned char *out)
+{
+    char const *p;
+    int size, ix;
+
+    size = 0;
+    for (p = w->needle; *p; p++) {
+        if (p[0]=='%' && p[1]=='c') {
+            for (ix = 0; ix<length; ix++) {
+                size += put(w->fill, s, out+size);
+            }
+            p++;
+        } else {
+            size += put((unsigned char)*p, s, out+size);
+        }
+    }
+    return size;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static double time_query(
+    sqlite3 *db,
+    wcase const *w,
+    store const *s,
+    unsigned char const *stack,
+    int stacksize,
+    unsigned char const *needle,
+    int needlesize,
+    sqlite3_int64 *resultOut)
+{
+    sqlite3_stmt *stmt;
+    double start, elapsed;
+
+    if (sqlite3_prepare_v2(db, w->sql, -1, &stmt, 0)!=SQLITE_OK) {
+        fprintf(stderr, "can't prepare %s: %s\n", w->sql, sqlite3_errmsg(db));
+        exit(2);
+    }
+    if (s->blob) {
+        sqlite3_bind_blob(stmt, 1, stack, stacksize, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, needle, needlesize, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_text64(stmt, 1, (char const *)stack, stacksize,
+                            SQLITE_STATIC, s->enc);
+        sqlite3_bind_text64(stmt, 2, (char const *)needle, needlesize,
+                            SQLITE_STATIC, s->enc);
+    }
+    start = now();
+    if (sqlite3_step(stmt)!=SQLITE_ROW) {
+        fprintf(stderr, "%s: %s\n", w->sql, sqlite3_errmsg(db));
+        exit(2);
+    }
+    elapsed = now()-start;
+    *resultOut = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return elapsed;
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+    static unsigned char stack[STACKSIZE*4], needle[LONG*4+16];
+    sqlite3 *dbs[4][2];
+    char const *filter;
+    int failures, wx, sx, trusted, stacksize, needlesize, ix;
+
+    filter = argc>1 ? argv[1] : 0;
+    for (sx = 0; sx<4; sx++) {
+        for (trusted = 0; trusted<2; trusted++) {
+            sqlite3 *db;
+            char *errmsg = 0;
+
+            if (sqlite3_open(":memory:", &db)!=SQLITE_OK)
+                exit(2);
+            sqlite3_exec(db,
+                         stores[sx].enc==SQLITE_UTF8
+                         ? "PRAGMA encoding='UTF-8'"
+                         : stores[sx].enc==SQLITE_UTF16LE
+                         ? "PRAGMA encoding='UTF-16le'"
+                         : "PRAGMA encoding='UTF-16be'", 0, 0, 0);
+            if ((trusted ? sqlite3_instrtrusted_init(db, &errmsg, 0)
+                 : sqlite3_instr_init(db, &errmsg, 0))!=SQLITE_OK) {
+                fprintf(stderr, "can't load instr: %s\n", errmsg);
+                exit(2);
+            }
+            dbs[sx][trusted] = db;
+        }
+    }
+    failures = 0;
+    for (wx = 0; wx<(int)(sizeof cases/sizeof cases[0]); wx++) {
+        wcase const *w = &cases[wx];
+
+        if (filter && !strstr(w->name, filter))
+            continue;
+        for (sx = 0; sx<4; sx++) {
+            store const *s = &stores[sx];
+
+            for (trusted = 0; trusted<2; trusted++) {
+                double times[2];
+                sqlite3_int64 results[2];
+                int lx;
+
+                if (s->blob && (trusted || w->fill>=0x80))
+                    continue;
+                stacksize = 0;
+                for (ix = 0; ix<STACKSIZE; ix++) {
+                    unsigned int c = w->nocase ? upper(w->fill) : w->fill;
+
+                    stacksize += put(c, s, stack+stacksize);
+                }
+                for (lx = 0; lx<2; lx++) {
+                    needlesize = build_needle(w, s, lx ? LONG : SHORT,
+                                              needle);
+                    times[lx] = time_query(dbs[sx][trusted], w, s,
+                                           stack, stacksize,
+                                           needle, needlesize,
+                                           &results[lx]);
+                }
+                printf("%-26s %-8s %-9s %8.4fs %8.4fs",
+                       w->name, s->name, trusted ? "trusted" : "",
+                       times[0], times[1]);
+                if (times[1]>SLOWDOWN*times[0]+SLACK) {
+                    printf("  FAIL\n");
+                    failures++;
+                } else {
+                    printf("\n");
+                }
+            }
+        }
+    }
+    printf("%d failures\n", failures);
+    return failures!=0;
+}